@@ -20,6 +20,8 @@
 #include <algorithm>
 #include <cctype>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iterator>
@@ -422,6 +424,23 @@ static void read_one_structure(
     line_number);
 }
 
+static void check_energies(const std::vector<Structure>& structures)
+{
+  for (const auto& s : structures) {
+    if (s.energy < -100.0f) {
+      std::cout << "Warning: \n";
+      std::cout << "    There is energy < -100 eV/atom in the data set.\n";
+      std::cout << "    Because we use single precision in NEP training\n";
+      std::cout << "    it means that the reference and calculated energies\n";
+      std::cout << "    might only be accurate up to 1 meV/atom\n";
+      std::cout << "    which can effectively introduce noises.\n";
+      std::cout << "    We suggest you preprocess (using double precision)\n";
+      std::cout << "    your data to make the energies closer to 0." << std::endl;
+      break;
+    }
+  }
+}
+
 static void read_exyz(
   const Parameters& para,
   std::ifstream& input,
@@ -449,20 +468,193 @@ static void read_exyz(
     ++Nc;
   }
   printf("Number of configurations = %d.\n", Nc);
+  check_energies(structures);
+}
 
-  for (const auto& s : structures) {
-    if (s.energy < -100.0f) {
-      std::cout << "Warning: \n";
-      std::cout << "    There is energy < -100 eV/atom in the data set.\n";
-      std::cout << "    Because we use single precision in NEP training\n";
-      std::cout << "    it means that the reference and calculated energies\n";
-      std::cout << "    might only be accurate up to 1 meV/atom\n";
-      std::cout << "    which can effectively introduce noises.\n";
-      std::cout << "    We suggest you preprocess (using double precision)\n";
-      std::cout << "    your data to make the energies closer to 0." << std::endl;
-      break;
+// The binary dataset format written by option 11 of
+// tools/for_coding/for_perioidc_table/nep_data_toolkit.cpp (see that file; version 2)
+struct Binary_Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t real_size; // bytes of a value in the atom columns: 8 or 4
+  uint64_t num_frames;
+  uint64_t num_atoms;
+  uint32_t num_species;
+  uint32_t num_sids;
+  uint64_t frame_offset;
+  uint64_t type_offset;
+  uint64_t column_offset[6]; // x, y, z, fx, fy, fz
+  uint64_t species_offset;
+  uint64_t sid_offset;
+};
+
+struct Binary_Frame {
+  uint64_t atom_offset;
+  int32_t num_atom;
+  int32_t sid_index;
+  uint32_t flags; // 1: sid; 2: virial; 4: stress; 8: energy weight corrected by the toolkit
+  uint32_t reserved;
+  double energy;
+  double energy_weight; // as in the xyz file
+  double weight;
+  double box[9];
+  double virial[9];
+  double stress[9];
+};
+
+static void read_binary_block(std::ifstream& input, uint64_t offset, void* data, uint64_t size)
+{
+  input.seekg(offset);
+  input.read(static_cast<char*>(data), size);
+  if (!input) {
+    PRINT_INPUT_ERROR("The binary dataset is shorter than its header says.");
+  }
+}
+
+// a column of all the atoms as double
+static void read_binary_column(
+  std::ifstream& input, const Binary_Header& header, int k, std::vector<double>& values)
+{
+  values.resize(header.num_atoms);
+  if (header.real_size == sizeof(double)) {
+    read_binary_block(
+      input, header.column_offset[k], values.data(), sizeof(double) * header.num_atoms);
+  } else {
+    std::vector<float> values_float(header.num_atoms);
+    read_binary_block(
+      input, header.column_offset[k], values_float.data(), sizeof(float) * header.num_atoms);
+    std::copy(values_float.begin(), values_float.end(), values.begin());
+  }
+}
+
+// the conversions are those of read_one_structure for train_mode 0
+static void read_binary(
+  const Parameters& para, std::ifstream& input, std::vector<Structure>& structures)
+{
+  Binary_Header header;
+  read_binary_block(input, 0, &header, sizeof(header));
+  if (memcmp(header.magic, "NEPBIN\0\0", 8) != 0 || header.version != 2) {
+    PRINT_INPUT_ERROR("This is not a binary dataset of version 2.");
+  }
+  if (header.real_size != 8 && header.real_size != 4) {
+    PRINT_INPUT_ERROR("The binary dataset should have 8 or 4 bytes per value.");
+  }
+  if (para.train_mode != 0) {
+    PRINT_INPUT_ERROR("A binary dataset has no dipole, polarizability, or temperature.");
+  }
+
+  // the types in nep.in of the species
+  std::vector<int> types(header.num_species, -1);
+  uint64_t offset = header.species_offset;
+  for (uint32_t k = 0; k < header.num_species; ++k) {
+    uint32_t length;
+    read_binary_block(input, offset, &length, sizeof(length));
+    std::string species(length, ' ');
+    read_binary_block(input, offset + sizeof(length), &species[0], length);
+    offset += sizeof(length) + length;
+    for (int n = 0; n < para.elements.size(); ++n) {
+      if (species == para.elements[n]) {
+        types[k] = n;
+      }
+    }
+  }
+
+  std::vector<Binary_Frame> frames(header.num_frames);
+  read_binary_block(
+    input, header.frame_offset, frames.data(), sizeof(Binary_Frame) * header.num_frames);
+  std::vector<uint8_t> type_ids(header.num_atoms);
+  read_binary_block(input, header.type_offset, type_ids.data(), header.num_atoms);
+
+  structures.resize(header.num_frames);
+  for (uint64_t nc = 0; nc < header.num_frames; ++nc) {
+    const Binary_Frame& frame = frames[nc];
+    Structure& structure = structures[nc];
+    if (
+      frame.num_atom < 1 || frame.atom_offset > header.num_atoms ||
+      uint64_t(frame.num_atom) > header.num_atoms - frame.atom_offset) {
+      PRINT_INPUT_ERROR("A frame of the binary dataset is out of range.");
+    }
+    structure.num_atom = frame.num_atom;
+    structure.energy_weight = frame.energy_weight;
+    structure.energy = frame.energy;
+    structure.energy /= structure.num_atom;
+    structure.has_temperature = false;
+    structure.temperature = 0;
+    structure.weight = frame.weight;
+    if (structure.weight <= 0.0f || structure.weight > 100.0f) {
+      PRINT_INPUT_ERROR("Configuration weight should > 0 and <= 100.");
+    }
+    const int transpose_index[9] = {0, 3, 6, 1, 4, 7, 2, 5, 8};
+    for (int m = 0; m < 9; ++m) {
+      structure.box_original[transpose_index[m]] = frame.box[m];
+    }
+    change_box(para, structure);
+
+    const int reduced_index[9] = {0, 3, 5, 3, 1, 4, 5, 4, 2};
+    structure.has_virial = (frame.flags & 2) != 0;
+    if (structure.has_virial) {
+      for (int m = 0; m < 9; ++m) {
+        structure.virial[reduced_index[m]] = frame.virial[m];
+        structure.virial[reduced_index[m]] /= structure.num_atom;
+      }
+    }
+    bool has_stress = (frame.flags & 4) != 0;
+    std::vector<float> virials_from_stress(6);
+    if (has_stress) {
+      float volume = abs(get_det(structure.box_original));
+      for (int m = 0; m < 9; ++m) {
+        virials_from_stress[reduced_index[m]] = frame.stress[m];
+        virials_from_stress[reduced_index[m]] *= -volume / structure.num_atom;
+      }
+    }
+    if (structure.has_virial && has_stress) {
+      const float tol = 1e-3;
+      for (int m = 0; m < 6; ++m) {
+        if (abs(structure.virial[m] - virials_from_stress[m]) > tol) {
+          if (para.prediction == 0) {
+            PRINT_INPUT_ERROR("Virials and stresses for structure are inconsistent!");
+          }
+        }
+      }
+      if (para.prediction == 0) {
+        std::cout
+          << "Structure has both defined virials and stresses. Will use virial information.\n";
+      }
+    } else if (!structure.has_virial && has_stress) {
+      for (int m = 0; m < 6; ++m) {
+        structure.virial[m] = virials_from_stress[m];
+      }
+      structure.has_virial = true;
+    }
+    if (!structure.has_virial) {
+      for (int m = 0; m < 6; ++m) {
+        structure.virial[m] = -1e6;
+      }
+    }
+
+    structure.type.resize(structure.num_atom);
+    for (int na = 0; na < structure.num_atom; ++na) {
+      uint8_t type_id = type_ids[frame.atom_offset + na];
+      if (type_id >= header.num_species || types[type_id] < 0) {
+        PRINT_INPUT_ERROR("There is atom in the binary dataset that is not in nep.in.\n");
+      }
+      structure.type[na] = types[type_id];
     }
   }
+
+  std::vector<double> values;
+  std::vector<float> Structure::*columns[6] = {
+    &Structure::x, &Structure::y, &Structure::z, &Structure::fx, &Structure::fy, &Structure::fz};
+  for (int k = 0; k < 6; ++k) {
+    read_binary_column(input, header, k, values);
+    for (uint64_t nc = 0; nc < header.num_frames; ++nc) {
+      const double* begin = values.data() + frames[nc].atom_offset;
+      (structures[nc].*columns[k]).assign(begin, begin + frames[nc].num_atom);
+    }
+  }
+
+  printf("Number of configurations = %d.\n", int(header.num_frames));
+  check_energies(structures);
 }
 
 static void find_permuted_indices(
@@ -582,8 +774,20 @@ static void reorder(const int num_batches, std::vector<Structure>& structures)
 bool read_structures(bool is_train, Parameters& para, std::vector<Structure>& structures)
 {
   std::ifstream input(is_train ? "train.xyz" : "test.xyz");
-  bool has_test_set = true;
+  // the binary dataset is read only if there is no xyz file
+  std::ifstream input_binary;
   if (!input.is_open()) {
+    input_binary.open(is_train ? "train.nepbin" : "test.nepbin", std::ios::binary);
+  }
+  bool has_test_set = true;
+  if (input_binary.is_open()) {
+    print_line_1();
+    std::string binary_filename = is_train ? "train.nepbin" : "test.nepbin";
+    std::cout << "Started reading " << binary_filename << std::endl;
+    print_line_2();
+    read_binary(para, input_binary, structures);
+    input_binary.close();
+  } else if (!input.is_open()) {
     if (is_train) {
       PRINT_INPUT_ERROR("Failed to open train.xyz.");
     } else {
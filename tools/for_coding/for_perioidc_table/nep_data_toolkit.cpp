@@ -1,6 +1,6 @@
 /*-----------------------------------------------------------------------------------------------100
 compile:
-    g++ -O3 nep_data_toolkit.cpp
+    g++ -O3 -std=c++17 -pthread nep_data_toolkit.cpp
 run:
     ./a.out
 --------------------------------------------------------------------------------------------------*/
@@ -9,18 +9,38 @@ run:
 #include "../../../../NEP_CPU/src/nep.h"
 #endif
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cfloat>
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <limits>
+#include <mutex>
 #include <numeric>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 static std::string remove_spaces_step1(const std::string& line)
 {
@@ -161,7 +181,9 @@ struct Structure {
   bool has_sid = false;
   bool has_virial = false;
   bool has_stress = false;
+  bool has_stress_in_file = false;    // stress= is also kept (in stress) when there is virial=
   double energy_weight = 1.0;
+  double energy_weight_in_file = 1.0; // before the correction for the sid
   double energy;
   double weight;
   double virial[9];
@@ -207,6 +229,8 @@ static void read_force(
       structure.fx[na] = get_double_from_token(tokens[0 + force_offset], __FILE__, __LINE__);
       structure.fy[na] = get_double_from_token(tokens[1 + force_offset], __FILE__, __LINE__);
       structure.fz[na] = get_double_from_token(tokens[2 + force_offset], __FILE__, __LINE__);
+    } else {
+      structure.fx[na] = structure.fy[na] = structure.fz[na] = 0.0;
     }
   }
 }
@@ -318,101 +342,1275 @@ static void read_one_structure(std::ifstream& input, Structure& structure)
     }
   }
 
-  int species_offset = 0;
-  int pos_offset = 0;
-  int force_offset = 0;
-  int num_columns = 0;
-  for (int n = 0; n < tokens.size(); ++n) {
-    const std::string properties_string = "properties=";
-    if (tokens[n].substr(0, properties_string.length()) == properties_string) {
-      std::string line = tokens[n].substr(properties_string.length(), tokens[n].length());
-      for (auto& letter : line) {
-        if (letter == ':') {
-          letter = ' ';
-        }
-      }
-      std::vector<std::string> sub_tokens = get_tokens(line);
-      int species_position = -1;
-      int pos_position = -1;
-      int force_position = -1;
-      for (int k = 0; k < sub_tokens.size() / 3; ++k) {
-        if (sub_tokens[k * 3] == "species") {
-          species_position = k;
-        }
-        if (sub_tokens[k * 3] == "pos") {
-          pos_position = k;
-        }
-        if (sub_tokens[k * 3] == "force" || sub_tokens[k * 3] == "forces") {
-          force_position = k;
-        }
-      }
-      if (species_position < 0) {
-        std::cout << "'species' is missing in properties." << std::endl;
-        exit(1);
-      }
-      if (pos_position < 0) {
-        std::cout << "'pos' is missing in properties." << std::endl;
-        exit(1);
-      }
-      if (force_position < 0) {
-        std::cout << "'force' or 'forces' is missing in properties." << std::endl;
-        exit(1);
-      }
-      for (int k = 0; k < sub_tokens.size() / 3; ++k) {
-        if (k < species_position) {
-          species_offset += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
-        }
-        if (k < pos_position) {
-          pos_offset += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
-        }
-        if (k < force_position) {
-          force_offset += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
-        }
-        num_columns += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
-      }
+  int species_offset = 0;
+  int pos_offset = 0;
+  int force_offset = 0;
+  int num_columns = 0;
+  for (int n = 0; n < tokens.size(); ++n) {
+    const std::string properties_string = "properties=";
+    if (tokens[n].substr(0, properties_string.length()) == properties_string) {
+      std::string line = tokens[n].substr(properties_string.length(), tokens[n].length());
+      for (auto& letter : line) {
+        if (letter == ':') {
+          letter = ' ';
+        }
+      }
+      std::vector<std::string> sub_tokens = get_tokens(line);
+      int species_position = -1;
+      int pos_position = -1;
+      int force_position = -1;
+      for (int k = 0; k < sub_tokens.size() / 3; ++k) {
+        if (sub_tokens[k * 3] == "species") {
+          species_position = k;
+        }
+        if (sub_tokens[k * 3] == "pos") {
+          pos_position = k;
+        }
+        if (sub_tokens[k * 3] == "force" || sub_tokens[k * 3] == "forces") {
+          force_position = k;
+        }
+      }
+      if (species_position < 0) {
+        std::cout << "'species' is missing in properties." << std::endl;
+        exit(1);
+      }
+      if (pos_position < 0) {
+        std::cout << "'pos' is missing in properties." << std::endl;
+        exit(1);
+      }
+      if (force_position < 0) {
+        std::cout << "'force' or 'forces' is missing in properties." << std::endl;
+        exit(1);
+      }
+      for (int k = 0; k < sub_tokens.size() / 3; ++k) {
+        if (k < species_position) {
+          species_offset += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
+        }
+        if (k < pos_position) {
+          pos_offset += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
+        }
+        if (k < force_position) {
+          force_offset += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
+        }
+        num_columns += get_int_from_token(sub_tokens[k * 3 + 2], __FILE__, __LINE__);
+      }
+    }
+  }
+
+  read_force(num_columns, species_offset, pos_offset, force_offset, input, structure);
+}
+
+// The frames are read one at a time into the same Structure, such that the
+// memory does not grow with the size of the dataset. This reader with
+// std::ifstream is the reference for Exyz_Parser below (see option 9).
+struct Structure_Reader {
+  std::string filename;
+  std::ifstream input;
+  int num_structures = 0; // number of frames read so far
+};
+
+static void open_reader(const std::string& inputfile, Structure_Reader& reader)
+{
+  reader.filename = inputfile;
+  reader.input.open(inputfile);
+  if (!reader.input.is_open()) {
+    std::cout << "Failed to open " << inputfile << std::endl;
+    exit(1);
+  }
+  reader.num_structures = 0;
+}
+
+// read the next frame; return false at the end of the file
+static bool read_next(Structure_Reader& reader, Structure& structure)
+{
+  std::vector<std::string> tokens = get_tokens(reader.input);
+  if (tokens.size() == 0) {
+    return false;
+  } else if (tokens.size() > 1) {
+    std::cout << "The first line for each frame should have one value." << std::endl;
+    exit(1);
+  }
+  structure.num_atom = get_int_from_token(tokens[0], __FILE__, __LINE__);
+  if (structure.num_atom < 1) {
+    std::cout << "Number of atoms for each frame should >= 1." << std::endl;
+    exit(1);
+  }
+  structure.sid.clear();
+  structure.has_sid = false;
+  structure.has_virial = false;
+  structure.has_stress = false;
+  structure.energy_weight = 1.0;
+  read_one_structure(reader.input, structure);
+  structure.has_stress_in_file = structure.has_stress;
+  structure.energy_weight_in_file = structure.energy_weight;
+
+  // correct my early mistakes; no side effect
+  if (structure.sid == "" || structure.sid == "\"oc20\"") {
+    structure.sid = "oc20"; // remove the quote
+    structure.energy_weight = 1.0; // energy should be trained for OC20
+  }
+  // correct my early mistakes; no side effect
+  if (structure.sid == "\"spice\"") {
+    structure.sid = "spice"; // remove the quote
+  }
+
+  reader.num_structures++;
+  return true;
+}
+
+// The input file is memory-mapped (read into memory if mmap is not available)
+// and parsed in place: the tokens are std::string_view into the file and the
+// numbers are converted with std::from_chars, such that an atom line does not
+// allocate. Exyz_Parser accepts exactly the inputs of read_next (the frames
+// are the same, bit for bit) and reports the line and the byte offset of an
+// error; inputs for which read_next has undefined behavior are rejected.
+// Unlike read_next, it also parses stress= when there is virial= (as the nep
+// trainer does), such that an invalid stress is an error in both cases.
+struct Mapped_File {
+  const char* data = nullptr;
+  size_t size = 0;
+  bool is_mapped = false;
+};
+
+static void map_file(const std::string& filename, Mapped_File& file)
+{
+#ifdef __linux__
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
+    std::cout << "Failed to open " << filename << std::endl;
+    exit(1);
+  }
+  file.size = file_stat.st_size;
+  if (file.size > 0) {
+    void* data = mmap(nullptr, file.size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (data == MAP_FAILED) {
+      std::cout << "Failed to map " << filename << std::endl;
+      exit(1);
+    }
+    madvise(data, file.size, MADV_SEQUENTIAL);
+    file.data = static_cast<const char*>(data);
+    file.is_mapped = true;
+  }
+  close(fd);
+#else
+  std::ifstream input(filename, std::ios::binary);
+  if (!input.is_open()) {
+    std::cout << "Failed to open " << filename << std::endl;
+    exit(1);
+  }
+  input.seekg(0, std::ios::end);
+  file.size = input.tellg();
+  input.seekg(0, std::ios::beg);
+  char* data = new char[file.size + 1];
+  input.read(data, file.size);
+  file.data = data;
+#endif
+}
+
+static void unmap_file(Mapped_File& file)
+{
+#ifdef __linux__
+  if (file.is_mapped) {
+    munmap(const_cast<char*>(file.data), file.size);
+  }
+#else
+  delete[] file.data;
+#endif
+  file.data = nullptr;
+  file.size = 0;
+  file.is_mapped = false;
+}
+
+struct Exyz_Parser {
+  std::string filename;
+  Mapped_File file;
+  size_t position = 0;                      // byte offset of the next line
+  size_t line_offset = 0;                   // byte offset of the current line
+  int64_t line_number = 0;                  // 1-based number of the current line
+  int num_structures = 0;                   // number of frames read so far
+  std::string comment;                      // the second line without unwanted spaces
+  std::string comment_step1;                // after the first step of remove_spaces
+  std::vector<std::string_view> tokens;     // of the current line
+  std::vector<double> values;               // simple numbers of an atom line
+  std::vector<std::string_view> sub_tokens; // of the properties
+};
+
+static void open_parser(const std::string& inputfile, Exyz_Parser& parser)
+{
+  parser.filename = inputfile;
+  map_file(inputfile, parser.file);
+  parser.position = 0;
+  parser.line_offset = 0;
+  parser.line_number = 0;
+  parser.num_structures = 0;
+}
+
+static void close_parser(Exyz_Parser& parser) { unmap_file(parser.file); }
+
+// an error in the input; thrown by the parser such that a worker thread can keep it for its frame
+struct Parse_Error {
+  std::string message; // with the file, line, and byte offset
+};
+
+[[noreturn]] static void parse_error(
+  const Exyz_Parser& parser, size_t offset, const std::string& message)
+{
+  std::ostringstream text;
+  text << message << "\n";
+  text << "    File:        " << parser.filename << "\n";
+  text << "    Line:        " << parser.line_number << "\n";
+  text << "    Byte offset: " << offset;
+  throw Parse_Error{text.str()};
+}
+
+[[noreturn]] static void report_parse_error(const Parse_Error& error)
+{
+  std::cout << error.message << std::endl;
+  exit(1);
+}
+
+// the next line without '\n' (empty at the end of the file, as std::getline)
+static std::string_view next_line(Exyz_Parser& parser)
+{
+  const char* data = parser.file.data;
+  size_t size = parser.file.size;
+  parser.line_offset = parser.position;
+  parser.line_number++;
+  if (parser.position >= size) {
+    return std::string_view();
+  }
+  const char* begin = data + parser.position;
+  const char* end = static_cast<const char*>(memchr(begin, '\n', size - parser.position));
+  if (end == nullptr) {
+    end = data + size;
+    parser.position = size;
+  } else {
+    parser.position = end - data + 1;
+  }
+  return std::string_view(begin, end - begin);
+}
+
+// the white spaces of std::istream in the "C" locale: ' ' and '\t' to '\r'
+static inline bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+static void split_tokens(std::string_view line, std::vector<std::string_view>& tokens)
+{
+  tokens.clear();
+  const char* p = line.data();
+  const char* end = p + line.size();
+  while (true) {
+    while (p < end && is_space(*p)) {
+      ++p;
+    }
+    if (p == end) {
+      break;
+    }
+    const char* begin = p;
+    while (p < end && !is_space(*p)) {
+      ++p;
+    }
+    tokens.emplace_back(begin, p - begin);
+  }
+}
+
+static inline bool starts_with(std::string_view token, std::string_view prefix)
+{
+  return token.substr(0, prefix.size()) == prefix;
+}
+
+// as std::stoi: an optional sign and at least one digit; the rest is ignored
+static bool parse_int(std::string_view token, int& value)
+{
+  size_t n = 0;
+  bool is_negative = false;
+  if (n < token.size() && (token[n] == '+' || token[n] == '-')) {
+    is_negative = (token[n] == '-');
+    ++n;
+  }
+  if (n == token.size() || token[n] < '0' || token[n] > '9') {
+    return false;
+  }
+  long long magnitude = 0;
+  for (; n < token.size() && token[n] >= '0' && token[n] <= '9'; ++n) {
+    magnitude = magnitude * 10 + (token[n] - '0');
+    if (magnitude > 2147483648LL) {
+      return false;
+    }
+  }
+  long long result = is_negative ? -magnitude : magnitude;
+  if (result > std::numeric_limits<int>::max()) {
+    return false;
+  }
+  value = static_cast<int>(result);
+  return true;
+}
+
+// a number like -123.456 with at most 15 digits is m / 10^k with m and 10^k
+// exact, so one division gives the correctly rounded value (as strtod); the
+// digits are given by scan_simple_double
+static const double powers_of_ten[16] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+struct Simple_Double {
+  uint64_t mantissa = 0;
+  int num_digits = 0;
+  int num_decimals = 0;
+  bool has_point = false;
+  bool is_simple = true;
+};
+
+static inline void scan_simple_double(char c, Simple_Double& number)
+{
+  unsigned digit = static_cast<unsigned char>(c) - '0';
+  if (digit < 10) {
+    number.mantissa = number.mantissa * 10 + digit;
+    number.num_digits++;
+    number.num_decimals += number.has_point;
+  } else if (c == '.' && !number.has_point) {
+    number.has_point = true;
+  } else {
+    number.is_simple = false;
+  }
+}
+
+static inline bool
+get_simple_double(const Simple_Double& number, bool is_negative, double& value)
+{
+  if (!number.is_simple || number.num_digits == 0 || number.num_digits > 15) {
+    return false;
+  }
+  double result = double(number.mantissa) / powers_of_ten[number.num_decimals];
+  value = is_negative ? -result : result;
+  return true;
+}
+
+static inline bool parse_simple_double(const char* p, const char* end, double& value)
+{
+  bool is_negative = (p < end && *p == '-');
+  Simple_Double number;
+  for (p += is_negative; p < end; ++p) {
+    scan_simple_double(*p, number);
+  }
+  return get_simple_double(number, is_negative, value);
+}
+
+// split_tokens for an atom line, with the simple numbers converted on the way
+// (values[k] is NaN if tokens[k] is not a simple number)
+static void split_atom_line(
+  std::string_view line, std::vector<std::string_view>& tokens, std::vector<double>& values)
+{
+  tokens.clear();
+  values.clear();
+  const char* p = line.data();
+  const char* end = p + line.size();
+  while (true) {
+    while (p < end && is_space(*p)) {
+      ++p;
+    }
+    if (p == end) {
+      break;
+    }
+    const char* begin = p;
+    bool is_negative = (*p == '-');
+    Simple_Double number;
+    for (p += is_negative; p < end && !is_space(*p); ++p) {
+      scan_simple_double(*p, number);
+    }
+    tokens.emplace_back(begin, p - begin);
+    double value;
+    if (!get_simple_double(number, is_negative, value)) {
+      value = std::numeric_limits<double>::quiet_NaN();
+    }
+    values.push_back(value);
+  }
+}
+
+// as std::stod: a simple number as above, std::from_chars otherwise, except
+// for a leading '+', hexadecimal numbers, and (for the error of underflow)
+// subnormal results, which go to strtod
+static bool parse_double(std::string_view token, double& value)
+{
+  const char* begin = token.data();
+  const char* end = begin + token.size();
+  if (parse_simple_double(begin, end, value)) {
+    return true;
+  }
+  const char* p = begin;
+  if (p < end && *p == '+') {
+    ++p;
+    if (p < end && (*p == '+' || *p == '-')) {
+      return false;
+    }
+  }
+  const char* digits = (p < end && *p == '-') ? p + 1 : p;
+  bool is_hex = (end - digits >= 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X'));
+  if (!is_hex) {
+    double result;
+    auto [ptr, ec] = std::from_chars(p, end, result);
+    if (ec == std::errc::invalid_argument) {
+      return false;
+    }
+    if (ec == std::errc() && (result == 0.0 || std::abs(result) >= DBL_MIN)) {
+      value = result;
+      return true;
+    }
+  }
+  std::string copy(token);
+  char* copy_end;
+  errno = 0;
+  double result = strtod(copy.c_str(), &copy_end);
+  if (copy_end == copy.c_str() || errno == ERANGE) {
+    return false;
+  }
+  value = result;
+  return true;
+}
+
+static int get_int(const Exyz_Parser& parser, std::string_view token, size_t offset)
+{
+  int value = 0;
+  if (!parse_int(token, value)) {
+    parse_error(parser, offset, "Cannot convert '" + std::string(token) + "' to an integer.");
+  }
+  return value;
+}
+
+static double get_double(const Exyz_Parser& parser, std::string_view token, size_t offset)
+{
+  double value = 0.0;
+  if (!parse_double(token, value)) {
+    parse_error(parser, offset, "Cannot convert '" + std::string(token) + "' to a number.");
+  }
+  return value;
+}
+
+// the number in column k of an atom line split by split_atom_line
+static inline double get_column(const Exyz_Parser& parser, int k)
+{
+  double value = parser.values[k];
+  if (std::isnan(value)) {
+    std::string_view token = parser.tokens[k];
+    value = get_double(parser, token, token.data() - parser.file.data);
+  }
+  return value;
+}
+
+static inline bool is_blank(char c) { return c == ' ' || c == '\t'; }
+
+// the usual case of a second line in which only the letters are to be lowered
+// (no space or tab next to '=', before '"', or after '="', and no '"' first)
+static bool has_no_unwanted_spaces(std::string_view line)
+{
+  const char* begin = line.data();
+  const char* end = begin + line.size();
+  for (const char* p = begin; (p = static_cast<const char*>(memchr(p, '=', end - p))); ++p) {
+    if ((p > begin && is_blank(p[-1])) || (p + 1 < end && is_blank(p[1]))) {
+      return false;
+    }
+  }
+  for (const char* p = begin; (p = static_cast<const char*>(memchr(p, '\"', end - p))); ++p) {
+    if (p == begin || is_blank(p[-1]) || (p[-1] == '=' && p + 1 < end && is_blank(p[1]))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// remove_spaces and the lowering of the tokens (std::tolower in the "C"
+// locale) in read_one_structure: a run of spaces and tabs is removed if it is
+// next to '=', followed by '"', or after a '"' which is after '='
+static void remove_unwanted_spaces(Exyz_Parser& parser, std::string_view line)
+{
+  if (has_no_unwanted_spaces(line)) {
+    std::string& comment = parser.comment;
+    comment.assign(line);
+    for (char& c : comment) {
+      c = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+    return;
+  }
+
+  std::string& step1 = parser.comment_step1;
+  step1.resize(line.size());
+  size_t size1 = 0;
+  for (size_t n = 0; n < line.size();) {
+    if (is_blank(line[n])) {
+      size_t end = n;
+      while (end < line.size() && is_blank(line[end])) {
+        ++end;
+      }
+      bool is_unwanted = (n > 0 && line[n - 1] == '=') || (end < line.size() && line[end] == '=');
+      if (!is_unwanted) {
+        memcpy(&step1[size1], line.data() + n, end - n);
+        size1 += end - n;
+      }
+      n = end;
+    } else {
+      step1[size1++] = line[n++];
+    }
+  }
+
+  if (size1 > 0 && step1[0] == '\"') {
+    parse_error(
+      parser, parser.line_offset, "The second line of the .xyz file should not begin with \".");
+  }
+  std::string& step2 = parser.comment;
+  step2.resize(size1);
+  size_t size2 = 0;
+  for (size_t n = 0; n < size1;) {
+    if (is_blank(step1[n])) {
+      size_t end = n;
+      while (end < size1 && is_blank(step1[end])) {
+        ++end;
+      }
+      bool is_unwanted = (end < size1 && step1[end] == '\"') ||
+                         (n > 1 && step1[n - 1] == '\"' && step1[n - 2] == '=');
+      if (!is_unwanted) {
+        memcpy(&step2[size2], step1.data() + n, end - n);
+        size2 += end - n;
+      }
+      n = end;
+    } else {
+      char c = step1[n++];
+      step2[size2++] = (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+  }
+  step2.resize(size2);
+}
+
+// the 9 numbers of lattice="...", virial="...", or stress="..." at tokens[n]
+static void parse_matrix(
+  const Exyz_Parser& parser, size_t n, std::string_view key, double* matrix)
+{
+  const std::vector<std::string_view>& tokens = parser.tokens;
+  if (n + 8 >= tokens.size() || tokens[n].size() < key.size() + 1) {
+    parse_error(parser, parser.line_offset, "'" + std::string(key) + "' should have 9 numbers.");
+  }
+  for (int m = 0; m < 9; ++m) {
+    std::string_view token = tokens[n + m];
+    if (m == 0) {
+      token.remove_prefix(key.size() + 1);
+    }
+    if (m == 8) {
+      token.remove_suffix(1);
+    }
+    matrix[m] = get_double(parser, token, parser.line_offset);
+  }
+}
+
+// the second line and the atom lines of a frame, as read_one_structure
+static void parse_one_structure(Exyz_Parser& parser, Structure& structure)
+{
+  remove_unwanted_spaces(parser, next_line(parser));
+  std::vector<std::string_view>& tokens = parser.tokens;
+  split_tokens(parser.comment, tokens);
+  size_t offset = parser.line_offset;
+
+  if (tokens.size() == 0) {
+    parse_error(parser, offset, "The second line for each frame should not be empty.");
+  }
+
+  for (const auto& token : tokens) {
+    if (starts_with(token, "sid=")) {
+      structure.has_sid = true;
+      structure.sid = token.substr(4);
+    }
+  }
+
+  // get energy_weight (optional)
+  for (const auto& token : tokens) {
+    if (starts_with(token, "energy_weight=")) {
+      structure.energy_weight = get_double(parser, token.substr(14), offset);
+    }
+  }
+
+  bool has_energy_in_exyz = false;
+  for (const auto& token : tokens) {
+    if (starts_with(token, "energy=")) {
+      has_energy_in_exyz = true;
+      structure.energy = get_double(parser, token.substr(7), offset);
+    }
+  }
+  if (!has_energy_in_exyz) {
+    parse_error(parser, offset, "'energy' is missing in the second line of a frame.");
+  }
+
+  structure.weight = 1.0f;
+  for (const auto& token : tokens) {
+    if (starts_with(token, "weight=")) {
+      structure.weight = get_double(parser, token.substr(7), offset);
+      if (structure.weight <= 0.0f || structure.weight > 100.0f) {
+        parse_error(parser, offset, "Configuration weight should > 0 and <= 100.");
+      }
+    }
+  }
+
+  bool has_lattice_in_exyz = false;
+  for (size_t n = 0; n < tokens.size(); ++n) {
+    if (starts_with(tokens[n], "lattice=")) {
+      has_lattice_in_exyz = true;
+      parse_matrix(parser, n, "lattice=", structure.box);
+    }
+  }
+  if (!has_lattice_in_exyz) {
+    parse_error(parser, offset, "'lattice' is missing in the second line of a frame.");
+  }
+
+  for (size_t n = 0; n < tokens.size(); ++n) {
+    if (starts_with(tokens[n], "virial=")) {
+      structure.has_virial = true;
+      parse_matrix(parser, n, "virial=", structure.virial);
+    }
+  }
+
+  // the stress is only used without virial, but it is kept for the binary dataset
+  for (size_t n = 0; n < tokens.size(); ++n) {
+    if (starts_with(tokens[n], "stress=")) {
+      structure.has_stress_in_file = true;
+      parse_matrix(parser, n, "stress=", structure.stress);
+    }
+  }
+  structure.has_stress = structure.has_stress_in_file && !structure.has_virial;
+
+  // the offsets and the number of columns add up over the properties tokens
+  int species_offset = 0;
+  int pos_offset = 0;
+  int force_offset = 0;
+  int num_columns = 0;
+  std::vector<std::string_view>& sub_tokens = parser.sub_tokens;
+  for (size_t n = 0; n < tokens.size(); ++n) {
+    if (!starts_with(tokens[n], "properties=")) {
+      continue;
+    }
+    std::string_view line = tokens[n].substr(11);
+    sub_tokens.clear();
+    for (size_t begin = 0; begin < line.size();) {
+      size_t end = line.find(':', begin);
+      if (end == std::string_view::npos) {
+        end = line.size();
+      }
+      if (end > begin) {
+        sub_tokens.emplace_back(line.substr(begin, end - begin));
+      }
+      begin = end + 1;
+    }
+    const int num_properties = sub_tokens.size() / 3;
+    int species_position = -1;
+    int pos_position = -1;
+    int force_position = -1;
+    for (int k = 0; k < num_properties; ++k) {
+      if (sub_tokens[k * 3] == "species") {
+        species_position = k;
+      }
+      if (sub_tokens[k * 3] == "pos") {
+        pos_position = k;
+      }
+      if (sub_tokens[k * 3] == "force" || sub_tokens[k * 3] == "forces") {
+        force_position = k;
+      }
+    }
+    if (species_position < 0) {
+      parse_error(parser, offset, "'species' is missing in properties.");
+    }
+    if (pos_position < 0) {
+      parse_error(parser, offset, "'pos' is missing in properties.");
+    }
+    if (force_position < 0) {
+      parse_error(parser, offset, "'force' or 'forces' is missing in properties.");
+    }
+    for (int k = 0; k < num_properties; ++k) {
+      int num_items = get_int(parser, sub_tokens[k * 3 + 2], offset);
+      if (k < species_position) {
+        species_offset += num_items;
+      }
+      if (k < pos_position) {
+        pos_offset += num_items;
+      }
+      if (k < force_position) {
+        force_offset += num_items;
+      }
+      num_columns += num_items;
+    }
+  }
+  bool has_force = (num_columns > 4);
+  if (
+    species_offset < 0 || species_offset >= num_columns || pos_offset < 0 ||
+    pos_offset + 2 >= num_columns ||
+    (has_force && (force_offset < 0 || force_offset + 2 >= num_columns))) {
+    parse_error(parser, offset, "The columns in properties are out of range.");
+  }
+
+  structure.atom_symbol.resize(structure.num_atom);
+  structure.x.resize(structure.num_atom);
+  structure.y.resize(structure.num_atom);
+  structure.z.resize(structure.num_atom);
+  structure.fx.resize(structure.num_atom);
+  structure.fy.resize(structure.num_atom);
+  structure.fz.resize(structure.num_atom);
+
+  std::vector<double>& values = parser.values;
+  for (int na = 0; na < structure.num_atom; ++na) {
+    split_atom_line(next_line(parser), tokens, values);
+    if (int(tokens.size()) != num_columns) {
+      parse_error(
+        parser, parser.line_offset, "Number of items for an atom line mismatches properties.");
+    }
+    structure.atom_symbol[na].assign(tokens[species_offset]);
+    structure.x[na] = get_column(parser, pos_offset + 0);
+    structure.y[na] = get_column(parser, pos_offset + 1);
+    structure.z[na] = get_column(parser, pos_offset + 2);
+    if (has_force) {
+      structure.fx[na] = get_column(parser, force_offset + 0);
+      structure.fy[na] = get_column(parser, force_offset + 1);
+      structure.fz[na] = get_column(parser, force_offset + 2);
+    } else {
+      structure.fx[na] = structure.fy[na] = structure.fz[na] = 0.0;
+    }
+  }
+}
+
+// parse the next frame; return false at the end of the file (as read_next)
+static bool parse_next(Exyz_Parser& parser, Structure& structure)
+{
+  std::vector<std::string_view>& tokens = parser.tokens;
+  split_tokens(next_line(parser), tokens);
+  if (tokens.size() == 0) {
+    return false;
+  } else if (tokens.size() > 1) {
+    parse_error(
+      parser, parser.line_offset, "The first line for each frame should have one value.");
+  }
+  structure.num_atom = get_int(parser, tokens[0], tokens[0].data() - parser.file.data);
+  if (structure.num_atom < 1) {
+    parse_error(parser, parser.line_offset, "Number of atoms for each frame should >= 1.");
+  }
+  structure.sid.clear();
+  structure.has_sid = false;
+  structure.has_virial = false;
+  structure.has_stress = false;
+  structure.has_stress_in_file = false;
+  structure.energy_weight = 1.0;
+  parse_one_structure(parser, structure);
+  structure.energy_weight_in_file = structure.energy_weight;
+
+  // correct my early mistakes; no side effect
+  if (structure.sid == "" || structure.sid == "\"oc20\"") {
+    structure.sid = "oc20"; // remove the quote
+    structure.energy_weight = 1.0; // energy should be trained for OC20
+  }
+  // correct my early mistakes; no side effect
+  if (structure.sid == "\"spice\"") {
+    structure.sid = "spice"; // remove the quote
+  }
+
+  parser.num_structures++;
+  return true;
+}
+
+// Frames are parsed in parallel, one window of frames at a time: the main thread finds the
+// frame boundaries of a window (the line with the number of atoms N and then N + 1 lines), the
+// worker threads parse its frames into preallocated slots while the main thread processes the
+// previous window in order, and the error of a frame is reported when that frame is reached, such
+// that the output and the error are the same as in a serial read. Two windows are in memory.
+static const int window_max_frames = 16384;
+static const size_t window_max_bytes = size_t(1) << 24;
+
+struct Frame_Slot {
+  size_t offset = 0;       // byte offset of the line with the number of atoms
+  size_t size = 0;         // number of bytes up to the end of the last atom line
+  int64_t line_number = 0; // 1-based number of that line
+  Structure structure;
+  bool has_error = false;
+  std::string error;
+};
+
+struct Frame_Window {
+  std::vector<Frame_Slot> slots; // the first num_frames are used; kept between windows
+  int num_frames = 0;
+  bool is_last = false; // the end of the frames (or an error in the scan) is in this window
+};
+
+struct Parser_Pool {
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable finish;
+  Frame_Window* window = nullptr; // the window being parsed
+  std::atomic<int> next{0};       // the next frame to be taken by a worker
+  int generation = 0;             // incremented for each window
+  int num_busy = 0;               // workers still parsing the window
+  bool stop = false;
+};
+
+// a single thread parses the frames serially
+static int get_num_parser_threads()
+{
+  int num_threads = std::thread::hardware_concurrency();
+  return num_threads < 1 ? 1 : num_threads;
+}
+
+// each worker has its own parser state on the same mapped file
+static void run_parser_worker(Parser_Pool& pool, const Exyz_Parser& main_parser)
+{
+  Exyz_Parser parser;
+  parser.filename = main_parser.filename;
+  parser.file = main_parser.file; // not owned
+  int generation = 0;
+  while (true) {
+    Frame_Window* window;
+    {
+      std::unique_lock<std::mutex> lock(pool.mutex);
+      pool.start.wait(lock, [&] { return pool.stop || pool.generation != generation; });
+      if (pool.stop) {
+        return;
+      }
+      generation = pool.generation;
+      window = pool.window;
+    }
+    for (int k = pool.next++; k < window->num_frames; k = pool.next++) {
+      Frame_Slot& slot = window->slots[k];
+      if (slot.has_error) {
+        continue; // found in the scan
+      }
+      parser.position = slot.offset;
+      parser.line_number = slot.line_number - 1;
+      try {
+        parse_next(parser, slot.structure);
+      } catch (const Parse_Error& error) {
+        slot.has_error = true;
+        slot.error = error.message;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(pool.mutex);
+      if (--pool.num_busy == 0) {
+        pool.finish.notify_one();
+      }
+    }
+  }
+}
+
+static void start_pool(Parser_Pool& pool, const Exyz_Parser& parser, int num_threads)
+{
+  for (int n = 0; n < num_threads; ++n) {
+    pool.threads.emplace_back(run_parser_worker, std::ref(pool), std::cref(parser));
+  }
+}
+
+static void stop_pool(Parser_Pool& pool)
+{
+  {
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.stop = true;
+  }
+  pool.start.notify_all();
+  for (std::thread& thread : pool.threads) {
+    thread.join();
+  }
+  pool.threads.clear();
+}
+
+static void start_window(Parser_Pool& pool, Frame_Window& window)
+{
+  std::lock_guard<std::mutex> lock(pool.mutex);
+  pool.window = &window;
+  pool.next = 0;
+  pool.num_busy = pool.threads.size();
+  pool.generation++;
+  pool.start.notify_all();
+}
+
+static void finish_window(Parser_Pool& pool)
+{
+  std::unique_lock<std::mutex> lock(pool.mutex);
+  pool.finish.wait(lock, [&] { return pool.num_busy == 0; });
+}
+
+// find the frames of the next window; the checks of the first line are those of parse_next
+static void scan_window(Exyz_Parser& parser, Frame_Window& window)
+{
+  std::vector<std::string_view>& tokens = parser.tokens;
+  size_t window_begin = parser.position;
+  window.num_frames = 0;
+  window.is_last = false;
+  while (window.num_frames < window_max_frames &&
+         parser.position - window_begin < window_max_bytes) {
+    size_t offset = parser.position;
+    split_tokens(next_line(parser), tokens);
+    if (tokens.size() == 0) {
+      window.is_last = true;
+      return;
+    }
+    if (size_t(window.num_frames) == window.slots.size()) {
+      window.slots.emplace_back();
+    }
+    Frame_Slot& slot = window.slots[window.num_frames++];
+    slot.offset = offset;
+    slot.line_number = parser.line_number;
+    slot.has_error = false;
+    int num_atom = 0;
+    try {
+      if (tokens.size() > 1) {
+        parse_error(
+          parser, parser.line_offset, "The first line for each frame should have one value.");
+      }
+      num_atom = get_int(parser, tokens[0], tokens[0].data() - parser.file.data);
+      if (num_atom < 1) {
+        parse_error(parser, parser.line_offset, "Number of atoms for each frame should >= 1.");
+      }
+    } catch (const Parse_Error& error) {
+      slot.has_error = true;
+      slot.error = error.message;
+      window.is_last = true;
+      return;
+    }
+    for (int n = 0; n < num_atom + 1; ++n) {
+      next_line(parser);
+    }
+    slot.size = parser.position - offset;
+  }
+}
+
+// call process(nc, offset, text, structure) for each frame nc in order, where text is the frame in
+// the file from the byte offset, and return the number of frames
+template <typename Process>
+static int for_each_frame(const std::string& inputfile, Process process)
+{
+  Exyz_Parser parser;
+  open_parser(inputfile, parser);
+  int num_threads = get_num_parser_threads();
+  if (num_threads == 1) {
+    Structure structure;
+    try {
+      for (size_t offset = parser.position; parse_next(parser, structure);
+           offset = parser.position) {
+        std::string_view text(parser.file.data + offset, parser.position - offset);
+        process(parser.num_structures - 1, offset, text, structure);
+      }
+    } catch (const Parse_Error& error) {
+      report_parse_error(error);
+    }
+    close_parser(parser);
+    std::cout << "Number of structures read from "
+              << inputfile + " = " << parser.num_structures << std::endl;
+    return parser.num_structures;
+  }
+
+  Parser_Pool pool;
+  start_pool(pool, parser, num_threads);
+  Frame_Window windows[2];
+  scan_window(parser, windows[0]);
+  start_window(pool, windows[0]);
+  if (!windows[0].is_last) {
+    scan_window(parser, windows[1]);
+  } else {
+    windows[1].num_frames = 0;
+    windows[1].is_last = true;
+  }
+
+  int num_structures = 0;
+  for (int w = 0;; w = 1 - w) {
+    Frame_Window& current = windows[w];
+    Frame_Window& next = windows[1 - w];
+    finish_window(pool);
+    if (!current.is_last) {
+      start_window(pool, next);
+    }
+    for (int k = 0; k < current.num_frames; ++k) {
+      Frame_Slot& slot = current.slots[k];
+      if (slot.has_error) {
+        finish_window(pool);
+        stop_pool(pool);
+        report_parse_error(Parse_Error{slot.error});
+      }
+      std::string_view text(parser.file.data + slot.offset, slot.size);
+      process(num_structures++, slot.offset, text, slot.structure);
+    }
+    if (current.is_last) {
+      break;
+    }
+    if (!next.is_last) {
+      scan_window(parser, current); // the window after next
+    } else {
+      current.num_frames = 0;
+      current.is_last = true;
+    }
+  }
+  stop_pool(pool);
+  close_parser(parser);
+  std::cout << "Number of structures read from "
+            << inputfile + " = " << num_structures << std::endl;
+  return num_structures;
+}
+
+// The binary dataset format (version 2) keeps the frames of an xyz file in columns:
+//   Binary_Header
+//   num_frames Binary_Frame (the values of a frame other than the atom columns)
+//   num_atoms uint8_t type ids (indices into the species table)
+//   the columns x, y, z, fx, fy, fz, each of num_atoms double (or float if real_size = 4)
+//   the species table and the sid table (each name is a uint32_t length and the characters)
+// The sections start at multiples of 64 bytes, and the numbers are in the byte order of the
+// machine that wrote the file. The nep trainer (src/main_nep/structure.cu) reads train.nepbin and
+// test.nepbin in this format when train.xyz and test.xyz are absent; therefore a frame keeps the
+// values as in the file: the energy weight before the correction for the sid (with a flag if the
+// correction changed it) and the stress also when there is a virial.
+static const char binary_magic[8] = {'N', 'E', 'P', 'B', 'I', 'N', '\0', '\0'};
+static const uint32_t binary_version = 2;
+static const uint32_t binary_has_sid = 1;
+static const uint32_t binary_has_virial = 2;
+static const uint32_t binary_has_stress = 4;
+static const uint32_t binary_energy_weight_corrected = 8; // the toolkit uses 1
+
+struct Binary_Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t real_size; // bytes of a value in the atom columns: 8 or 4
+  uint64_t num_frames;
+  uint64_t num_atoms; // in all the frames
+  uint32_t num_species;
+  uint32_t num_sids;
+  uint64_t frame_offset;
+  uint64_t type_offset;
+  uint64_t column_offset[6]; // x, y, z, fx, fy, fz
+  uint64_t species_offset;
+  uint64_t sid_offset;
+};
+
+struct Binary_Frame {
+  uint64_t atom_offset; // of the first atom of the frame in the columns
+  int32_t num_atom;
+  int32_t sid_index;
+  uint32_t flags; // binary_has_sid, binary_has_virial, binary_has_stress, ...
+  uint32_t reserved;
+  double energy;
+  double energy_weight; // as in the file
+  double weight;
+  double box[9];
+  double virial[9];
+  double stress[9];
+};
+
+struct Binary_Dataset {
+  std::string filename;
+  Mapped_File file;
+  Binary_Header header;
+  const Binary_Frame* frames = nullptr;
+  const uint8_t* types = nullptr;
+  const char* columns[6];
+  std::vector<std::string> species;
+  std::vector<std::string> sids;
+};
+
+static bool is_binary_dataset(const std::string& inputfile)
+{
+  std::ifstream input(inputfile, std::ios::binary);
+  char magic[sizeof(binary_magic)];
+  return input.read(magic, sizeof(magic)) && memcmp(magic, binary_magic, sizeof(magic)) == 0;
+}
+
+[[noreturn]] static void binary_error(const Binary_Dataset& dataset, const std::string& message)
+{
+  std::cout << message << std::endl;
+  std::cout << "    File: " << dataset.filename << std::endl;
+  exit(1);
+}
+
+static void read_name_table(
+  const Binary_Dataset& dataset, uint64_t offset, uint32_t count, std::vector<std::string>& names)
+{
+  names.resize(count);
+  for (uint32_t n = 0; n < count; ++n) {
+    uint32_t length;
+    if (offset + sizeof(length) > dataset.file.size) {
+      binary_error(dataset, "The name tables of the binary dataset are out of range.");
+    }
+    memcpy(&length, dataset.file.data + offset, sizeof(length));
+    offset += sizeof(length);
+    if (offset + length > dataset.file.size) {
+      binary_error(dataset, "The name tables of the binary dataset are out of range.");
+    }
+    names[n].assign(dataset.file.data + offset, length);
+    offset += length;
+  }
+}
+
+// map the file and check the sections, type ids, and frames once, such that the frames can then be
+// read without checks
+static void open_binary_dataset(const std::string& inputfile, Binary_Dataset& dataset)
+{
+  dataset.filename = inputfile;
+  map_file(inputfile, dataset.file);
+  const Mapped_File& file = dataset.file;
+  Binary_Header& header = dataset.header;
+  if (file.size < sizeof(header)) {
+    binary_error(dataset, "The binary dataset is shorter than its header.");
+  }
+  memcpy(&header, file.data, sizeof(header));
+  if (memcmp(header.magic, binary_magic, sizeof(header.magic)) != 0) {
+    binary_error(dataset, "This is not a binary dataset.");
+  }
+  if (header.version != binary_version) {
+    binary_error(
+      dataset,
+      "Version " + std::to_string(header.version) + " of the binary dataset is not supported.");
+  }
+  if (header.real_size != 8 && header.real_size != 4) {
+    binary_error(dataset, "The binary dataset should have 8 or 4 bytes per value.");
+  }
+  auto is_in_file = [&](uint64_t offset, uint64_t count, uint64_t size) {
+    return offset <= file.size && count <= (file.size - offset) / size;
+  };
+  bool is_valid = is_in_file(header.frame_offset, header.num_frames, sizeof(Binary_Frame)) &&
+                  is_in_file(header.type_offset, header.num_atoms, 1) &&
+                  header.frame_offset % alignof(Binary_Frame) == 0;
+  for (int k = 0; k < 6; ++k) {
+    is_valid = is_valid && is_in_file(header.column_offset[k], header.num_atoms, header.real_size);
+  }
+  if (!is_valid) {
+    binary_error(dataset, "The sections of the binary dataset are out of range.");
+  }
+  dataset.frames = reinterpret_cast<const Binary_Frame*>(file.data + header.frame_offset);
+  dataset.types = reinterpret_cast<const uint8_t*>(file.data + header.type_offset);
+  for (int k = 0; k < 6; ++k) {
+    dataset.columns[k] = file.data + header.column_offset[k];
+  }
+  read_name_table(dataset, header.species_offset, header.num_species, dataset.species);
+  read_name_table(dataset, header.sid_offset, header.num_sids, dataset.sids);
+
+  for (uint64_t n = 0; n < header.num_atoms; ++n) {
+    if (dataset.types[n] >= header.num_species) {
+      binary_error(dataset, "A type id of the binary dataset is out of range.");
+    }
+  }
+  for (uint64_t nc = 0; nc < header.num_frames; ++nc) {
+    const Binary_Frame& frame = dataset.frames[nc];
+    if (frame.num_atom < 1 || frame.atom_offset > header.num_atoms ||
+        uint64_t(frame.num_atom) > header.num_atoms - frame.atom_offset ||
+        frame.sid_index < 0 || uint32_t(frame.sid_index) >= header.num_sids) {
+      binary_error(dataset, "Frame " + std::to_string(nc) + " of the binary dataset is invalid.");
+    }
+  }
+}
+
+static void close_binary_dataset(Binary_Dataset& dataset) { unmap_file(dataset.file); }
+
+static void get_binary_column(
+  const Binary_Dataset& dataset,
+  int k,
+  uint64_t offset,
+  int num_atom,
+  std::vector<double>& values)
+{
+  values.resize(num_atom);
+  const char* column = dataset.columns[k];
+  if (dataset.header.real_size == sizeof(double)) {
+    memcpy(values.data(), column + offset * sizeof(double), sizeof(double) * num_atom);
+  } else {
+    for (int n = 0; n < num_atom; ++n) {
+      float value;
+      memcpy(&value, column + (offset + n) * sizeof(float), sizeof(float));
+      values[n] = value;
     }
   }
+}
 
-  read_force(num_columns, species_offset, pos_offset, force_offset, input, structure);
+static void get_binary_structure(const Binary_Dataset& dataset, uint64_t nc, Structure& structure)
+{
+  const Binary_Frame& frame = dataset.frames[nc];
+  structure.num_atom = frame.num_atom;
+  structure.sid = dataset.sids[frame.sid_index];
+  structure.has_sid = frame.flags & binary_has_sid;
+  structure.has_virial = frame.flags & binary_has_virial;
+  structure.has_stress_in_file = frame.flags & binary_has_stress;
+  structure.has_stress = structure.has_stress_in_file && !structure.has_virial;
+  structure.energy_weight_in_file = frame.energy_weight;
+  structure.energy_weight =
+    (frame.flags & binary_energy_weight_corrected) ? 1.0 : frame.energy_weight;
+  structure.energy = frame.energy;
+  structure.weight = frame.weight;
+  memcpy(structure.box, frame.box, sizeof(frame.box));
+  memcpy(structure.virial, frame.virial, sizeof(frame.virial));
+  memcpy(structure.stress, frame.stress, sizeof(frame.stress));
+  structure.atom_symbol.resize(frame.num_atom);
+  for (int n = 0; n < frame.num_atom; ++n) {
+    structure.atom_symbol[n] = dataset.species[dataset.types[frame.atom_offset + n]];
+  }
+  get_binary_column(dataset, 0, frame.atom_offset, frame.num_atom, structure.x);
+  get_binary_column(dataset, 1, frame.atom_offset, frame.num_atom, structure.y);
+  get_binary_column(dataset, 2, frame.atom_offset, frame.num_atom, structure.z);
+  get_binary_column(dataset, 3, frame.atom_offset, frame.num_atom, structure.fx);
+  get_binary_column(dataset, 4, frame.atom_offset, frame.num_atom, structure.fy);
+  get_binary_column(dataset, 5, frame.atom_offset, frame.num_atom, structure.fz);
 }
 
-static void read(const std::string& inputfile, std::vector<Structure>& structures)
+// call process(nc, structure) for each frame nc in order and return the number of frames; the input
+// is an xyz file or a binary dataset
+template <typename Process>
+static int for_each_structure(const std::string& inputfile, Process process)
 {
-  std::ifstream input(inputfile);
-  if (!input.is_open()) {
-    std::cout << "Failed to open " << inputfile << std::endl;
-    exit(1);
-  } else {
+  if (is_binary_dataset(inputfile)) {
+    Binary_Dataset dataset;
+    open_binary_dataset(inputfile, dataset);
+    int num_structures = dataset.header.num_frames;
+    Structure structure;
+    for (int nc = 0; nc < num_structures; ++nc) {
+      get_binary_structure(dataset, nc, structure);
+      process(nc, structure);
+    }
+    close_binary_dataset(dataset);
+    std::cout << "Number of structures read from "
+              << inputfile + " = " << num_structures << std::endl;
+    return num_structures;
+  }
+  return for_each_frame(
+    inputfile, [&](int nc, size_t /*offset*/, std::string_view /*text*/, Structure& structure) {
+      process(nc, structure);
+    });
+}
+
+// count the frames (and the atoms if num_atoms is not null) without parsing the atom lines
+static int count_structures(const std::string& inputfile, int64_t* num_atoms = nullptr)
+{
+  if (is_binary_dataset(inputfile)) {
+    Binary_Dataset dataset;
+    open_binary_dataset(inputfile, dataset);
+    int num_structures = dataset.header.num_frames;
+    if (num_atoms != nullptr) {
+      *num_atoms = dataset.header.num_atoms;
+    }
+    close_binary_dataset(dataset);
+    return num_structures;
+  }
+  if (num_atoms != nullptr) {
+    *num_atoms = 0;
+  }
+  Exyz_Parser parser;
+  open_parser(inputfile, parser);
+  std::vector<std::string_view>& tokens = parser.tokens;
+  try {
     while (true) {
-      std::vector<std::string> tokens = get_tokens(input);
+      split_tokens(next_line(parser), tokens);
       if (tokens.size() == 0) {
         break;
       } else if (tokens.size() > 1) {
-        std::cout << "The first line for each frame should have one value." << std::endl;
-        exit(1);
-      }
-      Structure structure;
-      structure.num_atom = get_int_from_token(tokens[0], __FILE__, __LINE__);
-      if (structure.num_atom < 1) {
-        std::cout << "Number of atoms for each frame should >= 1." << std::endl;
-        exit(1);
+        parse_error(
+          parser, parser.line_offset, "The first line for each frame should have one value.");
       }
-      read_one_structure(input, structure);
-
-      // correct my early mistakes; no side effect
-      if (structure.sid == "" || structure.sid == "\"oc20\"") {
-        structure.sid = "oc20"; // remove the quote
-        structure.energy_weight = 1.0; // energy should be trained for OC20
+      int num_atom = get_int(parser, tokens[0], tokens[0].data() - parser.file.data);
+      for (int n = 0; n < num_atom + 1; ++n) {
+        next_line(parser);
       }
-      // correct my early mistakes; no side effect
-      if (structure.sid == "\"spice\"") {
-        structure.sid = "spice"; // remove the quote
+      if (num_atoms != nullptr) {
+        *num_atoms += num_atom;
       }
-
-      structures.emplace_back(structure);
+      parser.num_structures++;
     }
-    input.close();
+  } catch (const Parse_Error& error) {
+    report_parse_error(error);
   }
+  close_parser(parser);
+  return parser.num_structures;
 }
 
 static void write_one_structure(std::ofstream& output, const Structure& structure)
@@ -469,49 +1667,70 @@ static void write_one_structure(std::ofstream& output, const Structure& structur
   }
 }
 
-static void write(
-  const std::string& outputfile,
-  const std::vector<Structure>& structures)
+static void open_output(const std::string& outputfile, std::ofstream& output)
 {
-  std::ofstream output(outputfile);
+  output.open(outputfile);
   if (!output.is_open()) {
     std::cout << "Failed to open " << outputfile << std::endl;
     exit(1);
   }
   std::cout << outputfile << " is opened." << std::endl;
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    write_one_structure(output, structures[nc]);
-  }
+}
+
+static void close_output(const std::string& outputfile, std::ofstream& output)
+{
   output.close();
   std::cout << outputfile << " is closed." << std::endl;
 }
 
-static void shift_energy(std::vector<Structure>& structures)
+static void copy(const std::string& inputfile, const std::string& outputfile)
+{
+  std::ofstream output;
+  open_output(outputfile, output);
+  for_each_structure(inputfile, [&](int /*nc*/, Structure& structure) {
+    write_one_structure(output, structure);
+  });
+  close_output(outputfile, output);
+}
+
+static void shift_energy(const std::string& inputfile, const std::string& outputfile)
 {
+  // the shift needs the number of frames before any frame is written
+  int num_structures = count_structures(inputfile);
   std::ifstream input_energy("energy_train.out");
 
   double energy_to_be_shifted = 0.0;
 
-  for (int nc = 0; nc < structures.size(); ++nc) {
+  for (int nc = 0; nc < num_structures; ++nc) {
     double energy_nep = 0.0;
     double energy_ref = 0.0;
     input_energy >> energy_nep >> energy_ref;
     energy_to_be_shifted += energy_ref - energy_nep;
   }
-  energy_to_be_shifted /= structures.size();
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    structures[nc].energy -= energy_to_be_shifted * structures[nc].num_atom;
-  }
+  energy_to_be_shifted /= num_structures;
 
   std::cout << "Energy is decreased by " << energy_to_be_shifted << " eV/atom" << std::endl;
+
+  std::ofstream output;
+  open_output(outputfile, output);
+  for_each_structure(inputfile, [&](int /*nc*/, Structure& structure) {
+    structure.energy -= energy_to_be_shifted * structure.num_atom;
+    write_one_structure(output, structure);
+  });
+  close_output(outputfile, output);
 }
 
-static void change_sid(std::vector<Structure>& structures, const std::string& new_sid)
+static void change_sid(
+  const std::string& inputfile, const std::string& outputfile, const std::string& new_sid)
 {
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    structures[nc].has_sid = true;
-    structures[nc].sid = new_sid;
-  }
+  std::ofstream output;
+  open_output(outputfile, output);
+  for_each_structure(inputfile, [&](int /*nc*/, Structure& structure) {
+    structure.has_sid = true;
+    structure.sid = new_sid;
+    write_one_structure(output, structure);
+  });
+  close_output(outputfile, output);
 }
 
 #ifdef ZHEYONG
@@ -606,20 +1825,25 @@ static void calculate_one_structure(
   }
 }
 
-static void add_d3(std::vector<Structure>& structures, const std::string& functional)
+static void add_d3(
+  const std::string& inputfile, const std::string& outputfile, const std::string& functional)
 {
   NEP3 nep3("nep.txt");
   std::vector<std::string> atom_symbols = get_atom_symbols("nep.txt");
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    calculate_one_structure(nep3, atom_symbols, structures[nc], functional, 12, 6);
-  }
+  std::ofstream output;
+  open_output(outputfile, output);
+  for_each_structure(inputfile, [&](int nc, Structure& structure) {
+    calculate_one_structure(nep3, atom_symbols, structure, functional, 12, 6);
+    write_one_structure(output, structure);
+  });
+  close_output(outputfile, output);
 }
 
 #endif
 
 static void split_into_accurate_and_inaccurate(
-  const std::vector<Structure>& structures, 
-  double energy_threshold, 
+  const std::string& inputfile,
+  double energy_threshold,
   double force_threshold,
   double virial_threshold)
 {
@@ -628,21 +1852,23 @@ static void split_into_accurate_and_inaccurate(
   std::ifstream input_virial("virial_train.out");
   std::ofstream output_accurate("accurate.xyz");
   std::ofstream output_inaccurate("inaccurate.xyz");
+  std::ofstream output_index_accurate("indices_accurate.txt");
+  std::ofstream output_index_inaccurate("indices_inaccurate.txt");
   int num1 = 0;
   int num2 = 0;
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    bool energy_is_small = structures[nc].energy < 0.0;
+  for_each_structure(inputfile, [&](int nc, Structure& structure) {
+    bool energy_is_small = structure.energy < 0.0;
     bool force_is_small = true;
-    for (int n = 0; n < structures[nc].num_atom; ++n) {
-      double fx = structures[nc].fx[n];
-      double fy = structures[nc].fy[n];
-      double fz = structures[nc].fz[n];
+    for (int n = 0; n < structure.num_atom; ++n) {
+      double fx = structure.fx[n];
+      double fy = structure.fy[n];
+      double fz = structure.fz[n];
       if (fx * fx + fy * fy + fz * fz > 400.0) {
         force_is_small = false;
         break;
       }
     }
-    bool is_considered = (energy_is_small || structures[nc].energy_weight < 0.5f) && force_is_small;
+    bool is_considered = (energy_is_small || structure.energy_weight < 0.5f) && force_is_small;
 
     bool is_accurate = true;
 
@@ -650,7 +1876,7 @@ static void split_into_accurate_and_inaccurate(
     double energy_ref = 0.0;
     input_energy >> energy_nep >> energy_ref;
 
-    if (structures[nc].energy_weight > 0.5f && energy_threshold > 0) {
+    if (structure.energy_weight > 0.5f && energy_threshold > 0) {
       if (std::abs(energy_nep - energy_ref) > energy_threshold) {
         is_accurate = false;
       }
@@ -658,7 +1884,7 @@ static void split_into_accurate_and_inaccurate(
 
     double force_nep[3];
     double force_ref[3];
-    for (int n = 0; n < structures[nc].num_atom; ++n) {
+    for (int n = 0; n < structure.num_atom; ++n) {
       input_force >> force_nep[0] >> force_nep[1] >> force_nep[2] >> force_ref[0] >> force_ref[1] >> force_ref[2];
       double fx_diff = force_nep[0] - force_ref[0];
       double fy_diff = force_nep[1] - force_ref[1];
@@ -678,7 +1904,7 @@ static void split_into_accurate_and_inaccurate(
     }
     for (int n = 0; n < 6; ++n) {
       if (std::abs(virial_nep[n] - virial_ref[n]) > virial_threshold) {
-        if (structures[nc].has_virial || structures[nc].has_stress) {
+        if (structure.has_virial || structure.has_stress) {
           is_accurate = false;
         }
       }
@@ -686,24 +1912,28 @@ static void split_into_accurate_and_inaccurate(
 
     //if (is_considered) {
       if (is_accurate) {
-        write_one_structure(output_accurate, structures[nc]);
+        write_one_structure(output_accurate, structure);
+        output_index_accurate << nc << "\n";
         num1++;
       } else{
-        write_one_structure(output_inaccurate, structures[nc]);
+        write_one_structure(output_inaccurate, structure);
+        output_index_inaccurate << nc << "\n";
         num2++;
       }
     //}
-  }
+  });
   input_energy.close();
   input_force.close();
   input_virial.close();
   output_accurate.close();
   output_inaccurate.close();
+  output_index_accurate.close();
+  output_index_inaccurate.close();
   std::cout << "Number of structures written into accurate.xyz = " << num1 << std::endl;
   std::cout << "Number of structures written into inaccurate.xyz = " << num2 << std::endl;
 }
 
-static void split_with_sid(const std::vector<Structure>& structures)
+static void split_with_sid(const std::string& inputfile)
 {
   std::ofstream output_ch("ch.xyz");
   std::ofstream output_unep1("unep1.xyz");
@@ -727,42 +1957,42 @@ static void split_with_sid(const std::vector<Structure>& structures)
   int num_protein = 0;
   int num_ani1xnr = 0;
   int num_salex = 0;
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    if (structures[nc].sid == "ch") {
-      write_one_structure(output_ch, structures[nc]);
+  for_each_structure(inputfile, [&](int /*nc*/, Structure& structure) {
+    if (structure.sid == "ch") {
+      write_one_structure(output_ch, structure);
         num_ch++;
-    } else if (structures[nc].sid == "unep1") {
-      write_one_structure(output_unep1, structures[nc]);
+    } else if (structure.sid == "unep1") {
+      write_one_structure(output_unep1, structure);
         num_unep1++;
-    } else if (structures[nc].sid == "oc20") {
-      write_one_structure(output_oc20, structures[nc]);
+    } else if (structure.sid == "oc20") {
+      write_one_structure(output_oc20, structure);
         num_oc20++;
-    } else if (structures[nc].sid == "oc22") {
-      write_one_structure(output_oc22, structures[nc]);
+    } else if (structure.sid == "oc22") {
+      write_one_structure(output_oc22, structure);
         num_oc22++;
-    } else if (structures[nc].sid == "spice") {
-      write_one_structure(output_spice, structures[nc]);
+    } else if (structure.sid == "spice") {
+      write_one_structure(output_spice, structure);
         num_spice++;
-    } else if (structures[nc].sid == "water") {
-      write_one_structure(output_water, structures[nc]);
+    } else if (structure.sid == "water") {
+      write_one_structure(output_water, structure);
         num_water++;
-    } else if (structures[nc].sid == "mp") {
-      write_one_structure(output_mp, structures[nc]);
+    } else if (structure.sid == "mp") {
+      write_one_structure(output_mp, structure);
         num_mp++;
-    } else if (structures[nc].sid == "protein") {
-      write_one_structure(output_protein, structures[nc]);
+    } else if (structure.sid == "protein") {
+      write_one_structure(output_protein, structure);
         num_protein++;
-    } else if (structures[nc].sid == "ani1xnr") {
-      write_one_structure(output_ani1xnr, structures[nc]);
+    } else if (structure.sid == "ani1xnr") {
+      write_one_structure(output_ani1xnr, structure);
         num_ani1xnr++;
-    } else if (structures[nc].sid == "salex") {
-      write_one_structure(output_salex, structures[nc]);
+    } else if (structure.sid == "salex") {
+      write_one_structure(output_salex, structure);
         num_salex++;
     } else {
-      write_one_structure(output_omat, structures[nc]);
+      write_one_structure(output_omat, structure);
         num_omat++;
     } 
-  }
+  });
   output_ch.close();
   output_unep1.close();
   output_oc20.close();
@@ -787,34 +2017,34 @@ static void split_with_sid(const std::vector<Structure>& structures)
   std::cout << "Number of structures written into salex.xyz = " << num_salex << std::endl;
 }
 
-static void fps(std::vector<Structure>& structures, double distance_square_min, int dim)
+static void fps(const std::string& inputfile, double distance_square_min, int dim)
 {
   std::ifstream input_descriptor("descriptor.out");
   std::ofstream output_selected("selected.xyz");
   std::ofstream output_not_selected("not_selected.xyz");
   std::ofstream output_index_selected("indices_selected.txt");
   std::ofstream output_index_not_selected("indices_not_selected.txt");
-  std::vector<Structure> structures_selected;
+  std::vector<double> q_selected; // only the descriptors of the selected frames are kept
 
   int num1 = 0;
   int num2 = 0;
 
-  for (int nc = 0; nc < structures.size(); ++nc) {
-    structures[nc].q.resize(dim);
+  for_each_structure(inputfile, [&](int nc, Structure& structure) {
+    structure.q.resize(dim);
     for (int d = 0; d < dim; ++d) {
-      input_descriptor >> structures[nc].q[d];
+      input_descriptor >> structure.q[d];
     }
     if (nc == 0) {
-      structures_selected.emplace_back(structures[nc]);
+      q_selected.insert(q_selected.end(), structure.q.begin(), structure.q.end());
       output_index_selected << nc << "\n";
       num1++;
-      write_one_structure(output_selected, structures[nc]);
+      write_one_structure(output_selected, structure);
     } else {
       bool to_be_selected = true;
-      for (int m = 0; m < structures_selected.size(); ++m) {
+      for (int m = 0; m < num1; ++m) {
         double distance_square = 0.0;
         for (int d = 0; d < dim; ++d) {
-          double temp = (structures[nc].q[d] - structures_selected[m].q[d]);
+          double temp = (structure.q[d] - q_selected[m * dim + d]);
           distance_square += temp * temp;
         }
         if (distance_square < distance_square_min) {
@@ -823,20 +2053,20 @@ static void fps(std::vector<Structure>& structures, double distance_square_min,
         }
       }
       if (to_be_selected) {
-        structures_selected.emplace_back(structures[nc]);
+        q_selected.insert(q_selected.end(), structure.q.begin(), structure.q.end());
         output_index_selected << nc << "\n";
         num1++;
         if (num1 % 1000 == 0) {
           std::cout << "#selected = " << num1 << ", current structure ID = " << nc << "\n";
         }
-        write_one_structure(output_selected, structures[nc]);
+        write_one_structure(output_selected, structure);
       } else {
         output_index_not_selected << nc << "\n";
         num2++;
-        write_one_structure(output_not_selected, structures[nc]);
+        write_one_structure(output_not_selected, structure);
       }
     }
-  }
+  });
 
   input_descriptor.close();
   output_selected.close();
@@ -847,7 +2077,517 @@ static void fps(std::vector<Structure>& structures, double distance_square_min,
   std::cout << "Number of structures written into not_selected.xyz = " << num2 << std::endl;
 }
 
-int main(int argc, char* argv[])
+// The index of an xyz file is a file next to it (the name + ".idx") with a header, one Frame_Record
+// for each frame, and the table of the distinct sids. It is built by one pass over the xyz file and
+// rebuilt when the size or the modification time of the xyz file differs from the header; the hash
+// of each frame read through the index is checked against its record.
+static const char index_magic[8] = {'N', 'E', 'P', 'I', 'D', 'X', '0', '1'};
+
+struct Index_Header {
+  char magic[8];
+  uint64_t file_size;        // of the xyz file
+  int64_t file_time;         // modification time of the xyz file
+  uint64_t num_frames;
+  uint64_t num_sids;
+  uint64_t sid_table_offset; // each sid is a uint32_t length and the characters
+};
+
+struct Frame_Record {
+  uint64_t offset;   // byte offset of the line with the number of atoms
+  uint64_t size;     // number of bytes up to the end of the last atom line
+  uint64_t hash;     // hash_bytes of these bytes
+  double energy;
+  int32_t num_atom;
+  int32_t sid_index; // in the sid table
+};
+
+static std::string get_index_filename(const std::string& inputfile) { return inputfile + ".idx"; }
+
+static void get_file_stamp(const std::string& filename, uint64_t& size, int64_t& time)
+{
+  std::error_code error;
+  size = std::filesystem::file_size(filename, error);
+  if (!error) {
+    time = std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+  }
+  if (error) {
+    std::cout << "Failed to get the size and modification time of " << filename << std::endl;
+    exit(1);
+  }
+}
+
+// a 64-bit hash of the bytes, eight at a time
+static uint64_t hash_bytes(std::string_view bytes)
+{
+  const uint64_t prime = 0x9e3779b97f4a7c15ULL;
+  uint64_t hash = bytes.size() * prime;
+  size_t n = 0;
+  for (; n + 8 <= bytes.size(); n += 8) {
+    uint64_t word;
+    memcpy(&word, bytes.data() + n, 8);
+    hash = (hash ^ word) * prime;
+    hash ^= hash >> 29;
+  }
+  uint64_t word = 0;
+  memcpy(&word, bytes.data() + n, bytes.size() - n);
+  hash = (hash ^ word) * prime;
+  return hash ^ (hash >> 32);
+}
+
+// the records are written as the frames are parsed; the header is written last
+static void build_index(const std::string& inputfile)
+{
+  std::string index_file = get_index_filename(inputfile);
+  std::string temporary_file = index_file + ".tmp";
+  std::cout << "Building the index " << index_file << std::endl;
+  Index_Header header;
+  memcpy(header.magic, index_magic, sizeof(header.magic));
+  get_file_stamp(inputfile, header.file_size, header.file_time);
+
+  std::ofstream output(temporary_file, std::ios::binary);
+  if (!output.is_open()) {
+    std::cout << "Failed to open " << temporary_file << std::endl;
+    exit(1);
+  }
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  std::vector<std::string> sids;
+  std::unordered_map<std::string, int> sid_indices;
+  header.num_frames = for_each_frame(
+    inputfile, [&](int /*nc*/, size_t offset, std::string_view text, Structure& structure) {
+      auto sid = sid_indices.emplace(structure.sid, int(sids.size()));
+      if (sid.second) {
+        sids.push_back(structure.sid);
+      }
+      Frame_Record record = {
+        offset, text.size(), hash_bytes(text), structure.energy, structure.num_atom,
+        sid.first->second};
+      output.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    });
+
+  header.num_sids = sids.size();
+  header.sid_table_offset = output.tellp();
+  for (const std::string& sid : sids) {
+    uint32_t length = sid.size();
+    output.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    output.write(sid.data(), length);
+  }
+  output.seekp(0);
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  output.close();
+  if (!output || std::rename(temporary_file.c_str(), index_file.c_str()) != 0) {
+    std::cout << "Failed to write " << index_file << std::endl;
+    exit(1);
+  }
+}
+
+static bool read_index_header(
+  const std::string& inputfile, std::ifstream& index, Index_Header& header)
+{
+  uint64_t file_size;
+  int64_t file_time;
+  get_file_stamp(inputfile, file_size, file_time);
+  index.close();
+  index.clear();
+  index.open(get_index_filename(inputfile), std::ios::binary);
+  return index.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+         memcmp(header.magic, index_magic, sizeof(header.magic)) == 0 &&
+         header.file_size == file_size && header.file_time == file_time;
+}
+
+// open the index of the xyz file, building it if it is missing or stale
+static void open_index(const std::string& inputfile, std::ifstream& index, Index_Header& header)
+{
+  std::string index_file = get_index_filename(inputfile);
+  if (read_index_header(inputfile, index, header)) {
+    std::cout << "Using the index " << index_file << std::endl;
+    return;
+  }
+  build_index(inputfile);
+  if (!read_index_header(inputfile, index, header)) {
+    std::cout << "Failed to read " << index_file << std::endl;
+    exit(1);
+  }
+}
+
+static void read_frame_record(std::ifstream& index, uint64_t nc, Frame_Record& record)
+{
+  index.seekg(sizeof(Index_Header) + nc * sizeof(Frame_Record));
+  if (!index.read(reinterpret_cast<char*>(&record), sizeof(record))) {
+    std::cout << "Failed to read the record of frame " << nc << " from the index." << std::endl;
+    exit(1);
+  }
+}
+
+// the next frame index in the file of indices; false at its end, and an error for anything but an
+// integer
+static bool read_frame_index(
+  std::ifstream& input_index, const std::string& indexfile, long long& nc)
+{
+  if (input_index >> nc) {
+    return true;
+  }
+  if (!input_index.eof()) {
+    std::cout << "Failed to read a frame index from " << indexfile
+              << "; the indices should be integers." << std::endl;
+    exit(1);
+  }
+  return false;
+}
+
+// the values as in the original xyz file: the energy weight before the correction for the sid, and
+// the stress also when there is a virial
+static void restore_values_in_file(Structure& structure)
+{
+  structure.energy_weight = structure.energy_weight_in_file;
+  structure.has_stress = structure.has_stress_in_file;
+}
+
+// a binary dataset is read directly, without an index; the frames are written from the stored
+// values, as in the original xyz file (see restore_values_in_file) but in the format of
+// write_one_structure
+static void extract_binary_frames(
+  const std::string& inputfile,
+  std::ifstream& input_index,
+  const std::string& indexfile,
+  const std::string& outputfile)
+{
+  Binary_Dataset dataset;
+  open_binary_dataset(inputfile, dataset);
+  std::ofstream output;
+  open_output(outputfile, output);
+  int num_frames = 0;
+  long long nc;
+  Structure structure;
+  while (read_frame_index(input_index, indexfile, nc)) {
+    if (nc < 0 || uint64_t(nc) >= dataset.header.num_frames) {
+      std::cout << "Frame index " << nc << " is out of range; " << inputfile << " has "
+                << dataset.header.num_frames << " frames." << std::endl;
+      exit(1);
+    }
+    get_binary_structure(dataset, nc, structure);
+    restore_values_in_file(structure);
+    write_one_structure(output, structure);
+    num_frames++;
+  }
+  close_binary_dataset(dataset);
+  close_output(outputfile, output);
+  std::cout << "Number of structures written into " << outputfile << " = " << num_frames
+            << std::endl;
+}
+
+// copy the frames listed in indexfile (one index per line, as indices_selected.txt) in that order,
+// reading only those frames from the xyz file through its index; the frames of an xyz file are
+// copied verbatim
+static void extract_frames(
+  const std::string& inputfile, const std::string& indexfile, const std::string& outputfile)
+{
+  std::ifstream input_index(indexfile);
+  if (!input_index.is_open()) {
+    std::cout << "Failed to open " << indexfile << std::endl;
+    exit(1);
+  }
+  if (is_binary_dataset(inputfile)) {
+    extract_binary_frames(inputfile, input_index, indexfile, outputfile);
+    return;
+  }
+  std::ifstream index;
+  Index_Header header;
+  open_index(inputfile, index, header);
+  std::ifstream input(inputfile, std::ios::binary);
+  if (!input.is_open()) {
+    std::cout << "Failed to open " << inputfile << std::endl;
+    exit(1);
+  }
+  std::ofstream output;
+  open_output(outputfile, output);
+
+  int num_frames = 0;
+  long long nc;
+  Frame_Record record;
+  std::string text;
+  while (read_frame_index(input_index, indexfile, nc)) {
+    if (nc < 0 || uint64_t(nc) >= header.num_frames) {
+      std::cout << "Frame index " << nc << " is out of range; " << inputfile << " has "
+                << header.num_frames << " frames." << std::endl;
+      exit(1);
+    }
+    read_frame_record(index, nc, record);
+    text.resize(record.size);
+    input.seekg(record.offset);
+    if (!input.read(&text[0], record.size) || hash_bytes(text) != record.hash) {
+      std::cout << "Frame " << nc << " of " << inputfile << " has changed since "
+                << get_index_filename(inputfile) << " was built; delete the index and try again."
+                << std::endl;
+      exit(1);
+    }
+    output << text;
+    if (text.back() != '\n') {
+      output << "\n"; // the last frame of a file without the final newline
+    }
+    num_frames++;
+  }
+  input_index.close();
+  input.close();
+  close_output(outputfile, output);
+  std::cout << "Number of structures written into " << outputfile << " = " << num_frames
+            << std::endl;
+}
+
+// the columns are written in blocks, each at its own position in the file
+struct Column_Writer {
+  uint64_t position;
+  std::vector<char> buffer;
+};
+
+static void flush_column(std::fstream& output, Column_Writer& column)
+{
+  output.seekp(column.position);
+  output.write(column.buffer.data(), column.buffer.size());
+  column.position += column.buffer.size();
+  column.buffer.clear();
+}
+
+static void write_column(
+  std::fstream& output, Column_Writer& column, const void* data, size_t size)
+{
+  const char* bytes = static_cast<const char*>(data);
+  column.buffer.insert(column.buffer.end(), bytes, bytes + size);
+  if (column.buffer.size() >= (1 << 20)) {
+    flush_column(output, column);
+  }
+}
+
+static void write_name_table(std::fstream& output, const std::vector<std::string>& names)
+{
+  for (const std::string& name : names) {
+    uint32_t length = name.size();
+    output.write(reinterpret_cast<const char*>(&length), sizeof(length));
+    output.write(name.data(), length);
+  }
+}
+
+static uint64_t align_to_64(uint64_t offset) { return (offset + 63) / 64 * 64; }
+
+// convert an xyz file into a binary dataset with real_size (8 or 4) bytes per value in the atom
+// columns; the first pass counts the frames and atoms to place the columns
+static void write_binary_dataset(
+  const std::string& inputfile, const std::string& outputfile, uint32_t real_size)
+{
+  Binary_Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, binary_magic, sizeof(header.magic));
+  header.version = binary_version;
+  header.real_size = real_size;
+  int64_t num_atoms;
+  header.num_frames = count_structures(inputfile, &num_atoms);
+  header.num_atoms = num_atoms;
+  header.frame_offset = align_to_64(sizeof(header));
+  header.type_offset = align_to_64(header.frame_offset + header.num_frames * sizeof(Binary_Frame));
+  uint64_t offset = align_to_64(header.type_offset + header.num_atoms);
+  for (int k = 0; k < 6; ++k) {
+    header.column_offset[k] = offset;
+    offset = align_to_64(offset + header.num_atoms * real_size);
+  }
+  header.species_offset = offset;
+
+  std::fstream output(
+    outputfile, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!output.is_open()) {
+    std::cout << "Failed to open " << outputfile << std::endl;
+    exit(1);
+  }
+  std::cout << outputfile << " is opened." << std::endl;
+  Column_Writer columns[8]; // frames, types, x, y, z, fx, fy, fz
+  columns[0].position = header.frame_offset;
+  columns[1].position = header.type_offset;
+  for (int k = 0; k < 6; ++k) {
+    columns[k + 2].position = header.column_offset[k];
+  }
+  std::vector<std::string> species;
+  std::vector<std::string> sids;
+  std::unordered_map<std::string, int> species_indices;
+  std::unordered_map<std::string, int> sid_indices;
+  std::vector<uint8_t> types;
+  std::vector<float> values;
+  uint64_t atom_offset = 0;
+
+  int num_structures = for_each_structure(inputfile, [&](int /*nc*/, Structure& structure) {
+    if (atom_offset + structure.num_atom > header.num_atoms) {
+      std::cout << inputfile << " has changed during the conversion." << std::endl;
+      exit(1);
+    }
+    Binary_Frame frame;
+    memset(&frame, 0, sizeof(frame));
+    frame.atom_offset = atom_offset;
+    frame.num_atom = structure.num_atom;
+    auto sid = sid_indices.emplace(structure.sid, int(sids.size()));
+    if (sid.second) {
+      sids.push_back(structure.sid);
+    }
+    frame.sid_index = sid.first->second;
+    frame.flags = (structure.has_sid ? binary_has_sid : 0) |
+                  (structure.has_virial ? binary_has_virial : 0) |
+                  (structure.has_stress_in_file ? binary_has_stress : 0) |
+                  (memcmp(&structure.energy_weight, &structure.energy_weight_in_file,
+                          sizeof(double)) != 0
+                     ? binary_energy_weight_corrected
+                     : 0);
+    frame.energy = structure.energy;
+    frame.energy_weight = structure.energy_weight_in_file;
+    frame.weight = structure.weight;
+    memcpy(frame.box, structure.box, sizeof(frame.box));
+    if (structure.has_virial) {
+      memcpy(frame.virial, structure.virial, sizeof(frame.virial));
+    }
+    if (structure.has_stress_in_file) {
+      memcpy(frame.stress, structure.stress, sizeof(frame.stress));
+    }
+    write_column(output, columns[0], &frame, sizeof(frame));
+
+    types.resize(structure.num_atom);
+    for (int n = 0; n < structure.num_atom; ++n) {
+      auto type = species_indices.emplace(structure.atom_symbol[n], int(species.size()));
+      if (type.second) {
+        if (species.size() == 256) {
+          std::cout << "A binary dataset can have at most 256 species." << std::endl;
+          exit(1);
+        }
+        species.push_back(structure.atom_symbol[n]);
+      }
+      types[n] = type.first->second;
+    }
+    write_column(output, columns[1], types.data(), types.size());
+
+    const std::vector<double>* atom_columns[6] = {
+      &structure.x, &structure.y, &structure.z, &structure.fx, &structure.fy, &structure.fz};
+    for (int k = 0; k < 6; ++k) {
+      const std::vector<double>& column = *atom_columns[k];
+      if (real_size == sizeof(double)) {
+        write_column(output, columns[k + 2], column.data(), sizeof(double) * structure.num_atom);
+      } else {
+        values.assign(column.begin(), column.begin() + structure.num_atom);
+        write_column(output, columns[k + 2], values.data(), sizeof(float) * structure.num_atom);
+      }
+    }
+    atom_offset += structure.num_atom;
+  });
+  if (uint64_t(num_structures) != header.num_frames || atom_offset != header.num_atoms) {
+    std::cout << inputfile << " has changed during the conversion." << std::endl;
+    exit(1);
+  }
+  for (int k = 0; k < 8; ++k) {
+    flush_column(output, columns[k]);
+  }
+
+  header.num_species = species.size();
+  header.num_sids = sids.size();
+  output.seekp(header.species_offset);
+  write_name_table(output, species);
+  header.sid_offset = output.tellp();
+  write_name_table(output, sids);
+  output.seekp(0);
+  output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  output.close();
+  if (!output) {
+    std::cout << "Failed to write " << outputfile << std::endl;
+    exit(1);
+  }
+  std::cout << outputfile << " is closed." << std::endl;
+  std::cout << "Number of structures written into " << outputfile << " = " << num_structures
+            << " (" << species.size() << " species, " << real_size * 8
+            << "-bit positions and forces)" << std::endl;
+}
+
+// convert a binary dataset back into an xyz file with the values as in the original xyz file
+static void write_xyz_from_binary(const std::string& inputfile, const std::string& outputfile)
+{
+  std::ofstream output;
+  open_output(outputfile, output);
+  for_each_structure(inputfile, [&](int /*nc*/, Structure& structure) {
+    restore_values_in_file(structure);
+    write_one_structure(output, structure);
+  });
+  close_output(outputfile, output);
+}
+
+static bool is_same_array(const double* a, const double* b, int n)
+{
+  return memcmp(a, b, sizeof(double) * n) == 0;
+}
+
+static bool is_same_structure(const Structure& a, const Structure& b)
+{
+  int n = a.num_atom;
+  return a.num_atom == b.num_atom && a.sid == b.sid && a.has_sid == b.has_sid &&
+         a.has_virial == b.has_virial && a.has_stress == b.has_stress &&
+         is_same_array(&a.energy_weight, &b.energy_weight, 1) &&
+         is_same_array(&a.energy, &b.energy, 1) && is_same_array(&a.weight, &b.weight, 1) &&
+         (!a.has_virial || is_same_array(a.virial, b.virial, 9)) &&
+         (!a.has_stress || is_same_array(a.stress, b.stress, 9)) &&
+         is_same_array(a.box, b.box, 9) && a.atom_symbol == b.atom_symbol &&
+         is_same_array(a.x.data(), b.x.data(), n) && is_same_array(a.y.data(), b.y.data(), n) &&
+         is_same_array(a.z.data(), b.z.data(), n) && is_same_array(a.fx.data(), b.fx.data(), n) &&
+         is_same_array(a.fy.data(), b.fy.data(), n) && is_same_array(a.fz.data(), b.fz.data(), n);
+}
+
+static double get_elapsed_seconds(std::chrono::steady_clock::time_point time_begin)
+{
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - time_begin).count();
+}
+
+// time read_next, parse_next, and the parallel parser, and check that they give the same frames
+static void benchmark_parser(const std::string& inputfile)
+{
+  Structure structure;
+  Structure_Reader reader;
+  auto time_begin = std::chrono::steady_clock::now();
+  open_reader(inputfile, reader);
+  while (read_next(reader, structure)) {
+  }
+  reader.input.close();
+  double time_reader = get_elapsed_seconds(time_begin);
+
+  Exyz_Parser parser;
+  time_begin = std::chrono::steady_clock::now();
+  open_parser(inputfile, parser);
+  try {
+    while (parse_next(parser, structure)) {
+    }
+  } catch (const Parse_Error& error) {
+    report_parse_error(error);
+  }
+  double size_in_mb = parser.file.size / 1048576.0;
+  close_parser(parser);
+  double time_parser = get_elapsed_seconds(time_begin);
+
+  time_begin = std::chrono::steady_clock::now();
+  for_each_structure(inputfile, [](int /*nc*/, Structure& /*structure*/) {});
+  double time_parallel = get_elapsed_seconds(time_begin);
+
+  std::cout << "Number of structures read from " << inputfile + " = " << parser.num_structures
+            << " (" << size_in_mb << " MB)" << std::endl;
+  std::cout << "std::ifstream reader: " << time_reader << " s (" << size_in_mb / time_reader
+            << " MB/s)" << std::endl;
+  std::cout << "mmap parser: " << time_parser << " s (" << size_in_mb / time_parser
+            << " MB/s), " << time_reader / time_parser << " times faster" << std::endl;
+  std::cout << "parallel parser with " << get_num_parser_threads() << " threads: " << time_parallel
+            << " s (" << size_in_mb / time_parallel << " MB/s), " << time_reader / time_parallel
+            << " times faster" << std::endl;
+
+  Structure structure_reference;
+  open_reader(inputfile, reader);
+  for_each_structure(inputfile, [&](int nc, Structure& structure) {
+    read_next(reader, structure_reference);
+    if (!is_same_structure(structure_reference, structure)) {
+      std::cout << "Frame " << nc << " differs between the parsers." << std::endl;
+      exit(1);
+    }
+  });
+  reader.input.close();
+  std::cout << "The parsers give the same frames." << std::endl;
+}
+
+int main()
 {
   std::cout << "====================================================\n";
   std::cout << "Welcome to use nep_data_toolkit!" << std::endl;
@@ -863,6 +2603,9 @@ int main(int argc, char* argv[])
 #ifdef ZHEYONG
   std::cout << "8: add D3\n";
 #endif
+  std::cout << "9: benchmark the parser\n";
+  std::cout << "10: extract frames by their indices\n";
+  std::cout << "11: convert between xyz and the binary format\n";
   std::cout << "====================================================\n";
 
   std::cout << "Please choose a number based on your purpose: ";
@@ -873,10 +2616,7 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the input xyz filename: ";
     std::string input_filename;
     std::cin >> input_filename;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
+    for_each_structure(input_filename, [](int /*nc*/, Structure& /*structure*/) {});
   } else if (option == 2) {
     std::cout << "Please enter the input xyz filename: ";
     std::string input_filename;
@@ -884,11 +2624,7 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the output xyz filename: ";
     std::string output_filename;
     std::cin >> output_filename;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-    write(output_filename, structures_input);
+    copy(input_filename, output_filename);
   } else if (option == 3) {
     std::cout << "Please enter the input xyz filename: ";
     std::string input_filename;
@@ -902,20 +2638,12 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the virial threshold in units of eV/atom: ";
     double virial_threshold;
     std::cin >> virial_threshold;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-    split_into_accurate_and_inaccurate(structures_input, energy_threshold, force_threshold, virial_threshold);
+    split_into_accurate_and_inaccurate(input_filename, energy_threshold, force_threshold, virial_threshold);
   } else if (option == 4) {
     std::cout << "Please enter the input xyz filename: ";
     std::string input_filename;
     std::cin >> input_filename;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-    split_with_sid(structures_input);
+    split_with_sid(input_filename);
   } else if (option == 5) {
     std::cout << "Please enter the input xyz filename: ";
     std::string input_filename;
@@ -926,13 +2654,8 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the dimension of descriptor space: ";
     int dim;
     std::cin >> dim;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-
     clock_t time_begin = clock();
-    fps(structures_input, distance * distance, dim);
+    fps(input_filename, distance * distance, dim);
     clock_t time_finish = clock();
     double time_used = (time_finish - time_begin) / double(CLOCKS_PER_SEC);
     std::cout << "Time used for descriptor-space subsampling = " << time_used << " s.\n";
@@ -943,12 +2666,7 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the output xyz filename: ";
     std::string output_filename;
     std::cin >> output_filename;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-    shift_energy(structures_input);
-    write(output_filename, structures_input);
+    shift_energy(input_filename, output_filename);
   } else if (option == 7) {
     std::cout << "Please enter the input xyz filename: ";
     std::string input_filename;
@@ -959,12 +2677,7 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the sid to be used for all the structures: ";
     std::string sid;
     std::cin >> sid;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-    change_sid(structures_input, sid);
-    write(output_filename, structures_input);
+    change_sid(input_filename, output_filename, sid);
 #ifdef ZHEYONG
   } else if (option == 8) {
     std::cout << "Please enter the input xyz filename: ";
@@ -976,13 +2689,43 @@ int main(int argc, char* argv[])
     std::cout << "Please enter the DFT functional: ";
     std::string functional;
     std::cin >> functional;
-    std::vector<Structure> structures_input;
-    read(input_filename, structures_input);
-    std::cout << "Number of structures read from "
-              << input_filename + " = " << structures_input.size() << std::endl;
-    add_d3(structures_input, functional);
-    write(output_filename, structures_input);
+    add_d3(input_filename, output_filename, functional);
 #endif
+  } else if (option == 9) {
+    std::cout << "Please enter the input xyz filename: ";
+    std::string input_filename;
+    std::cin >> input_filename;
+    benchmark_parser(input_filename);
+  } else if (option == 10) {
+    std::cout << "Please enter the input filename (xyz or binary): ";
+    std::string input_filename;
+    std::cin >> input_filename;
+    std::cout << "Please enter the filename of the frame indices (one per line): ";
+    std::string index_filename;
+    std::cin >> index_filename;
+    std::cout << "Please enter the output xyz filename: ";
+    std::string output_filename;
+    std::cin >> output_filename;
+    extract_frames(input_filename, index_filename, output_filename);
+  } else if (option == 11) {
+    std::cout << "Please enter the input filename (xyz or binary): ";
+    std::string input_filename;
+    std::cin >> input_filename;
+    std::cout << "Please enter the output filename: ";
+    std::string output_filename;
+    std::cin >> output_filename;
+    if (is_binary_dataset(input_filename)) {
+      write_xyz_from_binary(input_filename, output_filename);
+    } else {
+      std::cout << "Please enter the precision of positions and forces (64 or 32 bits): ";
+      int precision;
+      std::cin >> precision;
+      if (precision != 64 && precision != 32) {
+        std::cout << "The precision should be 64 or 32." << std::endl;
+        exit(1);
+      }
+      write_binary_dataset(input_filename, output_filename, precision / 8);
+    }
   } else {
     std::cout << "This is an invalid option.";
     exit(1);
@@ -5,32 +5,415 @@
     Author: Zheyong Fan (brucenju@gmail.com)
 
     Note: 
-    1) This is a serial code, which is used for teaching;
-    2) The Tersoff potential parameters by Lindsay&Broido are hard coded; 
-    3) The neighbor list is only built in the beginning (OK for stable solids);
+    1) This code is used for teaching; the loops over the particles are 
+       parallelized with OpenMP and the results do not depend on the number 
+       of threads;
+    2) The Tersoff potential parameters by Lindsay&Broido are hard coded 
+       (other potentials can be read from files, see note 15); 
+    3) The neighbor list is built with a cell list and a Verlet skin, and is 
+       only updated when a particle has moved more than half of the skin;
+       it is stored in compressed-sparse-row form (no maximum number of 
+       neighbors) and the bond data are indexed by bond;
     4) The box is assumed to be rectangular and is fixed (no pressure control);
     5) The temperature control is achieved by velocity re-scaling;
     6) The simulated system and various parameters are hard coded;
     7) The convective term of the heat current is dropped (OK for solids);
     8) The formulas in [PRB 92, 094301 (2015)] are used;
     9) My natural unit system: length--Angstrom; mass--amu; energy--eV;
-    10) compile with "g++ -O3 md_tersoff.cpp" and run with "./a.out"
+    10) compile with "g++ -O3 -fopenmp md_tersoff.cpp" and run with "./a.out";
+        "./a.out scaling" gives a strong-scaling report of the force evaluation
+        and "./a.out simd" compares the vectorized and scalar force evaluation
+    11) The code is templated on the precision: real_x for the positions, 
+        velocities, and accumulators and real_f for the force evaluation; 
+        "./a.out double" (the default; change it with -DPRECISION=...), 
+        "./a.out float", and "./a.out mixed" (float forces with double 
+        positions, velocities, and accumulators) select the mode, and 
+        "./a.out drift" compares the energy drift of the three modes
+    12) The hac is accumulated during the production stage with a streaming 
+        correlator (the heat current is not stored) and the partial hac and 
+        rtc are written to hac_partial.txt every tenth of the run; for long
+        correlation times (use_fft_for_hac), the heat current is stored 
+        instead and correlated by FFT (zero-padded, the same estimator as 
+        the direct sum) when the hac is needed; "./a.out hac" compares the 
+        direct, FFT, and streaming versions
+    13) "./a.out table" (or "./a.out table=N" for N intervals; 1000 by 
+        default) replaces the analytic Tersoff functions by cubic Hermite 
+        tables and reports the force error with respect to the analytic ones
+    14) Each MD run prints the time spent in each phase (neighbor list, bond
+        data, bond order, force, integration, thermostat, sampling, output) 
+        and writes it to profile_<precision>.json; "./a.out counters" adds 
+        the cycles, instructions, and last-level cache misses of each phase
+        (summed over the threads) from the Linux perf_event_open interface
+    15) "./a.out potential=../../potentials/tersoff/BN_Lindsay_2011.txt" 
+        reads a GPUMD tersoff_1988 or tersoff_1989 file; the honeycomb 
+        lattice is kept and the types are assigned by initialize_type (h-BN 
+        for B and N). A file with the built-in carbon parameters still uses 
+        the specialized (vectorized) kernels; other potentials use scalar 
+        multi-species kernels with a table of type triplets
+    16) "./a.out sort" (or "./a.out sort=K" for every K steps; 100 by 
+        default) sorts the particles along a Morton curve for cache 
+        locality; id keeps the original order; "./a.out cells=nx,ny" changes 
+        the number of unit cells (20,12 by default)
+    17) "./a.out replicas=R" runs R independent replicas (own velocities 
+        and thermostats) in one process; they are stacked along the free z 
+        direction and evaluated as one system, such that a small cell 
+        still keeps all the threads busy. Each hac is appended 
+        to hac.txt as for R separate runs, and the ensemble average and 
+        standard error of hac and rtc are written to hac_ensemble.txt
+    18) The random numbers come from a counter-based generator (Philox) 
+        keyed by (seed, replica, atom, step), so the velocities are drawn in
+        parallel and do not depend on the number of threads; the seed is 
+        the time unless given as "./a.out seed=S" and is printed at start
+    19) The production output is handed to a writer thread through a 
+        lock-free ring buffer, such that the MD loop does not wait for the 
+        disk; "binary" writes thermo.bin (with the heat current of each 
+        replica) instead of thermo.txt, "dump=K" writes the positions and 
+        velocities every K steps to traj.bin, and "convert=thermo.bin" or 
+        "convert=traj.bin" converts them to text (thermo.txt and 
+        heat_current.txt, or extended XYZ in traj.xyz)
+    20) "checkpoint=K" writes the whole state every K steps to restart.bin
+        and the equilibrated state to equilibrated.bin; "restart=FILE" 
+        continues from such a file (same precision, cells, replicas, 
+        potential parameters, table size, and binary option), and the 
+        outputs of a continued production stage are cut back to the 
+        checkpoint and appended to, such that they are identical to those 
+        of an uninterrupted run
+    21) "hnemd=fx,fy,fz" (in 1/A) replaces the Green-Kubo production stage 
+        by homogeneous non-equilibrium MD [PRB 99, 064308 (2019)]: the 
+        driving force is found from the partial forces of the bonds, the 
+        velocities are re-scaled at each step, and the running kappa 
+        <J> / (T V |Fe|) is written to kappa.txt (time, kappa, and the 
+        standard error over the replicas)
+    22) Ne and Np are upper limits when tolerances are given: with 
+        "drift_tol=X" (eV/atom/ps) the equilibration stops at the first 
+        tenth where the drift of the potential energy since the last tenth
+        is below X with 95% confidence, and with "kappa_tol=X" the 
+        production stops at the first tenth where the relative error of 
+        kappa is below X (block-averaged error of HNEMD, or the error over 
+        at least 4 replicas of EMD, once the largest correlation time has 
+        4 Nc time origins); with a tolerance, the decisions and the block
+        averages of the production stage are written to convergence.txt, 
+        which a restart cuts back to the checkpoint like the other outputs
+    23) tersoff_batch.h and tersoff_batch.cpp reuse the force evaluation of 
+        this file as a library for many small structures (energy, forces, 
+        and virial tensor of each), evaluated in parallel by a pool of 
+        threads with one structure per thread; tersoff_batch_benchmark.cpp
+        reports the throughput (see tersoff_batch.h)
 */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 #define K_B                      8.617343e-5 // Boltzmann's constant  
 #define TIME_UNIT_CONVERSION     1.018051e+1 // fs     <-> my natural unit
 #define KAPPA_UNIT_CONVERSION    1.573769e+5 // W/(mK) <-> my natural unit
 #define PRESSURE_UNIT_CONVERSION 1.602177e+2 // eV/A^3 <-> my natural unit
+#define PRECISION_DOUBLE 0 // real_x = real_f = double
+#define PRECISION_FLOAT  1 // real_x = real_f = float
+#define PRECISION_MIXED  2 // real_x = double and real_f = float
+#ifndef PRECISION
+#define PRECISION PRECISION_DOUBLE
+#endif
+const char *precision_names[3] = {"double", "float", "mixed"};
+#define PROP_NONE   0 // forces only
+#define PROP_ENERGY 1 // potential energy in prop[0]
+#define PROP_VIRIAL 2 // virial in prop[1-3]
+#define PROP_HEAT   4 // heat current in prop[4-6]
+#define PROP_ALL    (PROP_ENERGY | PROP_VIRIAL | PROP_HEAT)
+
+// the vectorized kernels are compiled for several instruction sets (see 
+// below) and the helpers must be inlined into every clone of them
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_TARGETS __attribute__((target_clones( \
+    "avx512f", "avx2", "default")))
+#define SIMD_INLINE inline __attribute__((always_inline))
+#else
+#define SIMD_TARGETS
+#define SIMD_INLINE inline
+#endif
+
+// wall-clock time in seconds (clock() would add up the time of all threads)
+double get_time()
+{
+    return std::chrono::duration<double>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+    Profiling of the MD loop (see note 14)
+    The wall-clock time of each phase is accumulated between phase_begin and
+    phase_end. Optionally, hardware counters (cycles, instructions, and LLC 
+    misses) are opened with perf_event_open for every OpenMP thread and their
+    increments (summed over the threads) are attributed to the phases too.
+    The profiler is a global object such that the force evaluation can be 
+    instrumented without changing its interface; it does nothing unless it 
+    has been started.
+*/
+#define PHASE_NEIGHBOR   0 // update_neighbor
+#define PHASE_BOND       1 // find_bond_data
+#define PHASE_B_BP       2 // find_b_and_bp
+#define PHASE_FORCE      3 // find_force_tersoff (with accumulate_force)
+#define PHASE_INTEGRATE  4 // integrate
+#define PHASE_THERMOSTAT 5 // scale_velocity
+#define PHASE_SAMPLING   6 // thermodynamic properties, hac, and energy fit
+#define PHASE_OUTPUT     7 // thermo.txt and the hac files
+#define PHASE_SORT       8 // sort_particles
+#define NUM_PHASES       9
+#define NUM_COUNTERS     3 // cycles, instructions, and LLC misses
+
+const char *phase_names[NUM_PHASES] = 
+{
+    "neighbor", "bond_data", "b_and_bp", "force", "integrate", "thermostat", 
+    "sampling", "output", "sort"
+};
+const char *counter_names[NUM_COUNTERS] = {"cycles", "instructions", "llc_misses"};
+
+struct Profiler
+{
+    int enabled;                 // 1 between start and stop_profiling
+    int num_fds;                 // number of threads with counters (or 0)
+    int *fd;                     // counters of the threads
+    double time_start;           // start of the profiled run
+    double time_total;           // duration of the profiled run
+    double time_begin;           // start of the current phase
+    long long count_begin[NUM_COUNTERS];  // counters at the start of it
+    double time[NUM_PHASES];     // accumulated time of the phases
+    long long calls[NUM_PHASES]; // number of calls of the phases
+    long long count[NUM_PHASES][NUM_COUNTERS]; // accumulated counters
+};
+Profiler profiler = {};
+
+// open the counters of all the OpenMP threads; returns 0 if not possible
+int open_counters()
+{
+#ifdef __linux__
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+    pid_t *tid = (pid_t*) malloc(num_threads * sizeof(pid_t));
+    for (int t = 0; t < num_threads; ++t) { tid[t] = 0; }
+#pragma omp parallel num_threads(num_threads)
+    {
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        tid[t] = (pid_t) syscall(SYS_gettid);
+    }
+
+    const unsigned long long config[NUM_COUNTERS] = 
+    {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, 
+        PERF_COUNT_HW_CACHE_MISSES
+    };
+    profiler.fd = (int*) malloc(num_threads * NUM_COUNTERS * sizeof(int));
+    profiler.num_fds = 0;
+    for (int t = 0; t < num_threads; ++t)
+    {
+        for (int k = 0; k < NUM_COUNTERS; ++k)
+        {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = config[k];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            int fd = syscall(SYS_perf_event_open, &attr, tid[t], -1, -1, 0);
+            if (fd < 0)
+            {
+                printf("Hardware counters are not available (%s).\n", 
+                    strerror(errno));
+                for (int f = 0; f < t * NUM_COUNTERS + k; ++f) 
+                { 
+                    close(profiler.fd[f]); 
+                }
+                free(profiler.fd);
+                free(tid);
+                return 0;
+            }
+            profiler.fd[t * NUM_COUNTERS + k] = fd;
+        }
+    }
+    profiler.num_fds = num_threads;
+    free(tid);
+    return 1;
+#else
+    printf("Hardware counters are only available on Linux.\n");
+    return 0;
+#endif
+}
+
+// current values of the counters summed over the threads
+void read_counters(long long count[NUM_COUNTERS])
+{
+    for (int k = 0; k < NUM_COUNTERS; ++k) { count[k] = 0; }
+#ifdef __linux__
+    for (int t = 0; t < profiler.num_fds; ++t)
+    {
+        for (int k = 0; k < NUM_COUNTERS; ++k)
+        {
+            long long value = 0;
+            if (read(profiler.fd[t * NUM_COUNTERS + k], &value, sizeof(value))
+                == sizeof(value)) 
+            { 
+                count[k] += value; 
+            }
+        }
+    }
+#endif
+}
+
+void start_profiling(int use_counters)
+{
+    memset(&profiler, 0, sizeof(profiler));
+    if (use_counters) { open_counters(); }
+    profiler.enabled = 1;
+    profiler.time_start = get_time();
+}
+
+void stop_profiling()
+{
+    profiler.time_total = get_time() - profiler.time_start;
+    profiler.enabled = 0;
+#ifdef __linux__
+    for (int f = 0; f < profiler.num_fds * NUM_COUNTERS; ++f) 
+    {
+        close(profiler.fd[f]); 
+    }
+#endif
+    if (profiler.num_fds > 0) { free(profiler.fd); }
+}
+
+inline void phase_begin()
+{
+    if (!profiler.enabled) { return; }
+    if (profiler.num_fds > 0) { read_counters(profiler.count_begin); }
+    profiler.time_begin = get_time();
+}
+
+inline void phase_end(int phase)
+{
+    if (!profiler.enabled) { return; }
+    profiler.time[phase] += get_time() - profiler.time_begin;
+    profiler.calls[phase]++;
+    if (profiler.num_fds > 0) 
+    {
+        long long count[NUM_COUNTERS];
+        read_counters(count);
+        for (int k = 0; k < NUM_COUNTERS; ++k)
+        {
+            profiler.count[phase][k] += count[k] - profiler.count_begin[k];
+        }
+    }
+}
+
+// print a summary table of the last profiled run and write it to a JSON file
+void report_profiling
+(
+    const char *precision, int N, int num_steps, const char *simd, 
+    int table_size, const char *filename
+)
+{
+    int num_threads = 1;
+#ifdef _OPENMP
+    num_threads = omp_get_max_threads();
+#endif
+    int has_counters = (profiler.num_fds > 0);
+    double time_phases = 0.0;
+    for (int p = 0; p < NUM_PHASES; ++p) { time_phases += profiler.time[p]; }
+
+    printf
+    (
+        "\nProfile (%s precision, %d steps, %d threads, %g s):\n", 
+        precision, num_steps, num_threads, profiler.time_total
+    );
+    printf("%12s%12s%10s%10s%14s", "phase", "time(s)", "percent", "calls", 
+        "us/call");
+    if (has_counters) 
+    {
+        printf("%16s%16s%8s%14s", "cycles", "instructions", "IPC", "LLC misses");
+    }
+    printf("\n");
+    for (int p = 0; p <= NUM_PHASES; ++p)
+    {
+        const char *name = (p < NUM_PHASES) ? phase_names[p] : "other";
+        double time = (p < NUM_PHASES) 
+                    ? profiler.time[p] : profiler.time_total - time_phases;
+        long long calls = (p < NUM_PHASES) ? profiler.calls[p] : 0;
+        printf
+        (
+            "%12s%12.4f%10.2f%10lld%14.3f", name, time, 
+            time / profiler.time_total * 100.0, calls, 
+            calls > 0 ? time / calls * 1.0e6 : 0.0
+        );
+        if (has_counters && p < NUM_PHASES)
+        {
+            long long *count = profiler.count[p];
+            printf
+            (
+                "%16lld%16lld%8.2f%14lld", count[0], count[1], 
+                count[0] > 0 ? (double) count[1] / count[0] : 0.0, count[2]
+            );
+        }
+        printf("\n");
+    }
+
+    FILE *fid = fopen(filename, "w");
+    fprintf(fid, "{\n");
+    fprintf(fid, "  \"precision\": \"%s\",\n", precision);
+    fprintf(fid, "  \"num_atoms\": %d,\n", N);
+    fprintf(fid, "  \"num_steps\": %d,\n", num_steps);
+    fprintf(fid, "  \"num_threads\": %d,\n", num_threads);
+    fprintf(fid, "  \"simd\": \"%s\",\n", simd);
+    fprintf(fid, "  \"table_size\": %d,\n", table_size);
+    fprintf(fid, "  \"counters\": %s,\n", has_counters ? "true" : "false");
+    fprintf(fid, "  \"time_total\": %.9g,\n", profiler.time_total);
+    fprintf(fid, "  \"phases\": [\n");
+    for (int p = 0; p < NUM_PHASES; ++p)
+    {
+        fprintf
+        (
+            fid, "    {\"name\": \"%s\", \"time\": %.9g, \"calls\": %lld", 
+            phase_names[p], profiler.time[p], profiler.calls[p]
+        );
+        for (int k = 0; k < NUM_COUNTERS && has_counters; ++k)
+        {
+            fprintf
+            (fid, ", \"%s\": %lld", counter_names[k], profiler.count[p][k]);
+        }
+        fprintf(fid, "}%s\n", (p < NUM_PHASES - 1) ? "," : "");
+    }
+    fprintf(fid, "  ]\n");
+    fprintf(fid, "}\n");
+    fclose(fid);
+}
 
 // apply the minimum image convention
+template <typename real>
 void apply_mic
 (
     int pbc[3], double box[3], double lxh, double lyh, double lzh, 
-    double &x12, double &y12, double &z12
+    real &x12, real &y12, real &z12
 )
 {
     if (pbc[0] == 1)
@@ -47,48 +430,419 @@ void apply_mic
     }
 }
 
-// contruct the neighbor list
+// put the particles back into the box in the periodic directions
+template <typename real_x>
+void apply_pbc
+(int N, int pbc[3], double box[3], real_x *x, real_x *y, real_x *z)
+{
+    for (int n = 0; n < N; ++n)
+    {
+        if (pbc[0] == 1) { x[n] -= floor(x[n] / box[0]) * box[0]; }
+        if (pbc[1] == 1) { y[n] -= floor(y[n] / box[1]) * box[1]; }
+        if (pbc[2] == 1) { z[n] -= floor(z[n] / box[2]) * box[2]; }
+    }
+}
+
+// find the cell index in one direction (clamped for free boundaries)
+inline int find_cell_id(int pbc, double box, int nc, double x)
+{
+    int i = (int) floor(x / box * nc);
+    if (pbc == 1)
+    {
+        while (i < 0) { i += nc; }
+        while (i >= nc) { i -= nc; }
+    }
+    else
+    {
+        if (i < 0) { i = 0; }
+        if (i >= nc) { i = nc - 1; }
+    }
+    return i;
+}
+
+// Compressed-sparse-row (CSR) neighbor list: the NN[n1] neighbors of n1 are
+// NL[NO[n1] + i1], 0 <= i1 < NN[n1], in increasing order, and NO[n1] + i1
+// is also the index of the bond n1 -> NL[NO[n1] + i1] in the bond data; the
+// memory grows with the number of bonds and there is no limit on NN
+struct Neighbor
+{
+    int *NN;      // number of neighbors
+    int *NO;      // offsets (N + 1 of them; NO[N] is the number of bonds)
+    int *NL;      // neighbor indices
+    int *reverse; // index NO[n2] + k of the bond n2 -> n1 = NL[NO[n2] + k]
+    int capacity; // allocated length of NL and reverse
+    int nn_max;   // largest number of neighbors
+};
+
+void allocate_neighbor(int N, Neighbor &neighbor)
+{
+    neighbor.NN = (int*) malloc(N * sizeof(int));
+    neighbor.NO = (int*) malloc((N + 1) * sizeof(int));
+    neighbor.NL = NULL;
+    neighbor.reverse = NULL;
+    neighbor.capacity = 0;
+    neighbor.nn_max = 0;
+}
+
+void free_neighbor(Neighbor &neighbor)
+{
+    free(neighbor.NN); free(neighbor.NO); free(neighbor.NL); 
+    free(neighbor.reverse);
+}
+
+// find the offsets from NN and make room for the bonds (with 20% to spare)
+void find_neighbor_offset(int N, Neighbor &neighbor)
+{
+    int *NN = neighbor.NN, *NO = neighbor.NO;
+    NO[0] = 0;
+    neighbor.nn_max = 0;
+    for (int n = 0; n < N; ++n)
+    {
+        NO[n + 1] = NO[n] + NN[n];
+        if (NN[n] > neighbor.nn_max) { neighbor.nn_max = NN[n]; }
+    }
+    if (NO[N] > neighbor.capacity)
+    {
+        neighbor.capacity = NO[N] + NO[N] / 5;
+        free(neighbor.NL); free(neighbor.reverse);
+        neighbor.NL = (int*) malloc(neighbor.capacity * sizeof(int));
+        neighbor.reverse = (int*) malloc(neighbor.capacity * sizeof(int));
+    }
+}
+
+// contruct the neighbor list using a cell list: O(N) instead of O(N^2);
+// the neighbors are counted first and then filled in
+template <typename real_x>
 void find_neighbor
 (
-    int N, int *NN, int *NL, int pbc[3], double box[3],
-    double *x, double *y, double *z, int MN, double cutoff
-)              
+    int N, Neighbor &neighbor, int pbc[3], double box[3],
+    real_x *x, real_x *y, real_x *z, double cutoff
+)
 {
     double lxh = box[0] * 0.5;
     double lyh = box[1] * 0.5;
-    double lzh = box[2] * 0.5; 
+    double lzh = box[2] * 0.5;
     double cutoff_square = cutoff * cutoff;
-    for (int n = 0; n < N; n++) {NN[n] = 0;}
-    for (int n1 = 0; n1 < N - 1; n1++)
-    {  
-        for (int n2 = n1 + 1; n2 < N; n2++)
-        {   
-            double x12 = x[n2] - x[n1];
-            double y12 = y[n2] - y[n1];
-            double z12 = z[n2] - z[n1];
-            apply_mic(pbc, box, lxh, lyh, lzh, x12, y12, z12);
-            double  distance_square = x12 * x12 + y12 * y12 + z12 * z12;
-            if (distance_square < cutoff_square)
-            {        
-                NL[n1 * MN + NN[n1]] = n2;
-                NN[n1]++;
-                NL[n2 * MN + NN[n2]] = n1;
-                NN[n2]++;
-            }
-            if (NN[n1] > MN)
-            {
-                printf("Error: MN is too small.\n");
-                exit(1);
+
+    // the cell size is not smaller than the cutoff
+    int nc[3];
+    for (int d = 0; d < 3; ++d)
+    {
+        if (pbc[d] == 1 && box[d] < 2.0 * cutoff)
+        {
+            printf("Error: box is too small for the neighbor list cutoff.\n");
+            exit(1);
+        }
+        nc[d] = (int) floor(box[d] / cutoff);
+        if (nc[d] < 1) { nc[d] = 1; }
+    }
+    int N_cells = nc[0] * nc[1] * nc[2];
+
+    // sort the particles into cells (counting sort)
+    int *cell_id = (int*) malloc(N * sizeof(int));
+    int *cell_count = (int*) malloc(N_cells * sizeof(int));
+    int *cell_count_sum = (int*) malloc(N_cells * sizeof(int));
+    int *cell_contents = (int*) malloc(N * sizeof(int));
+    for (int c = 0; c < N_cells; ++c) { cell_count[c] = 0; }
+    for (int n = 0; n < N; ++n)
+    {
+        int ix = find_cell_id(pbc[0], box[0], nc[0], x[n]);
+        int iy = find_cell_id(pbc[1], box[1], nc[1], y[n]);
+        int iz = find_cell_id(pbc[2], box[2], nc[2], z[n]);
+        cell_id[n] = ix + nc[0] * (iy + nc[1] * iz);
+        cell_count[cell_id[n]]++;
+    }
+    cell_count_sum[0] = 0;
+    for (int c = 1; c < N_cells; ++c)
+    {
+        cell_count_sum[c] = cell_count_sum[c - 1] + cell_count[c - 1];
+    }
+    for (int c = 0; c < N_cells; ++c) { cell_count[c] = 0; }
+    for (int n = 0; n < N; ++n)
+    {
+        int c = cell_id[n];
+        cell_contents[cell_count_sum[c] + cell_count[c]] = n;
+        cell_count[c]++;
+    }
+
+    // loop over the neighboring cells; each cell is visited only once even
+    // if there are less than 3 cells in a periodic direction
+    int lower[3], upper[3];
+    for (int d = 0; d < 3; ++d)
+    {
+        lower[d] = -1;
+        upper[d] = 1;
+        if (pbc[d] == 1 && nc[d] < 3) { lower[d] = 0; upper[d] = nc[d] - 1; }
+    }
+    int *NN = neighbor.NN;
+    for (int pass = 0; pass < 2; ++pass) // count and fill
+    {
+        if (pass == 1) { find_neighbor_offset(N, neighbor); }
+        int *NO = neighbor.NO, *NL = neighbor.NL;
+#pragma omp parallel for schedule(static)
+        for (int n1 = 0; n1 < N; ++n1)
+        {
+            int *list = (pass == 1) ? NL + NO[n1] : NULL;
+            int count = 0;
+            int c1 = cell_id[n1];
+            int ix = c1 % nc[0];
+            int iy = (c1 / nc[0]) % nc[1];
+            int iz = c1 / (nc[0] * nc[1]);
+            for (int k = lower[2]; k <= upper[2]; ++k)
+            {
+                int jz = iz + k;
+                if (pbc[2] == 1) { jz = (jz + nc[2]) % nc[2]; }
+                else if (jz < 0 || jz >= nc[2]) { continue; }
+                for (int j = lower[1]; j <= upper[1]; ++j)
+                {
+                    int jy = iy + j;
+                    if (pbc[1] == 1) { jy = (jy + nc[1]) % nc[1]; }
+                    else if (jy < 0 || jy >= nc[1]) { continue; }
+                    for (int i = lower[0]; i <= upper[0]; ++i)
+                    {
+                        int jx = ix + i;
+                        if (pbc[0] == 1) { jx = (jx + nc[0]) % nc[0]; }
+                        else if (jx < 0 || jx >= nc[0]) { continue; }
+                        int c2 = jx + nc[0] * (jy + nc[1] * jz);
+                        for (int m = 0; m < cell_count[c2]; ++m)
+                        {
+                            int n2 = cell_contents[cell_count_sum[c2] + m];
+                            if (n2 == n1) { continue; }
+                            real_x x12 = x[n2] - x[n1];
+                            real_x y12 = y[n2] - y[n1];
+                            real_x z12 = z[n2] - z[n1];
+                            apply_mic(pbc, box, lxh, lyh, lzh, x12, y12, z12);
+                            real_x distance_square 
+                                = x12 * x12 + y12 * y12 + z12 * z12;
+                            if (distance_square < cutoff_square)
+                            {
+                                if (list) { list[count] = n2; }
+                                count++;
+                            }
+                        }
+                    }
+                }
+            }
+            if (pass == 0) { NN[n1] = count; continue; }
+
+            // sort the neighbors so that the summation order is reproducible
+            for (int i1 = 1; i1 < count; ++i1)
+            {
+                int n2 = list[i1];
+                int i2 = i1 - 1;
+                while (i2 >= 0 && list[i2] > n2)
+                {
+                    list[i2 + 1] = list[i2];
+                    i2--;
+                }
+                list[i2 + 1] = n2;
             }
         }
-    } 
+    }
+
+    free(cell_id); free(cell_count); free(cell_count_sum); free(cell_contents);
+}
+
+// find the index of the reverse bond n2 -> n1 for each bond n1 -> n2
+void find_reverse_bond(int N, Neighbor &neighbor)
+{
+    int *NN = neighbor.NN, *NO = neighbor.NO, *NL = neighbor.NL;
+    int *reverse = neighbor.reverse;
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        for (int i1 = 0; i1 < NN[n1]; ++i1)
+        {
+            int n2 = NL[NO[n1] + i1];
+            for (int k = 0; k < NN[n2]; ++k)
+            {
+                if (NL[NO[n2] + k] == n1) 
+                { 
+                    reverse[NO[n1] + i1] = NO[n2] + k;
+                    break; 
+                }
+            }
+        }
+    }
+}
+
+// update the neighbor list if a particle has moved more than half of the skin
+// since the last update; return 1 if the neighbor list has been updated
+template <typename real_x>
+int update_neighbor
+(
+    int N, Neighbor &neighbor, int pbc[3], double box[3],
+    real_x *x, real_x *y, real_x *z, real_x *x0, real_x *y0, real_x *z0,
+    double cutoff, double skin, int is_first
+)
+{
+    if (!is_first)
+    {
+        double lxh = box[0] * 0.5;
+        double lyh = box[1] * 0.5;
+        double lzh = box[2] * 0.5;
+        double d2_max = 0.0;
+#pragma omp parallel for schedule(static) reduction(max:d2_max)
+        for (int n = 0; n < N; ++n)
+        {
+            real_x dx = x[n] - x0[n];
+            real_x dy = y[n] - y0[n];
+            real_x dz = z[n] - z0[n];
+            apply_mic(pbc, box, lxh, lyh, lzh, dx, dy, dz);
+            double d2 = dx * dx + dy * dy + dz * dz;
+            if (d2 > d2_max) { d2_max = d2; }
+        }
+        if (d2_max < 0.25 * skin * skin) { return 0; }
+    }
+
+    apply_pbc(N, pbc, box, x, y, z);
+    find_neighbor(N, neighbor, pbc, box, x, y, z, cutoff + skin);
+    find_reverse_bond(N, neighbor);
+    for (int n = 0; n < N; ++n)
+    {
+        x0[n] = x[n];
+        y0[n] = y[n];
+        z0[n] = z[n];
+    }
+    return 1;
+}
+
+/*
+    Space-filling-curve ordering of the particles (optional, see note 16)
+    The particles are sorted along a Morton (Z-order) curve of their 
+    positions, such that particles close in space are close in memory and 
+    the neighbor accesses (x[n2], NL[NO[n2] + k], the reverse bonds) stay
+    in cache. All the per-particle arrays are permuted, id[n] keeps the 
+    original index of particle n (for output in the original order), and 
+    the neighbor list is remapped instead of being rebuilt, such that the 
+    neighbor list updates happen at the same steps. 
+*/
+
+// spread the lowest 21 bits of i to every third bit
+inline unsigned long long spread_bits(unsigned long long i)
+{
+    i &= 0x1fffffULL;
+    i = (i | (i << 32)) & 0x1f00000000ffffULL;
+    i = (i | (i << 16)) & 0x1f0000ff0000ffULL;
+    i = (i | (i << 8))  & 0x100f00f00f00f00fULL;
+    i = (i | (i << 4))  & 0x10c30c30c30c30c3ULL;
+    i = (i | (i << 2))  & 0x1249249249249249ULL;
+    return i;
+}
+
+// Morton key of a position with 21 bits for each (fractional) coordinate
+inline unsigned long long find_morton_key(double box[3], double r[3])
+{
+    unsigned long long key = 0;
+    for (int d = 0; d < 3; ++d)
+    {
+        double s = r[d] / box[d]; // clamped for free boundaries
+        s = (s < 0.0) ? 0.0 : ((s >= 1.0) ? 0.999999999 : s);
+        key |= spread_bits((unsigned long long) (s * 2097152.0)) << d;
+    }
+    return key;
+}
+
+struct Sort_Item
+{
+    unsigned long long key;
+    int n;
+};
+
+int compare_sort_items(const void *a, const void *b)
+{
+    const Sort_Item *p = (const Sort_Item*) a;
+    const Sort_Item *q = (const Sort_Item*) b;
+    if (p->key != q->key) { return (p->key < q->key) ? -1 : 1; }
+    return p->n - q->n; // a total order: the sort is reproducible
+}
+
+// a[n] = a[perm[n]] with a buffer of N elements
+template <typename T>
+void permute(int N, int *perm, T *a, void *buffer)
+{
+    T *b = (T*) buffer;
+    for (int n = 0; n < N; ++n) { b[n] = a[perm[n]]; }
+    memcpy(a, b, N * sizeof(T));
+}
+
+// sort the particles along the Morton curve of their positions at the last
+// neighbor list update (which are in the box)
+template <typename real_x, typename real_f>
+void sort_particles
+(
+    int N, double box[3], Neighbor &neighbor, int *id, int *type, 
+    real_x *m, real_x *x, real_x *y, real_x *z, real_x *x0, real_x *y0, 
+    real_x *z0, real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy,
+    real_f *fz
+)
+{
+    Sort_Item *item = (Sort_Item*) malloc(N * sizeof(Sort_Item));
+    for (int n = 0; n < N; ++n)
+    {
+        double r[3] = {(double) x0[n], (double) y0[n], (double) z0[n]};
+        item[n].key = find_morton_key(box, r);
+        item[n].n = n;
+    }
+    qsort(item, N, sizeof(Sort_Item), compare_sort_items);
+    int *perm = (int*) malloc(N * sizeof(int));    // new -> old
+    int *inverse = (int*) malloc(N * sizeof(int)); // old -> new
+    for (int n = 0; n < N; ++n)
+    {
+        perm[n] = item[n].n; 
+        inverse[perm[n]] = n; 
+    }
+    free(item);
+
+    int *NN = neighbor.NN, *NO = neighbor.NO, *NL = neighbor.NL;
+    int num_bonds = NO[N];
+    void *buffer = malloc((N + 1 + num_bonds) * sizeof(int) 
+                 + N * sizeof(double));
+    permute(N, perm, id, buffer); permute(N, perm, type, buffer);
+    permute(N, perm, m, buffer);
+    permute(N, perm, x, buffer);  permute(N, perm, y, buffer);  
+    permute(N, perm, z, buffer);
+    permute(N, perm, x0, buffer); permute(N, perm, y0, buffer); 
+    permute(N, perm, z0, buffer);
+    permute(N, perm, vx, buffer); permute(N, perm, vy, buffer); 
+    permute(N, perm, vz, buffer);
+    permute(N, perm, fx, buffer); permute(N, perm, fy, buffer); 
+    permute(N, perm, fz, buffer);
+    permute(N, perm, NN, buffer);
+
+    // remap the neighbor list and sort it again (as in find_neighbor)
+    int *NO_old = (int*) buffer;
+    int *NL_old = NO_old + N + 1;
+    memcpy(NO_old, NO, (N + 1) * sizeof(int));
+    memcpy(NL_old, NL, num_bonds * sizeof(int));
+    find_neighbor_offset(N, neighbor);
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        int *row_old = NL_old + NO_old[perm[n1]];
+        int *row = NL + NO[n1];
+        for (int i1 = 0; i1 < NN[n1]; ++i1)
+        {
+            int n2 = inverse[row_old[i1]];
+            int i2 = i1 - 1;
+            while (i2 >= 0 && row[i2] > n2)
+            {
+                row[i2 + 1] = row[i2];
+                i2--;
+            }
+            row[i2 + 1] = n2;
+        }
+    }
+    find_reverse_bond(N, neighbor);
+    free(buffer); free(perm); free(inverse);
 }
 
 // initialize the positions: I take graphene as an example here 
+template <typename real_x>
 void initialize_position 
 (
     int nx, int ny, int nz, double ax, double ay, double az, 
-    double *x, double *y, double *z
+    real_x *x, real_x *y, real_x *z
 )
 {
     int n0 = 4; // rectangular unit cell
@@ -114,83 +868,203 @@ void initialize_position
     }
 } 
 
+// initialize the types on the same lattice: the two sublattices of the 
+// honeycomb get the first and the last types (such as h-BN for B and N), 
+// and with three or more types the first half (in x) gets the second type
+// (such as a graphene/h-BN interface for B, C, and N)
+void initialize_type(int nx, int ny, int nz, int num_types, int *type)
+{
+    int n0 = 4; // the same unit cell as in initialize_position
+    int sublattice[4] = {0, 1, 1, 0};
+    int n = 0;
+    for (int ix = 0; ix < nx; ++ix)
+    {
+        for (int iy = 0; iy < ny; ++iy)
+        {
+            for (int iz = 0; iz < nz; ++iz)
+            {
+                for (int i = 0; i < n0; ++i)
+                {
+                    type[n] = sublattice[i] * (num_types - 1);
+                    if (num_types > 2 && ix < nx / 2) { type[n] = 1; }
+                    n++;
+                }
+            }
+        }
+    }
+}
+
+/*
+    Counter-based random numbers (Philox4x32-10, Salmon et al., SC'11)
+    The random numbers are a pure function of a key (seed, replica) and a 
+    counter (atom, step, stream): there is no generator state, such that 
+    each particle (or data point) draws its own numbers on any thread and 
+    in any order, and the results do not depend on the number of threads.
+    Step 0 is the initialization; the streams separate the different uses.
+*/
+#define RNG_VELOCITY     0 // initial velocities
+#define RNG_DISPLACEMENT 1 // random displacements in check_simd/check_table
+#define RNG_SIGNAL       2 // random signal in check_hac
+
+inline void philox4x32_10(const uint32_t key[2], uint32_t ctr[4])
+{
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; ++round)
+    {
+        uint64_t p0 = (uint64_t) 0xD2511F53u * ctr[0];
+        uint64_t p1 = (uint64_t) 0xCD9E8D57u * ctr[2];
+        uint32_t c0 = (uint32_t) (p1 >> 32) ^ ctr[1] ^ k0;
+        uint32_t c2 = (uint32_t) (p0 >> 32) ^ ctr[3] ^ k1;
+        ctr[1] = (uint32_t) p1;
+        ctr[3] = (uint32_t) p0;
+        ctr[0] = c0;
+        ctr[2] = c2;
+        k0 += 0x9E3779B9u; // the Weyl sequence of the key schedule
+        k1 += 0xBB67AE85u;
+    }
+}
+
+// four uniform random numbers in (0, 1)
+inline void find_random_uniform
+(
+    unsigned int seed, int replica, int atom, int step, int stream, 
+    double u[4]
+)
+{
+    uint32_t key[2] = {seed, (uint32_t) replica};
+    uint32_t ctr[4] = 
+    {
+        (uint32_t) atom, (uint32_t) step, (uint32_t) stream, 0u
+    };
+    philox4x32_10(key, ctr);
+    for (int k = 0; k < 4; ++k) { u[k] = (ctr[k] + 0.5) / 4294967296.0; }
+}
+
 // scale the velocities to reach the target temperature
+template <typename real_x>
 void scale_velocity
-(int N, double T_0, double *m, double *vx, double *vy, double *vz)
+(int N, double T_0, real_x *m, real_x *vx, real_x *vy, real_x *vz)
 {  
-    double temperature = 0.0;
-    for (int n = 0; n < N; ++n) 
+    real_x temperature = 0.0;
+    for (int n = 0; n < N; ++n)
     {
-        double v2 = vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n];     
+        real_x v2 = vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n];     
         temperature += m[n] * v2; 
     }
     temperature /= 3.0 * K_B * N;
-    double scale_factor = sqrt(T_0 / temperature);
+    real_x scale_factor = sqrt(T_0 / temperature);
+#pragma omp parallel for schedule(static)
     for (int n = 0; n < N; ++n)
-    { 
+    {
         vx[n] *= scale_factor;
         vy[n] *= scale_factor;
         vz[n] *= scale_factor;
     }
 }  
 
-// initialize the velocites (only the linear momentum is zeroed)  
-void initialize_velocity
-(int N, double T_0, double *m, double *vx, double *vy, double *vz)
+// scale the velocities of each of the num_replicas independent replicas 
+// (particle n belongs to replica id[n] / (N / num_replicas)) to reach the 
+// target temperature; scale_factor has num_replicas elements (work space)
+template <typename real_x>
+void scale_velocity
+(
+    int N, int num_replicas, int *id, double T_0, real_x *m, 
+    real_x *vx, real_x *vy, real_x *vz, real_x *scale_factor
+)
 {
-    double momentum_average[3] = {0.0, 0.0, 0.0};
+    int N_replica = N / num_replicas;
+    for (int r = 0; r < num_replicas; ++r) { scale_factor[r] = 0.0; }
     for (int n = 0; n < N; ++n)
+    {
+        real_x v2 = vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n];     
+        scale_factor[id[n] / N_replica] += m[n] * v2; 
+    }
+    for (int r = 0; r < num_replicas; ++r) 
     { 
-        vx[n] = -1.0 + (rand() * 2.0) / RAND_MAX; 
-        vy[n] = -1.0 + (rand() * 2.0) / RAND_MAX; 
-        vz[n] = -1.0 + (rand() * 2.0) / RAND_MAX;    
-        
-        momentum_average[0] += m[n] * vx[n] / N;
-        momentum_average[1] += m[n] * vy[n] / N;
-        momentum_average[2] += m[n] * vz[n] / N;
-    } 
-    for (int n = 0; n < N; ++n) 
-    { 
-        vx[n] -= momentum_average[0] / m[n];
-        vy[n] -= momentum_average[1] / m[n];
+        real_x temperature = scale_factor[r] / (3.0 * K_B * N_replica);
+        scale_factor[r] = sqrt(T_0 / temperature);
+    }
+#pragma omp parallel for schedule(static)
+    for (int n = 0; n < N; ++n)
+    {
+        real_x factor = scale_factor[id[n] / N_replica];
+        vx[n] *= factor;
+        vy[n] *= factor;
+        vz[n] *= factor;
+    }
+}
+
+// initialize the velocites of a replica from the counter-based random 
+// numbers (only the linear momentum is zeroed)  
+template <typename real_x>
+void initialize_velocity
+(
+    int N, double T_0, unsigned int seed, int replica, real_x *m, 
+    real_x *vx, real_x *vy, real_x *vz
+)
+{
+#pragma omp parallel for schedule(static)
+    for (int n = 0; n < N; ++n)
+    {
+        double u[4];
+        find_random_uniform(seed, replica, n, 0, RNG_VELOCITY, u);
+        vx[n] = -1.0 + u[0] * 2.0; 
+        vy[n] = -1.0 + u[1] * 2.0; 
+        vz[n] = -1.0 + u[2] * 2.0;    
+    }
+    real_x momentum_average[3] = {0.0, 0.0, 0.0};
+    for (int n = 0; n < N; ++n)
+    {
+        momentum_average[0] += m[n] * vx[n] / N;
+        momentum_average[1] += m[n] * vy[n] / N;
+        momentum_average[2] += m[n] * vz[n] / N;
+    } 
+    for (int n = 0; n < N; ++n)
+    {
+        vx[n] -= momentum_average[0] / m[n];
+        vy[n] -= momentum_average[1] / m[n];
         vz[n] -= momentum_average[2] / m[n]; 
     }
     scale_velocity(N, T_0, m, vx, vy, vz);
 }
 
 // The repulsive function and its derivative in the Tersoff potential
-inline void find_fr_and_frp(double d12, double &fr, double &frp)
+template <typename real_f>
+inline void find_fr_and_frp(real_f d12, real_f &fr, real_f &frp)
 {     
-    const double a = 1393.6;   
-    const double lambda = 3.4879;    
+    const real_f a = 1393.6;   
+    const real_f lambda = 3.4879;    
     fr  = a * exp(- lambda * d12);    
     frp = - lambda * fr;
 }
 
 // The attractive function and its derivative in the Tersoff potential
-inline void find_fa_and_fap(double d12, double &fa, double &fap)
+template <typename real_f>
+inline void find_fa_and_fap(real_f d12, real_f &fa, real_f &fap)
 {     
-    const double b = 430.0; // optimized
-    const double mu = 2.2119;   
+    const real_f b = 430.0; // optimized
+    const real_f mu = 2.2119;   
     fa  = b * exp(- mu * d12);    
     fap = - mu * fa;
 }
 
 // The attractive function in the Tersoff potential
-inline void find_fa(double d12, double &fa)
+template <typename real_f>
+inline void find_fa(real_f d12, real_f &fa)
 {     
-    const double b = 430.0;  
-    const double mu = 2.2119;   
+    const real_f b = 430.0;  
+    const real_f mu = 2.2119;   
     fa  = b * exp(- mu * d12);    
 }
 
 // The cutoff function and its derivative in the Tersoff potential
-inline void find_fc_and_fcp(double d12, double &fc, double &fcp)
+template <typename real_f>
+inline void find_fc_and_fcp(real_f d12, real_f &fc, real_f &fcp)
 {
-    const double r1 = 1.8;
-    const double r2 = 2.1;
-    const double pi = 3.141592653589793;
-    const double pi_factor = pi / (r2 - r1);
+    const real_f r1 = 1.8;
+    const real_f r2 = 2.1;
+    const real_f pi = 3.141592653589793;
+    const real_f pi_factor = pi / (r2 - r1);
     if (d12 < r1)
     {
         fc  = 1.0;
@@ -209,12 +1083,13 @@ inline void find_fc_and_fcp(double d12, double &fc, double &fcp)
 }
 
 // The cutoff function in the Tersoff potential
-inline void find_fc(double d12, double &fc)
+template <typename real_f>
+inline void find_fc(real_f d12, real_f &fc)
 {
-    const double r1 = 1.8;
-    const double r2 = 2.1;
-    const double pi = 3.141592653589793;
-    const double pi_factor = pi / (r2 - r1);
+    const real_f r1 = 1.8;
+    const real_f r2 = 2.1;
+    const real_f pi = 3.141592653589793;
+    const real_f pi_factor = pi / (r2 - r1);
     if (d12 < r1)
     {
         fc  = 1.0;
@@ -230,507 +1105,4712 @@ inline void find_fc(double d12, double &fc)
 }
 
 // The angular function and its derivative in the Tersoff potential
-inline void find_g_and_gp(double cos, double &g, double &gp)
-{
-    const double c = 38049.0;
-    const double d = 4.3484;
-    const double h = - 0.930; // optimized
-    const double c2 = c * c;
-    const double d2 = d * d;
-    const double c2overd2 = c2 / d2;  
-    double temp = d2 + (cos - h) * (cos - h);
-    g  = 1.0 + c2overd2 - c2 / temp;    
+template <typename real_f>
+inline void find_g_and_gp(real_f cos, real_f &g, real_f &gp)
+{
+    const real_f c = 38049.0;
+    const real_f d = 4.3484;
+    const real_f h = - 0.930; // optimized
+    const real_f c2 = c * c;
+    const real_f d2 = d * d;
+    const real_f c2overd2 = c2 / d2;  
+    real_f temp = d2 + (cos - h) * (cos - h);
+    // c2 / d2 - c2 / temp without the cancellation (important for float)
+    g  = 1.0 + c2overd2 * (cos - h) * (cos - h) / temp;    
     gp = 2.0 * c2 * (cos - h) / (temp * temp);    
 }
 
 // The angular function in the Tersoff potential
-inline void find_g(double cos, double &g)
+template <typename real_f>
+inline void find_g(real_f cos, real_f &g)
 {
-    const double c = 38049.0;
-    const double d = 4.3484;
-    const double h = - 0.930;  // optimized
-    const double c2 = c * c;
-    const double d2 = d * d;
-    const double c2overd2 = c2 / d2;  
-    double temp = d2 + (cos - h) * (cos - h);
-    g  = 1.0 + c2overd2 - c2 / temp;      
+    const real_f c = 38049.0;
+    const real_f d = 4.3484;
+    const real_f h = - 0.930;  // optimized
+    const real_f c2 = c * c;
+    const real_f d2 = d * d;
+    const real_f c2overd2 = c2 / d2;  
+    real_f temp = d2 + (cos - h) * (cos - h);
+    g  = 1.0 + c2overd2 * (cos - h) * (cos - h) / temp;      
 }
 
-// pre-compute the bond-order functions and their derivatives
-void find_b_and_bp
+/*
+    Tabulated Tersoff functions (optional, see note 13)
+    fr and fa are tabulated in [TABLE_R_MIN, r2], fc in [r1, r2], and g in 
+    [-1, 1], each with n intervals. The values and the derivatives at the 
+    nodes are exact and cubic Hermite interpolation is used in between. The 
+    cubic of each interval is stored by its (double precision) coefficients
+    rather than by the node values, because differences of rounded node 
+    values would spoil the derivatives in float precision. The arguments are 
+    clamped to the tabulated ranges and fc is set to zero beyond r2.
+*/
+#define TABLE_R_MIN 1.0 // much shorter than any C-C bond
+
+template <typename real_f>
+struct Tersoff_Table
+{
+    int n;                    // number of intervals of each table
+    real_f h_inv_r;           // inverse spacing for fr and fa
+    real_f h_inv_fc;          // inverse spacing for fc
+    real_f h_inv_g;           // inverse spacing for g
+    real_f *fr, *fa, *fc, *g; // 4 coefficients of the cubic per interval
+};
+
+// the cubic c0 + c1 t + c2 t^2 + c3 t^3 (0 <= t <= 1) of each interval
+// [x0 + i * h, x0 + (i + 1) * h] of [x0, x1] with the exact f and h * f' 
+// at both ends
+template <typename real_f>
+void fill_table
 (
-    int N, int *NN, int*NL, int MN, int pbc[3], double box[3],
-    double *x, double *y, double *z, double *b, double *bp
+    int n, double x0, double x1, void (*find_f)(double, double &, double &),
+    real_f *table
 )
 {
-    const double beta = 1.5724e-7;
-    const double n = 0.72751;     
-    const double minus_half_over_n = - 0.5 / n;
-
-    double lxh = box[0] * 0.5;
-    double lyh = box[1] * 0.5;
-    double lzh = box[2] * 0.5;
-    for (int n1 = 0; n1 < N; ++n1)
+    double h = (x1 - x0) / n;
+    double f0, fp0, f1, fp1;
+    find_f(x0, f0, fp0);
+    for (int i = 0; i < n; ++i)
     {
-        for (int i1 = 0; i1 < NN[n1]; ++i1)   
-        {       
-            int n2 = NL[n1 * MN + i1]; // we only know n2 != n1     
-            double x12, y12, z12;
-            x12 = x[n2] - x[n1];
-            y12 = y[n2] - y[n1];
-            z12 = z[n2] - z[n1]; 
-            apply_mic(pbc, box, lxh, lyh, lzh, x12, y12, z12);
-            double d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
-            
-            double zeta = 0.0;
-            for (int i2 = 0; i2 < NN[n1]; ++i2)
-            {
-                int n3 = NL[n1 * MN + i2];  // we only know n3 != n1  
-                if (n3 == n2) { continue; } // ensure that n3 != n2
-                double x13, y13, z13;
-                x13 = x[n3] - x[n1];
-                y13 = y[n3] - y[n1];
-                z13 = z[n3] - z[n1];
-                apply_mic(pbc, box, lxh, lyh, lzh, x13, y13, z13);
-
-                double d13 = sqrt(x13 * x13 + y13 * y13 + z13 * z13);
-                double cos = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
-                double fc13, g123; 
-                find_fc(d13, fc13);
-                find_g(cos, g123);
-                zeta += fc13 * g123;
-            } 
-            double bzn = pow(beta * zeta, n);
-            double b12 = pow(1.0 + bzn, minus_half_over_n);
-            b[n1 * MN + i1]  = b12;
-            bp[n1 * MN + i1] = - b12 * bzn * 0.5 / ((1.0 + bzn) * zeta);
-        }
+        double x = (i == n - 1) ? x1 : x0 + (i + 1) * h;
+        find_f(x, f1, fp1);
+        table[4 * i + 0] = f0;
+        table[4 * i + 1] = h * fp0;
+        table[4 * i + 2] = 3.0 * (f1 - f0) - h * (2.0 * fp0 + fp1);
+        table[4 * i + 3] = 2.0 * (f0 - f1) + h * (fp0 + fp1);
+        f0 = f1;
+        fp0 = fp1;
     }
 }
 
-// The force evaluation function for the Tersoff potential
-void find_force_tersoff
-(
-    int N, int *NN, int*NL, int MN, int pbc[3], double box[3], 
-    double *b, double *bp, double *x, double *y, double *z, double *vx, 
-    double *vy, double *vz, double *fx, double *fy, double *fz, double prop[7]
-)
+template <typename real_f>
+void allocate_table(int n, Tersoff_Table<real_f> &table)
 {
-    for (int n = 0; n < 7; ++n) { prop[n]=0.0; }
-    for (int n = 0; n < N; ++n) { fx[n]=fy[n]=fz[n]=0.0; }
-    double lxh = box[0] * 0.5;
-    double lyh = box[1] * 0.5;
-    double lzh = box[2] * 0.5;
+    const double r1 = 1.8;
+    const double r2 = 2.1;
+    table.n = n;
+    table.h_inv_r = n / (r2 - TABLE_R_MIN);
+    table.h_inv_fc = n / (r2 - r1);
+    table.h_inv_g = n / 2.0;
+    table.fr = (real_f*) malloc(n * 4 * sizeof(real_f));
+    table.fa = (real_f*) malloc(n * 4 * sizeof(real_f));
+    table.fc = (real_f*) malloc(n * 4 * sizeof(real_f));
+    table.g  = (real_f*) malloc(n * 4 * sizeof(real_f));
+    fill_table(n, TABLE_R_MIN, r2, find_fr_and_frp<double>, table.fr);
+    fill_table(n, TABLE_R_MIN, r2, find_fa_and_fap<double>, table.fa);
+    fill_table(n, r1, r2, find_fc_and_fcp<double>, table.fc);
+    fill_table(n, -1.0, 1.0, find_g_and_gp<double>, table.g);
+}
 
-    for (int n1 = 0; n1 < N; ++n1)
-    {
-        for (int i1 = 0; i1 < NN[n1]; ++i1)   
-        {       
-            int n2 = NL[n1 * MN + i1];
-            if (n2 < n1) { continue; } // Will use Newton's 3rd law!!!
-            double x12, y12, z12;
-            x12 = x[n2] - x[n1];
-            y12 = y[n2] - y[n1];
-            z12 = z[n2] - z[n1];
-            apply_mic(pbc, box, lxh, lyh, lzh, x12, y12, z12);
-          
-            double d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
-            double d12inv = 1.0 / d12;
-            double d12inv_square = d12inv * d12inv;
-
-            double fc12, fcp12;
-            double fa12, fap12;
-            double fr12, frp12;
-            find_fc_and_fcp(d12, fc12, fcp12);
-            find_fa_and_fap(d12, fa12, fap12);
-            find_fr_and_frp(d12, fr12, frp12);
-
-            double b12, bp12;
-  
-            double f12[3] = {0.0, 0.0, 0.0};   // d_U_i_d_r_ij
-            double f21[3] = {0.0, 0.0, 0.0};   // d_U_j_d_r_ji 
-            double p12 = 0.0;                  // U_ij
-            double p21 = 0.0;                  // U_ji
-           
-            // accumulate_force_12 
-            b12 = b[n1 * MN + i1]; 
-            double factor1 = - b12 * fa12 + fr12;
-            double factor2 = - b12 * fap12 + frp12;    
-            double factor3 = (fcp12 * factor1 + fc12 * factor2) / d12;   
-            f12[0] += x12 * factor3 * 0.5; 
-            f12[1] += y12 * factor3 * 0.5;
-            f12[2] += z12 * factor3 * 0.5;     
-            p12 += factor1 * fc12;
+template <typename real_f>
+void free_table(Tersoff_Table<real_f> &table)
+{
+    free(table.fr); free(table.fa); free(table.fc); free(table.g);
+}
 
-            // accumulate_force_21
-            int offset = 0;
-            for (int k = 0; k < NN[n2]; ++k)
-            {
-                if (NL[n2 * MN + k] == n1) 
-                { 
-                    offset = k;
-                    break; 
-                }
-            }
-            b12 = b[n2 * MN + offset]; 
-            factor1 = - b12 * fa12 + fr12;
-            factor2 = - b12 * fap12 + frp12;    
-            factor3 = (fcp12 * factor1 + fc12 * factor2) / d12;                   
-            f21[0] += -x12 * factor3 * 0.5; 
-            f21[1] += -y12 * factor3 * 0.5;
-            f21[2] += -z12 * factor3 * 0.5;           
-            p21 += factor1 * fc12;
+// cubic Hermite interpolation of f and f' at x from a table starting at x0
+template <typename real_f>
+SIMD_INLINE void find_from_table
+(
+    const real_f *table, int n, real_f x0, real_f h_inv, real_f x, 
+    real_f &f, real_f &fp
+)
+{
+    real_f s = (x - x0) * h_inv;
+    s = (s > 0) ? s : real_f(0);
+    s = (s < n) ? s : real_f(n);
+    int i = (int) s;
+    i = (i < n) ? i : n - 1;
+    real_f t = s - i;
+    real_f c0 = table[4 * i], c1 = table[4 * i + 1]; 
+    real_f c2 = table[4 * i + 2], c3 = table[4 * i + 3];
+    f = c0 + t * (c1 + t * (c2 + t * c3));
+    fp = (c1 + t * (2 * c2 + t * 3 * c3)) * h_inv;
+}
 
-            // accumulate_force_123
-            bp12 = bp[n1 * MN + i1]; 
-            for (int i2 = 0; i2 < NN[n1]; ++i2)
-            {    
-                int n3 = NL[n1 * MN + i2];     
-                if (n3 == n2) { continue; } 
-                double x13, y13, z13;
-                x13 = x[n3] - x[n1];
-                y13 = y[n3] - y[n1];
-                z13 = z[n3] - z[n1];
-                apply_mic(pbc, box, lxh, lyh, lzh, x13, y13, z13);
-
-                double d13 = sqrt(x13 * x13 + y13 * y13 + z13 * z13);         
-                double fc13, fa13;
-                find_fc(d13, fc13);
-                find_fa(d13, fa13); 
-                double bp13 = bp[n1 * MN + i2]; 
-
-                double cos123 = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
-                double g123, gp123;
-                find_g_and_gp(cos123, g123, gp123);
-                double cos_x = x13 / (d12 * d13) - x12 * cos123 / (d12 * d12);
-                double cos_y = y13 / (d12 * d13) - y12 * cos123 / (d12 * d12);
-                double cos_z = z13 / (d12 * d13) - z12 * cos123 / (d12 * d12);                        
-                double factor123a = (-bp12*fc12*fa12*fc13 - bp13*fc13*fa13*fc12)*gp123;
-                double factor123b = - bp13 * fc13 * fa13 * fcp12 * g123 * d12inv;
-                f12[0] += (x12 * factor123b + factor123a * cos_x) * 0.5; 
-                f12[1] += (y12 * factor123b + factor123a * cos_y) * 0.5;
-                f12[2] += (z12 * factor123b + factor123a * cos_z) * 0.5;
-            }
+template <typename real_f>
+SIMD_INLINE void find_fr_and_frp_table
+(const Tersoff_Table<real_f> &table, real_f d12, real_f &fr, real_f &frp)
+{
+    const real_f r0 = TABLE_R_MIN;
+    find_from_table(table.fr, table.n, r0, table.h_inv_r, d12, fr, frp);
+}
 
-            // accumulate_force_213
-            bp12 = bp[n2 * MN + offset]; 
-            for (int i2 = 0; i2 < NN[n2]; ++i2)
-            {
-                int n3 = NL[n2 * MN + i2];       
-                if (n3 == n1) { continue; } 
-                double x23, y23, z23;
-                x23 = x[n3] - x[n2];
-                y23 = y[n3] - y[n2];
-                z23 = z[n3] - z[n2];
-                apply_mic(pbc, box, lxh, lyh, lzh, x23, y23, z23);
-
-                double d23 = sqrt(x23 * x23 + y23 * y23 + z23 * z23);         
-                double fc23, fa23;
-                find_fc(d23, fc23);
-                find_fa(d23, fa23);
-                double bp13 = bp[n2 * MN + i2]; 
-
-                double cos213 = - (x12 * x23 + y12 * y23 + z12 * z23) / (d12 * d23);
-                double g213, gp213;
-                find_g_and_gp(cos213, g213, gp213);
-                double cos_x = x23 / (d12 * d23) + x12 * cos213 / (d12 * d12);
-                double cos_y = y23 / (d12 * d23) + y12 * cos213 / (d12 * d12);
-                double cos_z = z23 / (d12 * d23) + z12 * cos213 / (d12 * d12);                       
-                double factor213a = (-bp12*fc12*fa12*fc23 - bp13*fc23*fa23*fc12)*gp213;
-                double factor213b = - bp13 * fc23 * fa23 * fcp12 * g213 * d12inv;
-                f21[0] += (-x12 * factor213b + factor213a * cos_x) * 0.5; 
-                f21[1] += (-y12 * factor213b + factor213a * cos_y) * 0.5;
-                f21[2] += (-z12 * factor213b + factor213a * cos_z) * 0.5;
-            }
-
-            // accumulate force: see Eq. (37) in [PRB 92, 094301 (2015)]   
-            double fx12 = f12[0] - f21[0];
-            double fy12 = f12[1] - f21[1];
-            double fz12 = f12[2] - f21[2];
-            fx[n1] += fx12; 
-            fy[n1] += fy12; 
-            fz[n1] += fz12; 
-            fx[n2] -= fx12; // Newton's 3rd law used here
-            fy[n2] -= fy12; 
-            fz[n2] -= fz12;
+template <typename real_f>
+SIMD_INLINE void find_fa_and_fap_table
+(const Tersoff_Table<real_f> &table, real_f d12, real_f &fa, real_f &fap)
+{
+    const real_f r0 = TABLE_R_MIN;
+    find_from_table(table.fa, table.n, r0, table.h_inv_r, d12, fa, fap);
+}
 
-            // accumulate potential energy:           
-            prop[0] += (p12 + p21) * 0.5;    
+template <typename real_f>
+SIMD_INLINE void find_fc_and_fcp_table
+(const Tersoff_Table<real_f> &table, real_f d12, real_f &fc, real_f &fcp)
+{
+    const real_f r1 = 1.8;
+    const real_f r2 = 2.1;
+    find_from_table(table.fc, table.n, r1, table.h_inv_fc, d12, fc, fcp);
+    fc = (d12 < r2) ? fc : real_f(0); // exactly zero beyond r2
+    fcp = (d12 < r2) ? fcp : real_f(0);
+}
 
-            // accumulate virial; see Eq. (39) in [PRB 92, 094301 (2015)]
-            prop[1] -= fx12*x12;
-            prop[2] -= fy12*y12;
-            prop[3] -= fz12*z12;
+template <typename real_f>
+SIMD_INLINE void find_g_and_gp_table
+(const Tersoff_Table<real_f> &table, real_f cos, real_f &g, real_f &gp)
+{
+    const real_f x0 = -1.0;
+    find_from_table(table.g, table.n, x0, table.h_inv_g, cos, g, gp);
+}
 
-            // accumulate heat current; see Eq. (43) in [PRB 92, 094301 (2015)]
-            double f12_dot_v2 = f12[0]*vx[n2] + f12[1]*vy[n2] + f12[2]*vz[n2];   
-            double f21_dot_v1 = f21[0]*vx[n1] + f21[1]*vy[n1] + f21[2]*vz[n1];      
-            prop[4] -= (f12_dot_v2 - f21_dot_v1) * x12;  
-            prop[5] -= (f12_dot_v2 - f21_dot_v1) * y12;                       
-            prop[6] -= (f12_dot_v2 - f21_dot_v1) * z12;
-        }
-    } 
-} 
+/*
+    Tersoff potentials from GPUMD potential files (optional, see note 15)
+    Both the tersoff_1988 format (one line of 14 parameters for each triplet
+    of types ijk) and the tersoff_1989 format (one line of 11 parameters for
+    each of at most two types, followed by chi for two types) are read into
+    the same table of type triplets. For the tersoff_1989 format, the 
+    two-body parameters of ijk are those of the pair ij (with the geometric 
+    and arithmetic mixing rules and chi), the cutoff of ijk (applied to r_13)
+    is that of the pair ik, and the three-body parameters are those of i.
+*/
+#define MAX_TYPES 8 // maximum number of types in a potential file
+#define TERS_A       0 // the 14 parameters in the file
+#define TERS_B       1
+#define TERS_LAMBDA  2
+#define TERS_MU      3
+#define TERS_BETA    4
+#define TERS_N       5
+#define TERS_C       6
+#define TERS_D       7
+#define TERS_H       8
+#define TERS_R1      9
+#define TERS_R2     10
+#define TERS_M      11
+#define TERS_ALPHA  12
+#define TERS_GAMMA  13
+#define TERS_C2                14 // and the pre-computed ones
+#define TERS_D2                15
+#define TERS_C2OVERD2          16
+#define TERS_PI_FACTOR         17
+#define TERS_MINUS_HALF_OVER_N 18
+#define NUM_TERS               19
 
-// a wrapper
-void find_force
-(
-    int N, int *NN, int*NL, int MN, int pbc[3], double box[3], 
-    double *b, double *bp, double *x, double *y, double *z, double *vx, 
-    double *vy, double *vz, double *fx, double *fy, double *fz, double prop[7]
-)
+struct Tersoff_Potential
 {
-    find_b_and_bp(N, NN, NL, MN, pbc, box, x, y, z, b, bp);
-    find_force_tersoff
-    (N, NN, NL, MN, pbc, box, b, bp, x, y, z, vx, vy, vz, fx, fy, fz, prop);
-} 
+    int num_types;
+    char symbol[MAX_TYPES][8];
+    double mass[MAX_TYPES];
+    double rc;     // the largest cutoff
+    double *ters;  // NUM_TERS parameters of the triplet ijk at
+                   // ((i * num_types + j) * num_types + k) * NUM_TERS
+    int is_carbon; // 1 if it is the built-in carbon potential
+};
 
-// velocity-Verlet
-void integrate
-(
-    int N, double time_step, double *m, double *fx, double *fy, double *fz, 
-    double *vx, double *vy, double *vz, double *x, double *y, double *z, 
-    int flag
-)
+// mass (amu) of the elements in the potential files (0 if unknown)
+double find_mass(const char *symbol)
 {
-    double time_step_half = time_step * 0.5;
-    for (int n = 0; n < N; ++n)
+    const char *symbols[8] = {"B", "C", "N", "O", "Si", "Ga", "Ge", "Sn"};
+    const double masses[8] = 
+    {10.811, 12.011, 14.007, 15.999, 28.085, 69.723, 72.630, 118.71};
+    for (int n = 0; n < 8; ++n)
     {
-        double mass_inv = 1.0 / m[n];
-        double ax = fx[n] * mass_inv;
-        double ay = fy[n] * mass_inv;
-        double az = fz[n] * mass_inv;
-        vx[n] += ax * time_step_half;
-        vy[n] += ay * time_step_half;
-        vz[n] += az * time_step_half;
-        if (flag == 1) 
-        { 
-            x[n] += vx[n] * time_step; 
-            y[n] += vy[n] * time_step; 
-            z[n] += vz[n] * time_step; 
-        }
+        if (strcmp(symbol, symbols[n]) == 0) { return masses[n]; }
     }
+    printf("Error: unknown element %s.\n", symbol);
+    return 0.0;
 }
 
-// find heat current autocorrelation (hac)
-void find_hac
-(
-    int Nc, int M, double *hx, double *hy, double *hz, double *hac_x, 
-    double *hac_y, double *hac_z 
-)
+// 0 for valid parameters, and 1 (with a message) otherwise
+int check_tersoff_parameters(double *p)
 {
-    for (int nc = 0; nc < Nc; nc++) // loop over the correlation time points
+    const char *names[14] = 
+    {"A", "B", "lambda", "mu", "beta", "n", "c", "d", "h", "R", "S", 
+     "m", "alpha", "gamma"};
+    for (int k = 0; k < 14; ++k)
     {
-        for (int m = 0; m < M; m++) // loop over the time origins
+        if (k != TERS_H && k != TERS_ALPHA && p[k] < 0.0)
         {
-            hac_x[nc] += hx[m] * hx[m + nc]; 
-            hac_y[nc] += hy[m] * hy[m + nc]; 
-            hac_z[nc] += hz[m] * hz[m + nc]; 
+            printf("Error: Tersoff parameter %s must be >= 0.\n", names[k]);
+            return 1;
         }
-        hac_x[nc] /= M; hac_y[nc] /= M; hac_z[nc] /= M;
     }
+    if (p[TERS_R2] <= p[TERS_R1])
+    {
+        printf("Error: Tersoff parameter S must be > R.\n");
+        return 1;
+    }
+    p[TERS_M] = round(p[TERS_M]);
+    if (p[TERS_M] != 1.0 && p[TERS_M] != 3.0)
+    {
+        printf("Error: Tersoff parameter m must be 1 or 3.\n");
+        return 1;
+    }
+    if (p[TERS_ALPHA] < 1.0e-15) { p[TERS_ALPHA] = 0.0; } // as in GPUMD
+    return 0;
 }
 
-// find running thermal conductivity (rtc)
-static void find_rtc
-(
-    int Nc, double factor, double *hac_x, double *hac_y, double *hac_z,
-    double *rtc_x, double *rtc_y, double *rtc_z
-)
+// read a potential file; 0 for success, and 1 (with a message, and nothing
+// allocated) for an invalid file, such that a library can go on (see 
+// create_tersoff_batch)
+int read_potential(const char *filename, Tersoff_Potential &potential)
 {
-    for (int nc = 1; nc < Nc; nc++)  
+    FILE *fid = fopen(filename, "r");
+    if (fid == NULL)
     {
-        rtc_x[nc] = rtc_x[nc - 1] + (hac_x[nc - 1] + hac_x[nc]) * factor;
-        rtc_y[nc] = rtc_y[nc - 1] + (hac_y[nc - 1] + hac_y[nc]) * factor;
-        rtc_z[nc] = rtc_z[nc - 1] + (hac_z[nc - 1] + hac_z[nc]) * factor;
+        printf("Error: cannot open %s.\n", filename);
+        return 1;
+    }
+    char model[32];
+    int num_types;
+    if (fscanf(fid, "%31s%d", model, &num_types) != 2)
+    {
+        printf("Error: reading error for %s.\n", filename);
+        fclose(fid);
+        return 1;
+    }
+    int is_1988 = (strcmp(model, "tersoff_1988") == 0);
+    int is_1989 = (strcmp(model, "tersoff_1989") == 0);
+    if (!is_1988 && !is_1989)
+    {
+        printf("Error: %s is not a tersoff_1988 or tersoff_1989 file.\n", 
+            filename);
+        fclose(fid);
+        return 1;
+    }
+    if (num_types < 1 || num_types > MAX_TYPES || (is_1989 && num_types > 2))
+    {
+        printf("Error: unsupported number of types in %s.\n", filename);
+        fclose(fid);
+        return 1;
+    }
+    potential.num_types = num_types;
+    for (int i = 0; i < num_types; ++i)
+    {
+        if (fscanf(fid, "%7s", potential.symbol[i]) != 1)
+        {
+            printf("Error: reading error for %s.\n", filename);
+            fclose(fid);
+            return 1;
+        }
+        potential.mass[i] = find_mass(potential.symbol[i]);
+        if (potential.mass[i] == 0.0) { fclose(fid); return 1; }
     }
-}
 
-// find hac and rtc
-void find_hac_kappa
-(
-    int Nd, int Nc, double dt, double T_0, double V, 
-    double *hx, double *hy, double *hz
-)
-{
-    double dt_in_ps = dt * TIME_UNIT_CONVERSION / 1000.0; // ps
-    int M = Nd - Nc; // number of time origins
+    int num_entries = num_types * num_types * num_types;
+    int num_lines = is_1988 ? num_entries : num_types;
+    int num_values = is_1988 ? 14 : 11;
+    double line[MAX_TYPES * MAX_TYPES * MAX_TYPES][14];
+    for (int l = 0; l < num_lines; ++l)
+    {
+        line[l][TERS_M] = 3.0;     // the tersoff_1989 values
+        line[l][TERS_ALPHA] = 0.0;
+        line[l][TERS_GAMMA] = 1.0;
+        for (int k = 0; k < num_values; ++k)
+        {
+            if (fscanf(fid, "%lf", &line[l][k]) != 1)
+            {
+                printf("Error: reading error for %s.\n", filename);
+                fclose(fid);
+                return 1;
+            }
+        }
+        if (check_tersoff_parameters(line[l]) != 0) 
+        { 
+            fclose(fid); 
+            return 1; 
+        }
+    }
+    double chi = 1.0;
+    if (is_1989 && num_types == 2 && fscanf(fid, "%lf", &chi) != 1)
+    {
+        printf("Error: reading error for %s.\n", filename);
+        fclose(fid);
+        return 1;
+    }
+    fclose(fid);
 
-    double *hac_x = (double *)malloc(sizeof(double) * Nc);
-    double *hac_y = (double *)malloc(sizeof(double) * Nc);
-    double *hac_z = (double *)malloc(sizeof(double) * Nc);
-    double *rtc_x = (double *)malloc(sizeof(double) * Nc);
-    double *rtc_y = (double *)malloc(sizeof(double) * Nc);
-    double *rtc_z = (double *)malloc(sizeof(double) * Nc);
-    for (int nc = 0; nc < Nc; nc++) {hac_x[nc] = hac_y[nc] = hac_z[nc] = 0.0;}
-    for (int nc = 0; nc < Nc; nc++) {rtc_x[nc] = rtc_y[nc] = rtc_z[nc] = 0.0;}
+    double *ters = (double*) malloc(num_entries * NUM_TERS * sizeof(double));
+    potential.rc = 0.0;
+    for (int i = 0; i < num_types; ++i)
+    {
+        for (int j = 0; j < num_types; ++j)
+        {
+            for (int k = 0; k < num_types; ++k)
+            {
+                int ijk = (i * num_types + j) * num_types + k;
+                double *p = ters + ijk * NUM_TERS;
+                if (is_1988)
+                {
+                    for (int l = 0; l < 14; ++l) { p[l] = line[ijk][l]; }
+                }
+                else
+                {
+                    double *pi = line[i], *pj = line[j], *pk = line[k];
+                    for (int l = 0; l < 14; ++l) { p[l] = pi[l]; }
+                    p[TERS_A] = sqrt(pi[TERS_A] * pj[TERS_A]);
+                    p[TERS_B] = sqrt(pi[TERS_B] * pj[TERS_B]);
+                    if (i != j) { p[TERS_B] *= chi; }
+                    p[TERS_LAMBDA] = 0.5 * (pi[TERS_LAMBDA] + pj[TERS_LAMBDA]);
+                    p[TERS_MU] = 0.5 * (pi[TERS_MU] + pj[TERS_MU]);
+                    p[TERS_R1] = sqrt(pi[TERS_R1] * pk[TERS_R1]);
+                    p[TERS_R2] = sqrt(pi[TERS_R2] * pk[TERS_R2]);
+                }
+                p[TERS_C2] = p[TERS_C] * p[TERS_C];
+                p[TERS_D2] = p[TERS_D] * p[TERS_D];
+                p[TERS_C2OVERD2] = (p[TERS_C2] == 0.0) 
+                                 ? 0.0 : p[TERS_C2] / p[TERS_D2];
+                p[TERS_PI_FACTOR] = 3.141592653589793 
+                                  / (p[TERS_R2] - p[TERS_R1]);
+                p[TERS_MINUS_HALF_OVER_N] = - 0.5 / p[TERS_N];
+                if (p[TERS_R2] > potential.rc) { potential.rc = p[TERS_R2]; }
+            }
+        }
+    }
+    potential.ters = ters;
 
-    find_hac(Nc, M, hx, hy, hz, hac_x, hac_y, hac_z);
-    double factor = dt * 0.5 *  KAPPA_UNIT_CONVERSION / (K_B * T_0 * T_0 * V);
-    find_rtc(Nc, factor, hac_x, hac_y, hac_z, rtc_x, rtc_y, rtc_z);
+    // the constants of find_fr_and_frp, find_fa_and_fap, find_fc_and_fcp,
+    // find_g_and_gp, and find_b_and_bp
+    const double carbon[14] = 
+    {
+        1393.6, 430.0, 3.4879, 2.2119, 1.5724e-7, 0.72751, 38049.0, 4.3484, 
+        -0.930, 1.8, 2.1, 3.0, 0.0, 1.0
+    };
+    potential.is_carbon = (num_types == 1);
+    for (int l = 0; l < 14; ++l)
+    {
+        if (l != TERS_M && fabs(ters[l] - carbon[l]) > 1e-12 * fabs(carbon[l]))
+        {
+            potential.is_carbon = 0;
+        }
+    }
 
-    FILE *fid = fopen("hac.txt", "a"); // "append" mode 
-    for (int nc = 0; nc < Nc; nc++) 
+    printf("Use the %s potential in %s with element(s):", model, filename);
+    for (int i = 0; i < num_types; ++i) { printf(" %s", potential.symbol[i]); }
+    printf("\n");
+    if (potential.is_carbon)
     {
-        fprintf
-        (
-            fid, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n", 
-            nc * dt_in_ps, // in units of ps
-            hac_x[nc], hac_y[nc], hac_z[nc], // in my natural units 
-            rtc_x[nc], rtc_y[nc], rtc_z[nc]  // in units of W/mK
-        );
+        printf("It is the built-in carbon potential (specialized kernels).\n");
     }
+    return 0;
+}
 
-    // do not forget to clear up
-    fclose(fid);
-    free(hac_x); free(hac_y); free(hac_z);
-    free(rtc_x); free(rtc_y); free(rtc_z);
+// as read_potential, but an invalid file is a fatal error
+void load_potential(const char *filename, Tersoff_Potential &potential)
+{
+    if (read_potential(filename, potential) != 0) { exit(1); }
 }
 
-// Finally, we reach the main function
-int main(int argc, char *argv[])
+void free_potential(Tersoff_Potential &potential)
 {
-    srand(time(NULL)); // each run is independent
-    int nx = 20; // number of unit cells in the x-direction
-    int ny = 12; // number of unit cells in the y-direction
-    int nz = 1;  // number of unit cells in the z-direction
-    int n0 = 4;  // number of particles in the unit cell
-    int N = n0 * nx * ny * nz; // total number of particles
-    int Ne = 10000;   // number of steps in the equilibration stage
-    int Np = 10000;   // number of steps in the production stage
-    int Ns = 10;      // sampling interval
-    int Nd = Np / Ns; // number of heat current data
-    int Nc = Nd / 10; // number of correlation data (a good choice)
-    int MN = 3;       // maximum number of neighbors for one particle
-    int pbc[3] = {1, 1, 0}; // 1 for periodic boundary; 0 for free boundary
+    free(potential.ters);
+}
 
-    double T_0 = 300.0;           // temperature prescribed
-    double ax = 1.438 * sqrt(3.0); // lattice constant in the x direction
-    double ay = 1.438 * 3.0;       // lattice constant in the y direction
-    double az = 3.35;             // Just a convention
-    double box[3];
-    box[0] = ax * nx;             // box length in the x direction
-    box[1] = ay * ny;             // box length in the y direction
-    box[2] = az * nz;             // box length in the z direction
-    double volume = box[0] * box[1] * box[2]; // volume of the system
-    double cutoff = 2.1;          // cutoff distance for neighbor list
-    double time_step = 1.0 / TIME_UNIT_CONVERSION; // time step (1 fs here)
-    
-    // neighbor list
-    int *NN = (int*) malloc(N * sizeof(int));
-    int *NL = (int*) malloc(N * MN * sizeof(int));
+// 64-bit FNV-1a hash of size bytes, continuing from hash
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char*) data;
+    for (size_t n = 0; n < size; ++n)
+    {
+        hash = (hash ^ bytes[n]) * 1099511628211ULL;
+    }
+    return hash;
+}
 
-    // major data for the particles
-    double *m  = (double*) malloc(N * sizeof(double)); // mass
-    double *x  = (double*) malloc(N * sizeof(double)); // position
-    double *y  = (double*) malloc(N * sizeof(double));
-    double *z  = (double*) malloc(N * sizeof(double));
-    double *vx = (double*) malloc(N * sizeof(double)); // velocity
-    double *vy = (double*) malloc(N * sizeof(double));
-    double *vz = (double*) malloc(N * sizeof(double));
-    double *fx = (double*) malloc(N * sizeof(double)); // force
-    double *fy = (double*) malloc(N * sizeof(double));
-    double *fz = (double*) malloc(N * sizeof(double));
-    double *hx = (double*) malloc(Nd * sizeof(double)); // heat current
-    double *hy = (double*) malloc(Nd * sizeof(double));
-    double *hz = (double*) malloc(Nd * sizeof(double));
-    double *b  = (double*) malloc(N * MN * sizeof(double)); // bond order
-    double *bp = (double*) malloc(N * MN * sizeof(double)); 
-
-    // initialize mass, position, and velocity
-    for (int n = 0; n < N; ++n) { m[n] = 12.0; } // mass for carbon atom
-    initialize_position(nx, ny, nz, ax, ay, az, x, y, z);
-    initialize_velocity(N, T_0, m, vx, vy, vz);
+// a hash of the elements, masses, and parameters of the potential, such that
+// a restart can check that the potential is the same (see note 20)
+uint64_t find_potential_hash(const Tersoff_Potential &potential)
+{
+    int num_types = potential.num_types;
+    int num_entries = num_types * num_types * num_types;
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hash_bytes(hash, &num_types, sizeof(num_types));
+    for (int i = 0; i < num_types; ++i)
+    {
+        hash = hash_bytes
+        (hash, potential.symbol[i], strlen(potential.symbol[i]) + 1);
+    }
+    hash = hash_bytes(hash, potential.mass, num_types * sizeof(double));
+    hash = hash_bytes(hash, &potential.rc, sizeof(double));
+    hash = hash_bytes
+    (hash, potential.ters, num_entries * NUM_TERS * sizeof(double));
+    return hash;
+}
 
-    // initialize neighbor list and force
-    find_neighbor(N, NN, NL, pbc, box, x, y, z, MN, cutoff);
-    double prop[7]; // potential, virial, and heat current
-    find_force
-    (N, NN, NL, MN, pbc, box, b, bp, x, y, z, vx, vy, vz, fx, fy, fz, prop);
+// The radial functions of the triplet ijk with parameters p; the two-body
+// part of the bond ij uses the triplet ijj
+template <typename real_f>
+inline void find_fr_and_frp
+(const double *p, real_f d12, real_f &fr, real_f &frp)
+{
+    real_f lambda = p[TERS_LAMBDA];
+    fr  = real_f(p[TERS_A]) * exp(- lambda * d12);
+    frp = - lambda * fr;
+}
 
-    // open a file for outputting some thermodynamic properties
-    FILE *fid = fopen("thermo.txt", "w");
-    clock_t time_begin;
-    clock_t time_finish;
-    double time_used;
+template <typename real_f>
+inline void find_fa_and_fap
+(const double *p, real_f d12, real_f &fa, real_f &fap)
+{
+    real_f mu = p[TERS_MU];
+    fa  = real_f(p[TERS_B]) * exp(- mu * d12);
+    fap = - mu * fa;
+}
 
-    // equilibration
-    printf("\nEquilibration started:\n");
-    time_begin = clock();
-    for (int step = 0; step < Ne; ++step)
-    { 
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
-        find_force
-        (N, NN, NL, MN, pbc, box, b, bp, x, y, z, vx, vy, vz, fx, fy, fz, prop);
-        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
-        scale_velocity(N, T_0, m, vx, vy, vz); // control temperature
-        if ((step+1) % (Ne/10) == 0)
-        {
-            printf("\t%d steps completed.\n", step + 1);
-        }
-    } 
-    time_finish = clock();
-    time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
-    fprintf(stderr, "time used for equilibration = %g s\n", time_used); 
+template <typename real_f>
+inline void find_fc_and_fcp
+(const double *p, real_f d12, real_f &fc, real_f &fcp)
+{
+    real_f r1 = p[TERS_R1];
+    real_f r2 = p[TERS_R2];
+    real_f pi_factor = p[TERS_PI_FACTOR];
+    if (d12 < r1)
+    {
+        fc  = 1.0;
+        fcp = 0.0;
+    }
+    else if (d12 < r2)
+    {              
+        fc = cos(pi_factor * (d12 - r1)) * 0.5 + 0.5;
+        fcp = - sin(pi_factor * (d12 - r1)) * pi_factor * 0.5;
+    }
+    else
+    {
+        fc = 0.0;
+        fcp = 0.0;
+    }
+}
+
+template <typename real_f>
+inline void find_fc(const double *p, real_f d12, real_f &fc)
+{
+    real_f r1 = p[TERS_R1];
+    real_f r2 = p[TERS_R2];
+    real_f pi_factor = p[TERS_PI_FACTOR];
+    if (d12 < r1)
+    {
+        fc  = 1.0;
+    }
+    else if (d12 < r2)
+    {              
+        fc = cos(pi_factor * (d12 - r1)) * 0.5 + 0.5;
+    }
+    else
+    {
+        fc = 0.0;
+    }
+}
+
+// The angular function (times gamma) and its derivative
+template <typename real_f>
+inline void find_g_and_gp(const double *p, real_f cos, real_f &g, real_f &gp)
+{
+    real_f h = p[TERS_H];
+    real_f d2 = p[TERS_D2];
+    real_f gamma = p[TERS_GAMMA];
+    real_f temp = d2 + (cos - h) * (cos - h);
+    real_f c2overd2 = p[TERS_C2OVERD2];
+    g  = gamma * (1.0 + c2overd2 * (cos - h) * (cos - h) / temp);
+    gp = gamma * 2.0 * real_f(p[TERS_C2]) * (cos - h) / (temp * temp);
+}
+
+template <typename real_f>
+inline void find_g(const double *p, real_f cos, real_f &g)
+{
+    real_f h = p[TERS_H];
+    real_f d2 = p[TERS_D2];
+    real_f gamma = p[TERS_GAMMA];
+    real_f c2overd2 = p[TERS_C2OVERD2];
+    real_f temp = d2 + (cos - h) * (cos - h);
+    g  = gamma * (1.0 + c2overd2 * (cos - h) * (cos - h) / temp);
+}
+
+// The exponential exp(alpha (d12 - d13)^m) and its derivative with d12
+template <typename real_f>
+inline void find_e_and_ep
+(const double *p, real_f d12, real_f d13, real_f &e, real_f &ep)
+{
+    real_f alpha = p[TERS_ALPHA];
+    if (alpha == 0.0)
+    {
+        e = 1.0;
+        ep = 0.0;
+    }
+    else if (p[TERS_M] == 3.0)
+    {
+        real_f r = d12 - d13;
+        e = exp(alpha * r * r * r);
+        ep = alpha * 3.0 * r * r * e;
+    }
+    else
+    {
+        e = exp(alpha * (d12 - d13));
+        ep = alpha * e;
+    }
+}
+
+// parameters of the triplet ijk
+inline const double* find_parameters
+(const Tersoff_Potential &potential, int i, int j, int k)
+{
+    int n = potential.num_types;
+    return potential.ters + ((i * n + j) * n + k) * NUM_TERS;
+}
+
+// Geometry and radial functions of the bonds n1 -> n2 = NL[NO[n1] + i1]; 
+// they are computed once per step and then shared by find_b_and_bp and 
+// find_force_tersoff, which only do arithmetic on them; the arrays grow 
+// with the number of bonds (N * nn_max in the padded layout of the 
+// vectorized kernels)
+template <typename real_f>
+struct Bond_Data
+{
+    int size;                 // allocated length of the arrays below
+    int *reverse;             // index of the bond n2 -> n1 (owned by the
+                              // neighbor list)
+    real_f *x12, *y12, *z12;  // displacement r_12 = r_2 - r_1
+    real_f *d12;              // distance |r_12|
+    real_f *fc, *fcp;         // cutoff function and its derivative
+    real_f *fa, *fap;         // attractive function and its derivative
+    real_f *fr, *frp;         // repulsive function and its derivative
+    real_f *b, *bp;           // bond order and its derivative
+    real_f *f12x, *f12y, *f12z; // partial forces
+    Tersoff_Table<real_f> *table; // tabulated functions (NULL: analytic)
+    Tersoff_Potential *potential; // parameters from a file (NULL: the 
+                                  // built-in carbon potential)
+    int *type;                    // types of the particles (with potential)
+};
+
+template <typename real_f>
+void allocate_bond_data(Bond_Data<real_f> &bond)
+{
+    bond.size = 0;
+    bond.reverse = NULL;
+    bond.x12 = bond.y12 = bond.z12 = bond.d12 = NULL;
+    bond.fc = bond.fcp = bond.fa = bond.fap = bond.fr = bond.frp = NULL;
+    bond.b = bond.bp = bond.f12x = bond.f12y = bond.f12z = NULL;
+    bond.table = NULL;
+    bond.potential = NULL;
+    bond.type = NULL;
+}
+
+template <typename T>
+void grow_array(int size, T *&a)
+{
+    a = (T*) realloc(a, size * sizeof(T));
+    if (a == NULL)
+    {
+        printf("Error: cannot allocate memory for the bond data.\n");
+        exit(1);
+    }
+}
+
+// make room for size bonds (with 20% to spare)
+template <typename real_f>
+void reserve_bond_data(int size, Bond_Data<real_f> &bond)
+{
+    if (size <= bond.size) { return; }
+    size += size / 5;
+    grow_array(size, bond.x12); grow_array(size, bond.y12);
+    grow_array(size, bond.z12); grow_array(size, bond.d12);
+    grow_array(size, bond.fc);  grow_array(size, bond.fcp);
+    grow_array(size, bond.fa);  grow_array(size, bond.fap);
+    grow_array(size, bond.fr);  grow_array(size, bond.frp);
+    grow_array(size, bond.b);   grow_array(size, bond.bp);
+    grow_array(size, bond.f12x); grow_array(size, bond.f12y); 
+    grow_array(size, bond.f12z);
+    bond.size = size;
+}
+
+template <typename real_f>
+void free_bond_data(Bond_Data<real_f> &bond)
+{
+    free(bond.x12); free(bond.y12); free(bond.z12); free(bond.d12); 
+    free(bond.fc); free(bond.fcp); free(bond.fa);
+    free(bond.fap); free(bond.fr); free(bond.frp); free(bond.b);
+    free(bond.bp); free(bond.f12x); free(bond.f12y); free(bond.f12z);
+}
+
+// evaluate the geometry and the radial functions of all the bonds; the
+// displacements are found in real_x before being rounded to real_f
+template <typename real_x, typename real_f>
+void find_bond_data
+(
+    int N, int *NN, int *NO, int *NL, int pbc[3], double box[3],
+    real_x *x, real_x *y, real_x *z, Bond_Data<real_f> &bond
+)
+{
+    double lxh = box[0] * 0.5;
+    double lyh = box[1] * 0.5;
+    double lzh = box[2] * 0.5;
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        for (int i1 = 0; i1 < NN[n1]; ++i1)   
+        {       
+            int index12 = NO[n1] + i1;
+            int n2 = NL[index12]; // we only know n2 != n1     
+            real_x x12_x, y12_x, z12_x;
+            x12_x = x[n2] - x[n1];
+            y12_x = y[n2] - y[n1];
+            z12_x = z[n2] - z[n1]; 
+            apply_mic(pbc, box, lxh, lyh, lzh, x12_x, y12_x, z12_x);
+            real_f x12 = x12_x, y12 = y12_x, z12 = z12_x;
+            real_f d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
+            bond.x12[index12] = x12;
+            bond.y12[index12] = y12;
+            bond.z12[index12] = z12;
+            bond.d12[index12] = d12;
+            if (bond.potential) // the pair ij uses the triplet ijj
+            {
+                int type2 = bond.type[n2];
+                const double *p = find_parameters
+                (*bond.potential, bond.type[n1], type2, type2);
+                find_fc_and_fcp(p, d12, bond.fc[index12], bond.fcp[index12]);
+                find_fa_and_fap(p, d12, bond.fa[index12], bond.fap[index12]);
+                find_fr_and_frp(p, d12, bond.fr[index12], bond.frp[index12]);
+                continue;
+            }
+            if (bond.table)
+            {
+                find_fc_and_fcp_table
+                (*bond.table, d12, bond.fc[index12], bond.fcp[index12]);
+            }
+            else
+            {
+                find_fc_and_fcp(d12, bond.fc[index12], bond.fcp[index12]);
+            }
+            if (bond.fc[index12] == 0.0) // in the skin
+            {
+                bond.fa[index12] = bond.fap[index12] = 0.0;
+                bond.fr[index12] = bond.frp[index12] = 0.0;
+                continue;
+            }
+            if (bond.table)
+            {
+                find_fa_and_fap_table
+                (*bond.table, d12, bond.fa[index12], bond.fap[index12]);
+                find_fr_and_frp_table
+                (*bond.table, d12, bond.fr[index12], bond.frp[index12]);
+            }
+            else
+            {
+                find_fa_and_fap(d12, bond.fa[index12], bond.fap[index12]);
+                find_fr_and_frp(d12, bond.fr[index12], bond.frp[index12]);
+            }
+        }
+    }
+}
+
+// pre-compute the bond-order functions and their derivatives
+template <typename real_f>
+void find_b_and_bp
+(
+    int N, int *NN, int *NO, Bond_Data<real_f> &bond, real_f *b, real_f *bp
+)
+{
+    const real_f beta = 1.5724e-7;
+    const real_f n = 0.72751;     
+    const real_f minus_half_over_n = - 0.5 / n;
+
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        for (int i1 = 0; i1 < NN[n1]; ++i1)   
+        {       
+            int index12 = NO[n1] + i1;
+            if (bond.fc[index12] == 0.0) // in the skin
+            {
+                b[index12]  = 0.0;
+                bp[index12] = 0.0;
+                continue;
+            }
+            real_f x12 = bond.x12[index12];
+            real_f y12 = bond.y12[index12];
+            real_f z12 = bond.z12[index12];
+            real_f d12 = bond.d12[index12];
+
+            real_f zeta = 0.0;
+            for (int i2 = 0; i2 < NN[n1]; ++i2)
+            {
+                if (i2 == i1) { continue; } // ensure that n3 != n2
+                int index13 = NO[n1] + i2;
+                real_f fc13 = bond.fc[index13];
+                if (fc13 == 0.0) { continue; } // in the skin
+                real_f cos = (x12 * bond.x12[index13] + y12 * bond.y12[index13]
+                           + z12 * bond.z12[index13]) / (d12 * bond.d12[index13]);
+                real_f g123, gp123; 
+                if (bond.table) 
+                { 
+                    find_g_and_gp_table(*bond.table, cos, g123, gp123); 
+                }
+                else 
+                { 
+                    find_g(cos, g123); 
+                }
+                zeta += fc13 * g123;
+            } 
+            real_f bzn = pow(beta * zeta, n);
+            real_f b12 = pow(1 + bzn, minus_half_over_n);
+            b[index12]  = b12;
+            // zeta = 0 means that bp12 will only be multiplied by fc13 = 0 
+            bp[index12] = (zeta > 0.0) 
+                        ? - b12 * bzn * 0.5 / ((1.0 + bzn) * zeta) : 0.0;
+        }
+    }
+}
+
+// accumulate force: see Eq. (37) in [PRB 92, 094301 (2015)]   
+// and add up the per-particle potential, virial, and heat current (if props);
+// the partial forces are stored as NO[n1] + i1 or (is_bond_major) i1 * N + n1
+template <typename real_x, typename real_f>
+void accumulate_force
+(
+    int N, int *NN, int *NO, int *NL, int is_bond_major, int *reverse, 
+    real_f *f12x, real_f *f12y, real_f *f12z, real_x *prop_atom, real_f *fx, 
+    real_f *fy, real_f *fz, real_x prop[7], int props
+)
+{
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        real_x f1[3] = {0.0, 0.0, 0.0};
+        for (int i1 = 0; i1 < NN[n1]; ++i1)   
+        {       
+            int index12 = NO[n1] + i1;
+            int index21 = reverse[index12];
+            if (is_bond_major)
+            {
+                int n2 = NL[index12];
+                index12 = i1 * N + n1;
+                index21 = (index21 - NO[n2]) * N + n2;
+            }
+            f1[0] += f12x[index12] - f12x[index21];
+            f1[1] += f12y[index12] - f12y[index21];
+            f1[2] += f12z[index12] - f12z[index21];
+        }
+        fx[n1] = f1[0]; 
+        fy[n1] = f1[1]; 
+        fz[n1] = f1[2];
+    }
+
+    if (props == PROP_NONE) { return; }
+    for (int k = 0; k < 7; ++k) { prop[k] = 0.0; }
+    for (int n = 0; n < N; ++n)
+    {
+        for (int k = 0; k < 7; ++k) { prop[k] += prop_atom[n * 7 + k]; }
+    }
+} 
+
+// The force evaluation function for the Tersoff potential
+// 1) Each particle n1 computes the partial forces f12 = d_U_1_d_r_12 of its 
+//    own bonds, together with its own potential, virial, and heat current.
+// 2) The total force on n1 is then gathered as sum_2 (f12 - f21).
+// No particle writes to the data of another particle, so both loops are 
+// parallelized without atomics and the results (including the per-particle 
+// sums for prop[0..6], which are added up serially in a fixed order) do not
+// depend on the number of threads.
+// 3) Only the properties in props (PROP_ENERGY | PROP_VIRIAL | PROP_HEAT) 
+//    are calculated; prop and prop_atom are not touched for PROP_NONE.
+template <int props, typename real_x, typename real_f>
+void find_force_tersoff
+(
+    int N, int *NN, int *NO, int *NL, Bond_Data<real_f> &bond, real_f *b, 
+    real_f *bp, real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, 
+    real_f *fz, real_f *f12x, real_f *f12y, real_f *f12z, real_x *prop_atom, 
+    real_x prop[7]
+)
+{
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        real_x p1[7] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+        for (int i1 = 0; i1 < NN[n1]; ++i1)   
+        {       
+            int index12 = NO[n1] + i1;
+            real_f fc12 = bond.fc[index12];
+            if (fc12 == 0.0) // in the skin
+            { 
+                f12x[index12] = f12y[index12] = f12z[index12] = 0.0;
+                continue; 
+            }
+            int n2 = NL[index12];
+            real_f x12 = bond.x12[index12];
+            real_f y12 = bond.y12[index12];
+            real_f z12 = bond.z12[index12];
+            real_f d12 = bond.d12[index12];
+            real_f d12inv = 1.0 / d12;
+            real_f fcp12 = bond.fcp[index12];
+            real_f fa12 = bond.fa[index12];
+            real_f fap12 = bond.fap[index12];
+            real_f fr12 = bond.fr[index12];
+            real_f frp12 = bond.frp[index12];
+
+            real_f f12[3] = {0.0, 0.0, 0.0};   // d_U_i_d_r_ij
+           
+            // accumulate_force_12 
+            real_f b12 = b[index12]; 
+            real_f factor1 = - b12 * fa12 + fr12;
+            real_f factor2 = - b12 * fap12 + frp12;    
+            real_f factor3 = (fcp12 * factor1 + fc12 * factor2) / d12;   
+            f12[0] += x12 * factor3 * 0.5; 
+            f12[1] += y12 * factor3 * 0.5;
+            f12[2] += z12 * factor3 * 0.5;     
+            real_f p12 = factor1 * fc12; // U_ij
+
+            // accumulate_force_123
+            real_f bp12 = bp[index12]; 
+            for (int i2 = 0; i2 < NN[n1]; ++i2)
+            {    
+                if (i2 == i1) { continue; } // ensure that n3 != n2
+                int index13 = NO[n1] + i2;
+                real_f fc13 = bond.fc[index13];
+                if (fc13 == 0.0) { continue; } // in the skin
+                real_f x13 = bond.x12[index13];
+                real_f y13 = bond.y12[index13];
+                real_f z13 = bond.z12[index13];
+                real_f d13 = bond.d12[index13];
+                real_f fa13 = bond.fa[index13];
+                real_f bp13 = bp[index13]; 
+
+                real_f cos123 = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
+                real_f g123, gp123;
+                if (bond.table) 
+                { 
+                    find_g_and_gp_table(*bond.table, cos123, g123, gp123); 
+                }
+                else 
+                { 
+                    find_g_and_gp(cos123, g123, gp123); 
+                }
+                real_f cos_x = x13 / (d12 * d13) - x12 * cos123 / (d12 * d12);
+                real_f cos_y = y13 / (d12 * d13) - y12 * cos123 / (d12 * d12);
+                real_f cos_z = z13 / (d12 * d13) - z12 * cos123 / (d12 * d12);                        
+                real_f factor123a = (-bp12*fc12*fa12*fc13 - bp13*fc13*fa13*fc12)*gp123;
+                real_f factor123b = - bp13 * fc13 * fa13 * fcp12 * g123 * d12inv;
+                f12[0] += (x12 * factor123b + factor123a * cos_x) * 0.5; 
+                f12[1] += (y12 * factor123b + factor123a * cos_y) * 0.5;
+                f12[2] += (z12 * factor123b + factor123a * cos_z) * 0.5;
+            }
+            f12x[index12] = f12[0];
+            f12y[index12] = f12[1];
+            f12z[index12] = f12[2];
+
+            // accumulate potential energy:           
+            if (props & PROP_ENERGY) { p1[0] += p12 * 0.5; }
+
+            // accumulate virial; see Eq. (39) in [PRB 92, 094301 (2015)];
+            // the bond 2 -> 1 gives the other half - f21 * x21 = f21 * x12
+            if (props & PROP_VIRIAL)
+            {
+                p1[1] -= f12[0] * x12;
+                p1[2] -= f12[1] * y12;
+                p1[3] -= f12[2] * z12;
+            }
+
+            // accumulate heat current; see Eq. (43) in [PRB 92, 094301 (2015)];
+            // the bond 2 -> 1 gives the other half (f21 * v1) * x12
+            if (props & PROP_HEAT)
+            {
+                real_x f12_dot_v2 = f12[0] * vx[n2] + f12[1] * vy[n2] 
+                                  + f12[2] * vz[n2];   
+                p1[4] -= f12_dot_v2 * x12;  
+                p1[5] -= f12_dot_v2 * y12;                       
+                p1[6] -= f12_dot_v2 * z12;
+            }
+        }
+        if (props != PROP_NONE)
+        {
+            for (int k = 0; k < 7; ++k) { prop_atom[n1 * 7 + k] = p1[k]; }
+        }
+    } 
+
+    accumulate_force
+    (
+        N, NN, NO, NL, 0, bond.reverse, f12x, f12y, f12z, prop_atom, 
+        fx, fy, fz, prop, props
+    );
+} 
+
+/*
+    Multi-species force evaluation (see note 15)
+    The same two steps as find_b_and_bp and find_force_tersoff, with the 
+    parameters of the triplets ijk as in GPUMD (src/force/tersoff1988.cu). 
+    The bond 12 contributes to zeta_13 through the cutoff of the triplet ikj,
+    which can be longer than that of the pair ij, so only the bonds beyond 
+    the largest cutoff (in the skin) are skipped. The bond data hold the 
+    radial functions of the pairs (the triplets ijj).
+*/
+
+// pre-compute the bond-order functions and their derivatives
+template <typename real_f>
+void find_b_and_bp_types
+(
+    int N, int *NN, int *NO, int *NL, Bond_Data<real_f> &bond, 
+    real_f *b, real_f *bp
+)
+{
+    const Tersoff_Potential &potential = *bond.potential;
+    const real_f rc = potential.rc;
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        int type1 = bond.type[n1];
+        for (int i1 = 0; i1 < NN[n1]; ++i1)   
+        {       
+            int index12 = NO[n1] + i1;
+            if (bond.fc[index12] == 0.0) // b12 is only used with fc12
+            {
+                b[index12]  = 0.0;
+                bp[index12] = 0.0;
+                continue;
+            }
+            int type2 = bond.type[NL[index12]];
+            real_f x12 = bond.x12[index12];
+            real_f y12 = bond.y12[index12];
+            real_f z12 = bond.z12[index12];
+            real_f d12 = bond.d12[index12];
+
+            real_f zeta = 0.0;
+            for (int i2 = 0; i2 < NN[n1]; ++i2)
+            {
+                if (i2 == i1) { continue; } // ensure that n3 != n2
+                int index13 = NO[n1] + i2;
+                real_f d13 = bond.d12[index13];
+                if (d13 >= rc) { continue; } // in the skin
+                int type3 = bond.type[NL[index13]];
+                const double *p = find_parameters
+                (potential, type1, type2, type3);
+                real_f fc13;
+                find_fc(p, d13, fc13);
+                if (fc13 == 0.0) { continue; }
+                real_f cos = (x12 * bond.x12[index13] + y12 * bond.y12[index13]
+                           + z12 * bond.z12[index13]) / (d12 * d13);
+                real_f g123, e123, ep123; 
+                find_g(p, cos, g123);
+                find_e_and_ep(p, d12, d13, e123, ep123);
+                zeta += fc13 * g123 * e123;
+            } 
+            const double *p = find_parameters(potential, type1, type2, type2);
+            real_f beta = p[TERS_BETA];
+            real_f n = p[TERS_N];
+            real_f minus_half_over_n = p[TERS_MINUS_HALF_OVER_N];
+            real_f bzn = pow(beta * zeta, n);
+            real_f b12 = pow(1 + bzn, minus_half_over_n);
+            b[index12]  = b12;
+            bp[index12] = (zeta > 0.0) 
+                        ? - b12 * bzn * 0.5 / ((1.0 + bzn) * zeta) : 0.0;
+        }
+    }
+}
+
+// the partial forces and the per-particle properties, as find_force_tersoff
+template <int props, typename real_x, typename real_f>
+void find_force_tersoff_types
+(
+    int N, int *NN, int *NO, int *NL, Bond_Data<real_f> &bond, real_f *b, 
+    real_f *bp, real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, 
+    real_f *fz, real_f *f12x, real_f *f12y, real_f *f12z, real_x *prop_atom, 
+    real_x prop[7]
+)
+{
+    const Tersoff_Potential &potential = *bond.potential;
+    const real_f rc = potential.rc;
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        real_x p1[7] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+        int type1 = bond.type[n1];
+        for (int i1 = 0; i1 < NN[n1]; ++i1)   
+        {       
+            int index12 = NO[n1] + i1;
+            real_f d12 = bond.d12[index12];
+            if (d12 >= rc) // in the skin
+            { 
+                f12x[index12] = f12y[index12] = f12z[index12] = 0.0;
+                continue; 
+            }
+            int n2 = NL[index12];
+            int type2 = bond.type[n2];
+            real_f x12 = bond.x12[index12];
+            real_f y12 = bond.y12[index12];
+            real_f z12 = bond.z12[index12];
+            real_f d12inv = 1.0 / d12;
+            real_f fc12 = bond.fc[index12];
+            real_f fcp12 = bond.fcp[index12];
+            real_f fa12 = bond.fa[index12];
+            real_f fap12 = bond.fap[index12];
+            real_f fr12 = bond.fr[index12];
+            real_f frp12 = bond.frp[index12];
+
+            real_f f12[3] = {0.0, 0.0, 0.0};   // d_U_i_d_r_ij
+           
+            // accumulate_force_12 
+            real_f b12 = b[index12]; 
+            real_f factor1 = - b12 * fa12 + fr12;
+            real_f factor2 = - b12 * fap12 + frp12;    
+            real_f factor3 = (fcp12 * factor1 + fc12 * factor2) / d12;   
+            f12[0] += x12 * factor3 * 0.5; 
+            f12[1] += y12 * factor3 * 0.5;
+            f12[2] += z12 * factor3 * 0.5;     
+            real_f p12 = factor1 * fc12; // U_ij
+
+            // accumulate_force_123: zeta_12 (triplet ijk) and zeta_13 
+            // (triplet ikj) depend on r_12
+            real_f bp12 = bp[index12]; 
+            for (int i2 = 0; i2 < NN[n1]; ++i2)
+            {    
+                if (i2 == i1) { continue; } // ensure that n3 != n2
+                int index13 = NO[n1] + i2;
+                real_f d13 = bond.d12[index13];
+                if (d13 >= rc) { continue; } // in the skin
+                int type3 = bond.type[NL[index13]];
+                const double *p_ijk = find_parameters
+                (potential, type1, type2, type3);
+                const double *p_ikj = find_parameters
+                (potential, type1, type3, type2);
+                real_f fc13 = bond.fc[index13]; // triplet ikk
+                real_f fa13 = bond.fa[index13];
+                real_f fc_ijk_13, fc_ikj_12, fcp_ikj_12;
+                find_fc(p_ijk, d13, fc_ijk_13);
+                if (fc13 == 0.0 && fc_ijk_13 == 0.0) { continue; }
+                find_fc_and_fcp(p_ikj, d12, fc_ikj_12, fcp_ikj_12);
+                real_f x13 = bond.x12[index13];
+                real_f y13 = bond.y12[index13];
+                real_f z13 = bond.z12[index13];
+                real_f bp13 = bp[index13]; 
+
+                real_f cos123 = (x12 * x13 + y12 * y13 + z12 * z13) / (d12 * d13);
+                real_f g_ijk, gp_ijk, g_ikj, gp_ikj;
+                find_g_and_gp(p_ijk, cos123, g_ijk, gp_ijk);
+                find_g_and_gp(p_ikj, cos123, g_ikj, gp_ikj);
+                real_f e_ijk, ep_ijk, e_ikj, ep_ikj; // ep: derivative with 
+                find_e_and_ep(p_ijk, d12, d13, e_ijk, ep_ijk); // the first 
+                find_e_and_ep(p_ikj, d13, d12, e_ikj, ep_ikj); // distance
+                real_f cos_x = x13 / (d12 * d13) - x12 * cos123 / (d12 * d12);
+                real_f cos_y = y13 / (d12 * d13) - y12 * cos123 / (d12 * d12);
+                real_f cos_z = z13 / (d12 * d13) - z12 * cos123 / (d12 * d12);
+                real_f factor12 = - bp12 * fc12 * fa12 * fc_ijk_13;
+                real_f factor13 = - bp13 * fc13 * fa13;
+                real_f factor123a = factor12 * gp_ijk * e_ijk
+                                  + factor13 * fc_ikj_12 * gp_ikj * e_ikj;
+                real_f factor123b = (factor12 * g_ijk * ep_ijk + factor13 
+                                  * g_ikj * (fcp_ikj_12 * e_ikj 
+                                  - fc_ikj_12 * ep_ikj)) * d12inv;
+                f12[0] += (x12 * factor123b + factor123a * cos_x) * 0.5; 
+                f12[1] += (y12 * factor123b + factor123a * cos_y) * 0.5;
+                f12[2] += (z12 * factor123b + factor123a * cos_z) * 0.5;
+            }
+            f12x[index12] = f12[0];
+            f12y[index12] = f12[1];
+            f12z[index12] = f12[2];
+
+            if (props & PROP_ENERGY) { p1[0] += p12 * 0.5; }
+            if (props & PROP_VIRIAL)
+            {
+                p1[1] -= f12[0] * x12;
+                p1[2] -= f12[1] * y12;
+                p1[3] -= f12[2] * z12;
+            }
+            if (props & PROP_HEAT)
+            {
+                real_x f12_dot_v2 = f12[0] * vx[n2] + f12[1] * vy[n2] 
+                                  + f12[2] * vz[n2];   
+                p1[4] -= f12_dot_v2 * x12;  
+                p1[5] -= f12_dot_v2 * y12;                       
+                p1[6] -= f12_dot_v2 * z12;
+            }
+        }
+        if (props != PROP_NONE)
+        {
+            for (int k = 0; k < 7; ++k) { prop_atom[n1 * 7 + k] = p1[k]; }
+        }
+    } 
+
+    accumulate_force
+    (
+        N, NN, NO, NL, 0, bond.reverse, f12x, f12y, f12z, prop_atom, 
+        fx, fy, fz, prop, props
+    );
+} 
+
+/*
+    Vectorized force evaluation
+    1) One lane per particle: the loops over the neighbors are outside and
+       the loop over the particles of a thread is vectorized. The bond data
+       are stored as i1 * N + n1 (bond-major, as in GPUMD) so that the lanes
+       access contiguous memory. The bonds of a thread are padded up to its
+       largest number of neighbors (the neighbor list is padded with the 
+       particle itself and the padded bonds have fc = 0), so that all the 
+       lanes do the same work.
+    2) The kernels are compiled for AVX-512, AVX2, and the default (SSE2) 
+       instruction sets, and the best one supported by the CPU is chosen at
+       run time (the clones are selected by CPU features, not CPU models).
+    3) The loops have no branches and no library calls: exp, log, pow, cos, 
+       and sin are replaced by the polynomial approximations below, and the 
+       selections are done with integer masks (select_by_sign). sqrt is only 
+       vectorized with -fno-math-errno, so the bond geometry (one sqrt per
+       bond) stays in a scalar loop.
+    4) The forces agree with the scalar version to about 1e-14 (relative) 
+       in double precision and 1e-5 in float precision. 
+*/
+
+// name of the instruction set used by the vectorized kernels
+const char* get_simd_name()
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx512f")) { return "AVX-512"; }
+    if (__builtin_cpu_supports("avx2")) { return "AVX2"; }
+    return "SSE2";
+#else
+    return "compiler default";
+#endif
+}
+
+// largest number of neighbors of the particles n_begin <= n1 < n_end
+inline int find_max_neighbor(int n_begin, int n_end, int *NN)
+{
+    int nn_max = 0;
+    for (int n1 = n_begin; n1 < n_end; ++n1)
+    {
+        if (NN[n1] > nn_max) { nn_max = NN[n1]; }
+    }
+    return nn_max;
+}
+
+// bit layout of the floating-point types and the constants that depend on it
+template <typename real> struct Float_Bits;
+
+template <> struct Float_Bits<double>
+{
+    typedef unsigned long long uint;
+    static const int num_mantissa_bits = 52;
+    static const int exponent_bias = 1023;
+    static constexpr double two_to_m = 4503599627370496.0; // 2^52
+    static constexpr double ln2_hi = 6.93147180369123816490e-01;
+    static constexpr double ln2_lo = 1.90821492927058770002e-10;
+    static constexpr double max_exp_arg = 700.0;
+};
+
+template <> struct Float_Bits<float>
+{
+    typedef unsigned int uint;
+    static const int num_mantissa_bits = 23;
+    static const int exponent_bias = 127;
+    static constexpr float two_to_m = 8388608.0f; // 2^23
+    static constexpr float ln2_hi = 6.93145751953125e-01f;
+    static constexpr float ln2_lo = 1.42860682030941723212e-06f;
+    static constexpr float max_exp_arg = 87.0f;
+};
+
+template <typename real>
+SIMD_INLINE real as_real(typename Float_Bits<real>::uint i)
+{
+    real d;
+    memcpy(&d, &i, sizeof(real));
+    return d;
+}
+
+template <typename real>
+SIMD_INLINE typename Float_Bits<real>::uint as_bits(real d)
+{
+    typename Float_Bits<real>::uint i;
+    memcpy(&i, &d, sizeof(real));
+    return i;
+}
+
+// a if the sign bit of x is set and b otherwise; the selection uses integer
+// masks since GCC moves floating-point comparisons back into branches
+template <typename real>
+SIMD_INLINE real select_by_sign(real x, real a, real b)
+{
+    typedef typename Float_Bits<real>::uint uint;
+    uint mask = uint(0) - (as_bits(x) >> (sizeof(real) * 8 - 1));
+    return as_real<real>((as_bits(a) & mask) | (as_bits(b) & ~mask));
+}
+
+// exp(x) = 2^k exp(r) with |r| <= ln(2)/2 and exp(r) by its Taylor series
+// up to r^13; relative error < 3e-16 (double) or < 2e-7 (float) for
+// |x| < max_exp_arg (x is clamped to this)
+template <typename real>
+SIMD_INLINE real simd_exp(real x)
+{
+    typedef Float_Bits<real> Bits;
+    typedef typename Bits::uint uint;
+    const real log2e = 1.4426950408889634;
+    const real shifter = 1.5 * Bits::two_to_m;
+    x = select_by_sign(x + Bits::max_exp_arg, - Bits::max_exp_arg, x);
+    x = select_by_sign(Bits::max_exp_arg - x, Bits::max_exp_arg, x);
+    real kd = x * log2e + shifter; // the integer k is in the low bits
+    real k = kd - shifter;
+    real r = (x - k * Bits::ln2_hi) - k * Bits::ln2_lo;
+    real p = real(1.0 / 6227020800.0);
+    p = p * r + real(1.0 / 479001600.0);
+    p = p * r + real(1.0 / 39916800.0);
+    p = p * r + real(1.0 / 3628800.0);
+    p = p * r + real(1.0 / 362880.0);
+    p = p * r + real(1.0 / 40320.0);
+    p = p * r + real(1.0 / 5040.0);
+    p = p * r + real(1.0 / 720.0);
+    p = p * r + real(1.0 / 120.0);
+    p = p * r + real(1.0 / 24.0);
+    p = p * r + real(1.0 / 6.0);
+    p = p * r + real(0.5);
+    p = p * r + 1;
+    p = p * r + 1;
+    uint scale = as_bits(kd) - as_bits(shifter) + uint(Bits::exponent_bias);
+    return p * as_real<real>(scale << Bits::num_mantissa_bits);
+}
+
+// log(x) = e ln(2) + 2 atanh(s) with s = (m - 1) / (m + 1), where x = m 2^e
+// and sqrt(1/2) <= m < sqrt(2); absolute error < 3e-16 (double) or < 2e-7
+// (float) times max(1, |log(x)|) for normal x > 0
+template <typename real>
+SIMD_INLINE real simd_log(real x)
+{
+    typedef Float_Bits<real> Bits;
+    typedef typename Bits::uint uint;
+    const uint mantissa_mask = (uint(1) << Bits::num_mantissa_bits) - 1;
+    uint ix = as_bits(x);
+    real e = as_real<real>(as_bits(Bits::two_to_m)
+           | (ix >> Bits::num_mantissa_bits))
+           - Bits::two_to_m - real(Bits::exponent_bias);
+    real m = as_real<real>((ix & mantissa_mask) | as_bits(real(1)));
+    real is_large = real(1.4142135623730951) - m; // negative if large
+    e = select_by_sign(is_large, e + 1, e);
+    m = select_by_sign(is_large, m * real(0.5), m);
+    real s = (m - 1) / (m + 1);
+    real s2 = s * s;
+    real p = real(1.0 / 21.0);
+    p = p * s2 + real(1.0 / 19.0);
+    p = p * s2 + real(1.0 / 17.0);
+    p = p * s2 + real(1.0 / 15.0);
+    p = p * s2 + real(1.0 / 13.0);
+    p = p * s2 + real(1.0 / 11.0);
+    p = p * s2 + real(1.0 / 9.0);
+    p = p * s2 + real(1.0 / 7.0);
+    p = p * s2 + real(1.0 / 5.0);
+    p = p * s2 + real(1.0 / 3.0);
+    p = p * s2 + 1;
+    return e * Bits::ln2_hi + (2 * s * p + e * Bits::ln2_lo);
+}
+
+// x^y for x > 0; relative error < 1e-15 (double) or < 1e-6 (float) for the
+// arguments used here (0 < x < 20 with y = n and 1 <= x < 1e3 with
+// y = -1/(2n))
+template <typename real>
+SIMD_INLINE real simd_pow(real x, real y)
+{
+    return simd_exp(y * simd_log(x));
+}
+
+// cos(t) and sin(t) for 0 <= t <= pi from the Taylor series of sin(u) and
+// cos(u) with u = t - pi/2, up to u^21 and u^20; absolute error < 4e-16
+// (double) or < 1e-7 (float)
+template <typename real>
+SIMD_INLINE void simd_cos_sin(real t, real &c, real &s)
+{
+    real u = t - real(1.5707963267948966);
+    real u2 = u * u;
+    real ps = real(1.0 / 51090942171709440000.0);
+    ps = ps * u2 - real(1.0 / 121645100408832000.0);
+    ps = ps * u2 + real(1.0 / 355687428096000.0);
+    ps = ps * u2 - real(1.0 / 1307674368000.0);
+    ps = ps * u2 + real(1.0 / 6227020800.0);
+    ps = ps * u2 - real(1.0 / 39916800.0);
+    ps = ps * u2 + real(1.0 / 362880.0);
+    ps = ps * u2 - real(1.0 / 5040.0);
+    ps = ps * u2 + real(1.0 / 120.0);
+    ps = ps * u2 - real(1.0 / 6.0);
+    ps = ps * u2 + 1;
+    real pc = real(1.0 / 2432902008176640000.0);
+    pc = pc * u2 - real(1.0 / 6402373705728000.0);
+    pc = pc * u2 + real(1.0 / 20922789888000.0);
+    pc = pc * u2 - real(1.0 / 87178291200.0);
+    pc = pc * u2 + real(1.0 / 479001600.0);
+    pc = pc * u2 - real(1.0 / 3628800.0);
+    pc = pc * u2 + real(1.0 / 40320.0);
+    pc = pc * u2 - real(1.0 / 720.0);
+    pc = pc * u2 + real(1.0 / 24.0);
+    pc = pc * u2 - real(0.5);
+    pc = pc * u2 + 1;
+    c = - u * ps; // cos(t) = - sin(u)
+    s = pc;       // sin(t) = cos(u)
+}
+
+// The repulsive function and its derivative (vectorizable version)
+template <typename real_f>
+SIMD_INLINE void find_fr_and_frp_simd(real_f d12, real_f &fr, real_f &frp)
+{
+    const real_f a = 1393.6;
+    const real_f lambda = 3.4879;
+    fr  = a * simd_exp(- lambda * d12);
+    frp = - lambda * fr;
+}
+
+// The attractive function and its derivative (vectorizable version)
+template <typename real_f>
+SIMD_INLINE void find_fa_and_fap_simd(real_f d12, real_f &fa, real_f &fap)
+{
+    const real_f b = 430.0; // optimized
+    const real_f mu = 2.2119;
+    fa  = b * simd_exp(- mu * d12);
+    fap = - mu * fa;
+}
+
+// The cutoff function and its derivative (vectorizable version)
+template <typename real_f>
+SIMD_INLINE void find_fc_and_fcp_simd(real_f d12, real_f &fc, real_f &fcp)
+{
+    const real_f r1 = 1.8;
+    const real_f r2 = 2.1;
+    const real_f pi = 3.141592653589793;
+    const real_f pi_factor = pi / (r2 - r1);
+    const real_f half = 0.5;
+    real_f is_inner = d12 - r1; // negative if inner
+    real_f is_outer = d12 - r2; // not negative if outer
+    real_f t = select_by_sign(is_inner, real_f(0), pi_factor * (d12 - r1));
+    t = select_by_sign(is_outer, t, pi);
+    real_f c, s;
+    simd_cos_sin(t, c, s);
+    fc  = select_by_sign(is_inner, real_f(1), c * half + half);
+    fc  = select_by_sign(is_outer, fc, real_f(0)); // exactly zero beyond r2
+    fcp = select_by_sign(is_inner, real_f(0), - s * pi_factor * half);
+    fcp = select_by_sign(is_outer, fcp, real_f(0));
+}
+
+// find the range of particles of the calling thread (static schedule)
+inline void find_thread_range(int N, int &n_begin, int &n_end)
+{
+#ifdef _OPENMP
+    int num_threads = omp_get_num_threads();
+    int thread_id = omp_get_thread_num();
+#else
+    int num_threads = 1;
+    int thread_id = 0;
+#endif
+    n_begin = (int) ((long long) N * thread_id / num_threads);
+    n_end = (int) ((long long) N * (thread_id + 1) / num_threads);
+}
+
+// radial functions of the bonds of the particles n_begin <= n1 < n_end
+// (use_table: tabulated functions)
+template <int use_table, typename real_f>
+SIMD_TARGETS
+void find_radial_functions_simd
+(
+    int N, int n_begin, int n_end, int nn_max, Bond_Data<real_f> &bond
+)
+{
+    real_f *d12 = bond.d12;
+    real_f *fc = bond.fc, *fcp = bond.fcp;
+    real_f *fa = bond.fa, *fap = bond.fap;
+    real_f *fr = bond.fr, *frp = bond.frp;
+    Tersoff_Table<real_f> table = {}; // a local copy cannot alias the outputs
+    if (use_table) { table = *bond.table; }
+
+    for (int i1 = 0; i1 < nn_max; ++i1)
+    {
+#pragma omp simd
+        for (int n1 = n_begin; n1 < n_end; ++n1)
+        {
+            int index12 = i1 * N + n1;
+            if (use_table)
+            {
+                find_fc_and_fcp_table
+                (table, d12[index12], fc[index12], fcp[index12]);
+                find_fa_and_fap_table
+                (table, d12[index12], fa[index12], fap[index12]);
+                find_fr_and_frp_table
+                (table, d12[index12], fr[index12], frp[index12]);
+            }
+            else
+            {
+                find_fc_and_fcp_simd(d12[index12], fc[index12], fcp[index12]);
+                find_fa_and_fap_simd(d12[index12], fa[index12], fap[index12]);
+                find_fr_and_frp_simd(d12[index12], fr[index12], frp[index12]);
+            }
+        }
+    }
+}
+
+// evaluate the geometry and the radial functions of all the bonds
+template <typename real_x, typename real_f>
+void find_bond_data_simd
+(
+    int N, int *NN, int *NO, int *NL, int pbc[3], double box[3],
+    real_x *x, real_x *y, real_x *z, Bond_Data<real_f> &bond
+)
+{
+    double lxh = box[0] * 0.5;
+    double lyh = box[1] * 0.5;
+    double lzh = box[2] * 0.5;
+#pragma omp parallel
+    {
+        int n_begin, n_end;
+        find_thread_range(N, n_begin, n_end);
+        int nn_max = find_max_neighbor(n_begin, n_end, NN);
+        for (int n1 = n_begin; n1 < n_end; ++n1)
+        {
+            for (int i1 = 0; i1 < nn_max; ++i1)
+            {
+                int index12 = i1 * N + n1;
+                real_f x12 = 0.0, y12 = 0.0, z12 = 0.0;
+                real_f d12 = 1.0e3; // a padded bond is beyond the cutoff
+                if (i1 < NN[n1])
+                {
+                    int n2 = NL[NO[n1] + i1];
+                    real_x x12_x = x[n2] - x[n1];
+                    real_x y12_x = y[n2] - y[n1];
+                    real_x z12_x = z[n2] - z[n1];
+                    apply_mic(pbc, box, lxh, lyh, lzh, x12_x, y12_x, z12_x);
+                    x12 = x12_x;
+                    y12 = y12_x;
+                    z12 = z12_x;
+                    d12 = sqrt(x12 * x12 + y12 * y12 + z12 * z12);
+                }
+                bond.x12[index12] = x12;
+                bond.y12[index12] = y12;
+                bond.z12[index12] = z12;
+                bond.d12[index12] = d12;
+            }
+        }
+        if (bond.table)
+        {
+            find_radial_functions_simd<1>(N, n_begin, n_end, nn_max, bond);
+        }
+        else
+        {
+            find_radial_functions_simd<0>(N, n_begin, n_end, nn_max, bond);
+        }
+    }
+}
+
+// bond-order functions of the particles n_begin <= n1 < n_end (b holds
+// zeta until the last loop)
+template <int use_table, typename real_f>
+SIMD_TARGETS
+void find_b_and_bp_simd_range
+(
+    int N, int n_begin, int n_end, int nn_max, Bond_Data<real_f> &bond,
+    real_f *b, real_f *bp
+)
+{
+    const real_f beta = 1.5724e-7;
+    const real_f n = 0.72751;
+    const real_f minus_half_over_n = - 0.5 / n;
+    const real_f half = 0.5;
+    real_f *x12 = bond.x12, *y12 = bond.y12, *z12 = bond.z12;
+    real_f *d12 = bond.d12, *fc = bond.fc;
+    Tersoff_Table<real_f> table = {}; // a local copy cannot alias the outputs
+    if (use_table) { table = *bond.table; }
+
+    for (int i1 = 0; i1 < nn_max; ++i1)
+    {
+#pragma omp simd
+        for (int n1 = n_begin; n1 < n_end; ++n1)
+        {
+            b[i1 * N + n1] = 0;
+        }
+        for (int i2 = 0; i2 < nn_max; ++i2)
+        {
+            if (i2 == i1) { continue; }
+#pragma omp simd
+            for (int n1 = n_begin; n1 < n_end; ++n1)
+            {
+                int index12 = i1 * N + n1;
+                int index13 = i2 * N + n1;
+                real_f cos = (x12[index12] * x12[index13]
+                           + y12[index12] * y12[index13]
+                           + z12[index12] * z12[index13])
+                           / (d12[index12] * d12[index13]);
+                real_f g123, gp123;
+                if (use_table) 
+                { 
+                    find_g_and_gp_table(table, cos, g123, gp123); 
+                }
+                else 
+                { 
+                    find_g(cos, g123); 
+                }
+                b[index12] += fc[index13] * g123;
+            }
+        }
+    }
+
+    for (int i1 = 0; i1 < nn_max; ++i1)
+    {
+#pragma omp simd
+        for (int n1 = n_begin; n1 < n_end; ++n1)
+        {
+            int index12 = i1 * N + n1;
+            real_f zeta = b[index12];
+            real_f is_positive = 0 - zeta; // zeta >= 0
+            real_f zeta_safe = select_by_sign(is_positive, zeta, real_f(1));
+            real_f bzn = simd_pow(beta * zeta_safe, n);
+            bzn = select_by_sign(is_positive, bzn, real_f(0));
+            real_f b12 = simd_pow(1 + bzn, minus_half_over_n);
+            real_f bp12 = - b12 * bzn * half / ((1 + bzn) * zeta_safe);
+            real_f is_bond = 0 - fc[index12]; // fc >= 0
+            b[index12] = select_by_sign(is_bond, b12, real_f(0));
+            bp[index12] = select_by_sign(is_bond, bp12, real_f(0));
+        }
+    }
+}
+
+template <typename real_f>
+void find_b_and_bp_simd
+(
+    int N, int *NN, Bond_Data<real_f> &bond, real_f *b, real_f *bp
+)
+{
+#pragma omp parallel
+    {
+        int n_begin, n_end;
+        find_thread_range(N, n_begin, n_end);
+        int nn_max = find_max_neighbor(n_begin, n_end, NN);
+        if (bond.table)
+        {
+            find_b_and_bp_simd_range<1>(N, n_begin, n_end, nn_max, bond, b, bp);
+        }
+        else
+        {
+            find_b_and_bp_simd_range<0>(N, n_begin, n_end, nn_max, bond, b, bp);
+        }
+    }
+}
+
+// partial forces and per-particle properties of the particles
+// n_begin <= n1 < n_end; see find_force_tersoff for the formulas and props
+template <int use_table, int props, typename real_x, typename real_f>
+SIMD_TARGETS
+void find_partial_force_simd_range
+(
+    int N, int n_begin, int n_end, int nn_max, int *NO, int *NL,
+    Bond_Data<real_f> &bond, real_f *b, real_f *bp,
+    real_x *vx, real_x *vy, real_x *vz,
+    real_f *f12x, real_f *f12y, real_f *f12z, real_x *prop_atom
+)
+{
+    const real_f half = 0.5;
+    real_f *x12 = bond.x12, *y12 = bond.y12, *z12 = bond.z12;
+    real_f *d12 = bond.d12;
+    real_f *fc = bond.fc, *fcp = bond.fcp;
+    real_f *fa = bond.fa, *fap = bond.fap;
+    real_f *fr = bond.fr, *frp = bond.frp;
+    Tersoff_Table<real_f> table = {}; // a local copy cannot alias the outputs
+    if (use_table) { table = *bond.table; }
+
+    if (props != PROP_NONE)
+    {
+#pragma omp simd
+        for (int n1 = n_begin; n1 < n_end; ++n1)
+        {
+            for (int k = 0; k < 7; ++k) { prop_atom[n1 * 7 + k] = 0; }
+        }
+    }
+
+    for (int i1 = 0; i1 < nn_max; ++i1)
+    {
+#pragma omp simd
+        for (int n1 = n_begin; n1 < n_end; ++n1)
+        {
+            int index12 = i1 * N + n1;
+            real_f d12inv = 1 / d12[index12];
+            real_f factor1 = - b[index12] * fa[index12] + fr[index12];
+            real_f factor2 = - b[index12] * fap[index12] + frp[index12];
+            real_f factor3 = (fcp[index12] * factor1 + fc[index12] * factor2)
+                           * d12inv;
+            f12x[index12] = x12[index12] * factor3 * half;
+            f12y[index12] = y12[index12] * factor3 * half;
+            f12z[index12] = z12[index12] * factor3 * half;
+            if (props & PROP_ENERGY)
+            {
+                prop_atom[n1 * 7 + 0] += factor1 * fc[index12] * half;
+            }
+        }
+
+        for (int i2 = 0; i2 < nn_max; ++i2)
+        {
+            if (i2 == i1) { continue; }
+#pragma omp simd
+            for (int n1 = n_begin; n1 < n_end; ++n1)
+            {
+                int index12 = i1 * N + n1;
+                int index13 = i2 * N + n1;
+                real_f d12inv = 1 / d12[index12];
+                real_f d1213inv = d12inv / d12[index13];
+                real_f cos123 = (x12[index12] * x12[index13]
+                              + y12[index12] * y12[index13]
+                              + z12[index12] * z12[index13]) * d1213inv;
+                real_f g123, gp123;
+                if (use_table) 
+                { 
+                    find_g_and_gp_table(table, cos123, g123, gp123); 
+                }
+                else 
+                { 
+                    find_g_and_gp(cos123, g123, gp123); 
+                }
+                real_f cos_factor = cos123 * d12inv * d12inv;
+                real_f cos_x = x12[index13] * d1213inv
+                             - x12[index12] * cos_factor;
+                real_f cos_y = y12[index13] * d1213inv
+                             - y12[index12] * cos_factor;
+                real_f cos_z = z12[index13] * d1213inv
+                             - z12[index12] * cos_factor;
+                real_f fc13fa13bp13 = fc[index13] * fa[index13] * bp[index13];
+                real_f factor123a = (- bp[index12] * fc[index12]
+                                  * fa[index12] * fc[index13]
+                                  - fc13fa13bp13 * fc[index12]) * gp123;
+                real_f factor123b = - fc13fa13bp13 * fcp[index12] * g123
+                                  * d12inv;
+                f12x[index12] += (x12[index12] * factor123b
+                               + factor123a * cos_x) * half;
+                f12y[index12] += (y12[index12] * factor123b
+                               + factor123a * cos_y) * half;
+                f12z[index12] += (z12[index12] * factor123b
+                               + factor123a * cos_z) * half;
+            }
+        }
+
+        if (props & PROP_VIRIAL)
+        {
+#pragma omp simd
+            for (int n1 = n_begin; n1 < n_end; ++n1)
+            {
+                int index12 = i1 * N + n1;
+                prop_atom[n1 * 7 + 1] -= f12x[index12] * x12[index12];
+                prop_atom[n1 * 7 + 2] -= f12y[index12] * y12[index12];
+                prop_atom[n1 * 7 + 3] -= f12z[index12] * z12[index12];
+            }
+        }
+
+        if (props & PROP_HEAT)
+        {
+#pragma omp simd
+            for (int n1 = n_begin; n1 < n_end; ++n1)
+            {
+                int index12 = i1 * N + n1;
+                int index = NO[n1] + i1; // the padded bonds have f12 = 0
+                int n2 = (index < NO[n1 + 1]) ? NL[index] : n1;
+                real_x f12_dot_v2 = f12x[index12] * vx[n2]
+                                  + f12y[index12] * vy[n2]
+                                  + f12z[index12] * vz[n2];
+                prop_atom[n1 * 7 + 4] -= f12_dot_v2 * x12[index12];
+                prop_atom[n1 * 7 + 5] -= f12_dot_v2 * y12[index12];
+                prop_atom[n1 * 7 + 6] -= f12_dot_v2 * z12[index12];
+            }
+        }
+    }
+}
+
+template <int props, typename real_x, typename real_f>
+void find_force_tersoff_simd
+(
+    int N, int *NN, int *NO, int *NL, Bond_Data<real_f> &bond, real_f *b,
+    real_f *bp, real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy,
+    real_f *fz, real_f *f12x, real_f *f12y, real_f *f12z, real_x *prop_atom,
+    real_x prop[7]
+)
+{
+#pragma omp parallel
+    {
+        int n_begin, n_end;
+        find_thread_range(N, n_begin, n_end);
+        int nn_max = find_max_neighbor(n_begin, n_end, NN);
+        if (bond.table)
+        {
+            find_partial_force_simd_range<1, props>
+            (
+                N, n_begin, n_end, nn_max, NO, NL, bond, b, bp, vx, vy, vz,
+                f12x, f12y, f12z, prop_atom
+            );
+        }
+        else
+        {
+            find_partial_force_simd_range<0, props>
+            (
+                N, n_begin, n_end, nn_max, NO, NL, bond, b, bp, vx, vy, vz,
+                f12x, f12y, f12z, prop_atom
+            );
+        }
+    }
+    accumulate_force
+    (
+        N, NN, NO, NL, 1, bond.reverse, f12x, f12y, f12z, prop_atom,
+        fx, fy, fz, prop, props
+    );
+}
+
+// a wrapper; props tells which properties are needed besides the forces
+// (PROP_NONE or PROP_ALL)
+template <typename real_x, typename real_f>
+void find_force
+(
+    int N, Neighbor &neighbor, int pbc[3], double box[3],
+    Bond_Data<real_f> &bond, real_x *x, real_x *y, real_x *z, 
+    real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, real_f *fz, 
+    real_x *prop_atom, real_x prop[7], int use_simd, int props
+)
+{
+    int *NN = neighbor.NN, *NO = neighbor.NO, *NL = neighbor.NL;
+    // the vectorized kernels pad the bonds of each particle to nn_max
+    use_simd = use_simd && !bond.potential;
+    reserve_bond_data(use_simd ? N * neighbor.nn_max : NO[N], bond);
+    bond.reverse = neighbor.reverse;
+    real_f *b = bond.b, *bp = bond.bp;
+    real_f *f12x = bond.f12x, *f12y = bond.f12y, *f12z = bond.f12z;
+
+    // only the forces-only and the full versions are instantiated
+    if (bond.potential) // multi-species (not vectorized)
+    {
+        phase_begin();
+        find_bond_data(N, NN, NO, NL, pbc, box, x, y, z, bond);
+        phase_end(PHASE_BOND);
+        phase_begin();
+        find_b_and_bp_types(N, NN, NO, NL, bond, b, bp);
+        phase_end(PHASE_B_BP);
+        phase_begin();
+        if (props == PROP_NONE)
+        {
+            find_force_tersoff_types<PROP_NONE>
+            (
+                N, NN, NO, NL, bond, b, bp, vx, vy, vz, fx, fy, fz,
+                f12x, f12y, f12z, prop_atom, prop
+            );
+        }
+        else
+        {
+            find_force_tersoff_types<PROP_ALL>
+            (
+                N, NN, NO, NL, bond, b, bp, vx, vy, vz, fx, fy, fz,
+                f12x, f12y, f12z, prop_atom, prop
+            );
+        }
+    }
+    else if (use_simd)
+    {
+        phase_begin();
+        find_bond_data_simd(N, NN, NO, NL, pbc, box, x, y, z, bond);
+        phase_end(PHASE_BOND);
+        phase_begin();
+        find_b_and_bp_simd(N, NN, bond, b, bp);
+        phase_end(PHASE_B_BP);
+        phase_begin();
+        if (props == PROP_NONE)
+        {
+            find_force_tersoff_simd<PROP_NONE>
+            (
+                N, NN, NO, NL, bond, b, bp, vx, vy, vz, fx, fy, fz,
+                f12x, f12y, f12z, prop_atom, prop
+            );
+        }
+        else
+        {
+            find_force_tersoff_simd<PROP_ALL>
+            (
+                N, NN, NO, NL, bond, b, bp, vx, vy, vz, fx, fy, fz,
+                f12x, f12y, f12z, prop_atom, prop
+            );
+        }
+    }
+    else
+    {
+        phase_begin();
+        find_bond_data(N, NN, NO, NL, pbc, box, x, y, z, bond);
+        phase_end(PHASE_BOND);
+        phase_begin();
+        find_b_and_bp(N, NN, NO, bond, b, bp);
+        phase_end(PHASE_B_BP);
+        phase_begin();
+        if (props == PROP_NONE)
+        {
+            find_force_tersoff<PROP_NONE>
+            (
+                N, NN, NO, NL, bond, b, bp, vx, vy, vz, fx, fy, fz,
+                f12x, f12y, f12z, prop_atom, prop
+            );
+        }
+        else
+        {
+            find_force_tersoff<PROP_ALL>
+            (
+                N, NN, NO, NL, bond, b, bp, vx, vy, vz, fx, fy, fz,
+                f12x, f12y, f12z, prop_atom, prop
+            );
+        }
+    }
+    phase_end(PHASE_FORCE);
+}
+
+// Evans driving force of the HNEMD method (see note 21). The heat current 
+// J = sum over the bonds of - r12 (f12 . v2) is J = sum_n W_n v_n, and the 
+// force F_n = Fe W_n, summed from the bonds n2 -> n1 = n, makes Fe . J 
+// the power of the driving force; the total force of each replica is then
+// removed as in GPUMD. The bond data are those of the last find_force
+// (is_bond_major for the vectorized kernels).
+template <typename real_f>
+void add_driving_force
+(
+    int N, Neighbor &neighbor, int is_bond_major, Bond_Data<real_f> &bond,
+    const double fe[3], int num_replicas, int *id, real_f *fx, real_f *fy, 
+    real_f *fz
+)
+{
+    int *NN = neighbor.NN, *NO = neighbor.NO, *NL = neighbor.NL;
+#pragma omp parallel for schedule(static)
+    for (int n1 = 0; n1 < N; ++n1)
+    {
+        double f1[3] = {0.0, 0.0, 0.0};
+        for (int i1 = 0; i1 < NN[n1]; ++i1)
+        {
+            int index21 = neighbor.reverse[NO[n1] + i1]; // bond n2 -> n1
+            if (is_bond_major)
+            {
+                int n2 = NL[NO[n1] + i1];
+                index21 = (index21 - NO[n2]) * N + n2;
+            }
+            double fe_dot_r21 = fe[0] * bond.x12[index21] 
+                              + fe[1] * bond.y12[index21] 
+                              + fe[2] * bond.z12[index21];
+            f1[0] -= fe_dot_r21 * bond.f12x[index21];
+            f1[1] -= fe_dot_r21 * bond.f12y[index21];
+            f1[2] -= fe_dot_r21 * bond.f12z[index21];
+        }
+        fx[n1] += f1[0]; 
+        fy[n1] += f1[1]; 
+        fz[n1] += f1[2];
+    }
+
+    // the total force of each replica (in the order of n)
+    int N_replica = N / num_replicas;
+    double *f_total = (double*) malloc(num_replicas * 3 * sizeof(double));
+    for (int k = 0; k < num_replicas * 3; ++k) { f_total[k] = 0.0; }
+    for (int n = 0; n < N; ++n)
+    {
+        double *f = f_total + id[n] / N_replica * 3;
+        f[0] += fx[n]; f[1] += fy[n]; f[2] += fz[n];
+    }
+    for (int k = 0; k < num_replicas * 3; ++k) { f_total[k] /= N_replica; }
+#pragma omp parallel for schedule(static)
+    for (int n = 0; n < N; ++n)
+    {
+        double *f = f_total + id[n] / N_replica * 3;
+        fx[n] -= f[0]; fy[n] -= f[1]; fz[n] -= f[2];
+    }
+    free(f_total);
+}
+
+// velocity-Verlet
+template <typename real_x, typename real_f>
+void integrate
+(
+    int N, double time_step, real_x *m, real_f *fx, real_f *fy, real_f *fz, 
+    real_x *vx, real_x *vy, real_x *vz, real_x *x, real_x *y, real_x *z, 
+    int flag
+)
+{
+    real_x time_step_half = time_step * 0.5;
+#pragma omp parallel for schedule(static)
+    for (int n = 0; n < N; ++n)
+    {
+        real_x mass_inv = 1.0 / m[n];
+        real_x ax = fx[n] * mass_inv;
+        real_x ay = fy[n] * mass_inv;
+        real_x az = fz[n] * mass_inv;
+        vx[n] += ax * time_step_half;
+        vy[n] += ay * time_step_half;
+        vz[n] += az * time_step_half;
+        if (flag == 1) 
+        { 
+            x[n] += vx[n] * time_step; 
+            y[n] += vy[n] * time_step; 
+            z[n] += vz[n] * time_step; 
+        }
+    }
+}
+
+// find heat current autocorrelation (hac)
+void find_hac
+(
+    int Nc, int M, double *hx, double *hy, double *hz, double *hac_x, 
+    double *hac_y, double *hac_z 
+)
+{
+    for (int nc = 0; nc < Nc; nc++) // loop over the correlation time points
+    {
+        for (int m = 0; m < M; m++) // loop over the time origins
+        {
+            hac_x[nc] += hx[m] * hx[m + nc]; 
+            hac_y[nc] += hy[m] * hy[m + nc]; 
+            hac_z[nc] += hz[m] * hz[m + nc]; 
+        }
+        hac_x[nc] /= M; hac_y[nc] /= M; hac_z[nc] /= M;
+    }
+}
+
+// in-place radix-2 FFT of length L (a power of 2) with the twiddle factors
+// cos_table[k] + i sin_table[k] = exp(-2 pi i k / L), 0 <= k < L/2; 
+// the inverse transform (sign = -1) is not normalized
+void fft
+(
+    int L, int sign, double *cos_table, double *sin_table, 
+    double *re, double *im
+)
+{
+    for (int i = 1, j = 0; i < L; ++i) // bit-reversal permutation
+    {
+        int bit = L >> 1;
+        for (; j & bit; bit >>= 1) { j ^= bit; }
+        j ^= bit;
+        if (i < j) 
+        {
+            double t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+    for (int len = 2; len <= L; len <<= 1) // butterflies
+    {
+        int half = len >> 1;
+        int stride = L / len;
+        for (int i = 0; i < L; i += len)
+        {
+            for (int k = 0; k < half; ++k)
+            {
+                double wr = cos_table[k * stride];
+                double wi = sin_table[k * stride] * sign;
+                int i1 = i + k, i2 = i + k + half;
+                double tr = re[i2] * wr - im[i2] * wi;
+                double ti = re[i2] * wi + im[i2] * wr;
+                re[i2] = re[i1] - tr; im[i2] = im[i1] - ti;
+                re[i1] += tr; im[i1] += ti;
+            }
+        }
+    }
+}
+
+// the smallest power of 2 that is not smaller than Nd
+int find_fft_length(int Nd)
+{
+    int L = 1;
+    while (L < Nd) { L <<= 1; }
+    return L;
+}
+
+// sums of h(m) h(m + nc) over the time origins m < M with m + nc < Nd 
+// (M <= Nd), for nc < Nc, by FFT (Wiener-Khinchin): the first M data are 
+// correlated with the first Nd data and both are zero-padded to L >= Nd and 
+// L >= M + Nc, such that there is no wrap-around
+void find_correlation_fft(int Nc, int M, int Nd, double *h[3], double *sum[3])
+{
+    int L = find_fft_length((Nd > M + Nc) ? Nd : M + Nc);
+    double *cos_table = (double*) malloc(sizeof(double) * (L / 2));
+    double *sin_table = (double*) malloc(sizeof(double) * (L / 2));
+    double *re = (double*) malloc(sizeof(double) * L);
+    double *im = (double*) malloc(sizeof(double) * L);
+    for (int k = 0; k < L / 2; ++k)
+    {
+        cos_table[k] = cos(2.0 * M_PI * k / L);
+        sin_table[k] = - sin(2.0 * M_PI * k / L);
+    }
+
+    for (int d = 0; d < 3; ++d)
+    {
+        // one transform for both real sequences: a (the time origins) in the 
+        // real part and b (all the data) in the imaginary part
+        for (int n = 0; n < L; ++n)
+        {
+            re[n] = (n < M) ? h[d][n] : 0.0;
+            im[n] = (n < Nd) ? h[d][n] : 0.0;
+        }
+        fft(L, 1, cos_table, sin_table, re, im);
+
+        // conj(A) * B, which is Hermitian
+        for (int k = 0; k <= L / 2; ++k)
+        {
+            int k2 = (L - k) & (L - 1);
+            double ar = (re[k] + re[k2]) * 0.5, ai = (im[k] - im[k2]) * 0.5;
+            double br = (im[k] + im[k2]) * 0.5, bi = (re[k2] - re[k]) * 0.5;
+            double pr = ar * br + ai * bi;
+            double pi = ar * bi - ai * br;
+            re[k] = pr; im[k] = pi;
+            re[k2] = pr; im[k2] = - pi;
+        }
+        fft(L, -1, cos_table, sin_table, re, im);
+
+        for (int nc = 0; nc < Nc; nc++) { sum[d][nc] = re[nc] / L; }
+    }
+
+    free(cos_table); free(sin_table); free(re); free(im);
+}
+
+// the FFT version of find_hac; the first M data are correlated with all the
+// Nd = M + Nc data, which is the same estimator as in find_hac
+void find_hac_fft
+(
+    int Nc, int M, double *hx, double *hy, double *hz, double *hac_x, 
+    double *hac_y, double *hac_z 
+)
+{
+    double *h[3] = {hx, hy, hz};
+    double *hac[3] = {hac_x, hac_y, hac_z};
+    find_correlation_fft(Nc, M, M + Nc, h, hac);
+    for (int d = 0; d < 3; ++d)
+    {
+        for (int nc = 0; nc < Nc; nc++) { hac[d][nc] /= M; }
+    }
+}
+
+// 1 if the correlator should store the Nd heat current data and use FFT, 
+// which needs fewer operations for long correlation times even when the 
+// partial hac is found at each tenth of the run (10 transforms); the cost 
+// of a transform relative to the streaming sums is measured by "./a.out hac"
+int use_fft_for_hac(int Nd, int Nc)
+{
+    int L = find_fft_length(Nd);
+    double cost_streaming = (double) Nc * (Nd - Nc);
+    double cost_fft = 10 * 10.0 * L * log2((double) L);
+    return cost_fft < cost_streaming;
+}
+
+// 1 if the correlators of a run use FFT (only EMD has correlators)
+int use_fft_for_run(int Nd, int Nc, const double fe[3])
+{
+    int use_hnemd = (fe[0] != 0.0 || fe[1] != 0.0 || fe[2] != 0.0);
+    return !use_hnemd && use_fft_for_hac(Nd, Nc);
+}
+
+// find running thermal conductivity (rtc)
+static void find_rtc
+(
+    int Nc, double factor, double *hac_x, double *hac_y, double *hac_z,
+    double *rtc_x, double *rtc_y, double *rtc_z
+)
+{
+    for (int nc = 1; nc < Nc; nc++)  
+    {
+        rtc_x[nc] = rtc_x[nc - 1] + (hac_x[nc - 1] + hac_x[nc]) * factor;
+        rtc_y[nc] = rtc_y[nc - 1] + (hac_y[nc - 1] + hac_y[nc]) * factor;
+        rtc_z[nc] = rtc_z[nc - 1] + (hac_z[nc - 1] + hac_z[nc]) * factor;
+    }
+}
+
+// find rtc from hac and output both (one line per correlation time); 
+// kappa gets the rtc at the largest correlation time
+void output_hac_kappa
+(
+    FILE *fid, int Nc, double dt, double T_0, double V, 
+    double *hac_x, double *hac_y, double *hac_z, double kappa[3]
+)
+{
+    double dt_in_ps = dt * TIME_UNIT_CONVERSION / 1000.0; // ps
+    double *rtc_x = (double *)malloc(sizeof(double) * Nc);
+    double *rtc_y = (double *)malloc(sizeof(double) * Nc);
+    double *rtc_z = (double *)malloc(sizeof(double) * Nc);
+    for (int nc = 0; nc < Nc; nc++) {rtc_x[nc] = rtc_y[nc] = rtc_z[nc] = 0.0;}
+
+    double factor = dt * 0.5 *  KAPPA_UNIT_CONVERSION / (K_B * T_0 * T_0 * V);
+    find_rtc(Nc, factor, hac_x, hac_y, hac_z, rtc_x, rtc_y, rtc_z);
+
+    for (int nc = 0; nc < Nc; nc++) 
+    {
+        fprintf
+        (
+            fid, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n", 
+            nc * dt_in_ps, // in units of ps
+            hac_x[nc], hac_y[nc], hac_z[nc], // in my natural units 
+            rtc_x[nc], rtc_y[nc], rtc_z[nc]  // in units of W/mK
+        );
+    }
+    kappa[0] = rtc_x[Nc - 1];
+    kappa[1] = rtc_y[Nc - 1];
+    kappa[2] = rtc_z[Nc - 1];
+
+    free(rtc_x); free(rtc_y); free(rtc_z);
+}
+
+// Streaming version of find_hac: each heat current data is correlated with 
+// the last Nc data (kept in a ring buffer) when it is added, such that the 
+// heat current need not be stored and the hac is available during the run. 
+// Only the first M data are used as time origins and the sums go in the 
+// same order, so the final hac is identical to that of find_hac.
+// For long correlation times (use_fft_for_hac), the correlator instead 
+// stores all the data and finds the sums by FFT when the hac is needed.
+struct Correlator
+{
+    int Nc;         // number of correlation data
+    int M;          // number of time origins
+    int num_data;   // number of data added so far
+    int use_fft;    // 1 if the data are stored and correlated by FFT
+    int length;     // length of h: Nc, or M + Nc with use_fft
+    double *h[3];   // the last Nc heat current data, or all of them
+    double *sum[3]; // sum of h(m) h(m + nc) over the time origins m
+};
+
+// length of h in a correlator (also for the checkpoints)
+int find_correlator_length(int Nc, int M, int use_fft)
+{
+    return use_fft ? M + Nc : Nc;
+}
+
+void allocate_correlator(int Nc, int M, int use_fft, Correlator &corr)
+{
+    corr.Nc = Nc;
+    corr.M = M;
+    corr.num_data = 0;
+    corr.use_fft = use_fft;
+    corr.length = find_correlator_length(Nc, M, use_fft);
+    for (int d = 0; d < 3; ++d)
+    {
+        corr.h[d] = (double*) malloc(sizeof(double) * corr.length);
+        corr.sum[d] = (double*) malloc(sizeof(double) * Nc);
+        for (int nc = 0; nc < Nc; nc++) { corr.sum[d][nc] = 0.0; }
+    }
+}
+
+void free_correlator(Correlator &corr)
+{
+    for (int d = 0; d < 3; ++d) { free(corr.h[d]); free(corr.sum[d]); }
+}
+
+void add_to_correlator(Correlator &corr, double hx, double hy, double hz)
+{
+    int n = corr.num_data++;
+    double h[3] = {hx, hy, hz};
+    if (corr.use_fft)
+    {
+        for (int d = 0; d < 3; ++d) { corr.h[d][n] = h[d]; }
+        return;
+    }
+    for (int d = 0; d < 3; ++d)
+    {
+        corr.h[d][n % corr.Nc] = h[d];
+        // time origins m with n - m < Nc and m < M, in contiguous pieces of
+        // the ring buffer
+        int m_begin = (n >= corr.Nc) ? n - corr.Nc + 1 : 0;
+        int m_end = (n < corr.M) ? n + 1 : corr.M;
+        for (int m = m_begin; m < m_end; )
+        {
+            int k = m % corr.Nc;
+            int len = corr.Nc - k;
+            if (len > m_end - m) { len = m_end - m; }
+            double *h_origin = corr.h[d] + k;
+            double *sum = corr.sum[d] + (n - m); // sum[-i] for origin m + i
+            for (int i = 0; i < len; ++i) { sum[-i] += h_origin[i] * h[d]; }
+            m += len;
+        }
+    }
+}
+
+// hac from the data added so far
+void find_correlator_hac(Correlator &corr, double *hac[3])
+{
+    if (corr.use_fft && corr.num_data > 0)
+    {
+        int M = (corr.num_data < corr.M) ? corr.num_data : corr.M;
+        find_correlation_fft(corr.Nc, M, corr.num_data, corr.h, corr.sum);
+    }
+    for (int d = 0; d < 3; ++d)
+    {
+        for (int nc = 0; nc < corr.Nc; nc++)
+        {
+            int count = corr.num_data - nc; // number of time origins used
+            if (count > corr.M) { count = corr.M; }
+            hac[d][nc] = (count > 0) ? corr.sum[d][nc] / count : 0.0;
+        }
+    }
+}
+
+// running kappa of HNEMD, kappa = <J> / (T V |Fe|), from the sums of the
+// heat current of each replica over count samples, averaged over the 
+// replicas (with the standard error; zero for one replica)
+void find_hnemd_kappa
+(
+    int num_replicas, double *heat_sum, int count, double T_0, double V, 
+    const double fe[3], double kappa[3], double kappa_error[3]
+)
+{
+    double fe_norm = sqrt(fe[0] * fe[0] + fe[1] * fe[1] + fe[2] * fe[2]);
+    double factor = KAPPA_UNIT_CONVERSION / (count * T_0 * V * fe_norm);
+    for (int d = 0; d < 3; ++d)
+    {
+        double sum = 0.0;
+        for (int r = 0; r < num_replicas; ++r) 
+        { 
+            sum += heat_sum[r * 3 + d] * factor; 
+        }
+        kappa[d] = sum / num_replicas;
+        double sum2 = 0.0; // the two-pass variance
+        for (int r = 0; r < num_replicas; ++r) 
+        { 
+            double deviation = heat_sum[r * 3 + d] * factor - kappa[d];
+            sum2 += deviation * deviation; 
+        }
+        kappa_error[d] = (num_replicas > 1) 
+                       ? sqrt(sum2 / ((num_replicas - 1.0) * num_replicas)) 
+                       : 0.0;
+    }
+}
+
+// hac from the data added so far and output with rtc (output_hac_kappa)
+void output_correlator
+(
+    Correlator &corr, double dt, double T_0, double V, FILE *fid, 
+    double kappa[3]
+)
+{
+    int Nc = corr.Nc;
+    double *hac[3];
+    for (int d = 0; d < 3; ++d)
+    {
+        hac[d] = (double*) malloc(sizeof(double) * Nc);
+    }
+    find_correlator_hac(corr, hac);
+    output_hac_kappa(fid, Nc, dt, T_0, V, hac[0], hac[1], hac[2], kappa);
+    for (int d = 0; d < 3; ++d) { free(hac[d]); }
+}
+
+// ensemble average and standard error of the hac and rtc of independent 
+// replicas (one correlator each); one line per correlation time with the 
+// time, the averages of hac and rtc, and then the standard errors of hac 
+// and rtc; kappa and kappa_error get the rtc at the largest correlation time
+void output_ensemble
+(
+    int num_replicas, Correlator *corr, double dt, double T_0, double V, 
+    FILE *fid, double kappa[3], double kappa_error[3]
+)
+{
+    int Nc = corr[0].Nc;
+    double dt_in_ps = dt * TIME_UNIT_CONVERSION / 1000.0; // ps
+    double factor = dt * 0.5 *  KAPPA_UNIT_CONVERSION / (K_B * T_0 * T_0 * V);
+
+    // hac_x, hac_y, hac_z, rtc_x, rtc_y, rtc_z of replica r start at 
+    // data + (r * 6 + k) * Nc for k = 0, ..., 5
+    double *data = (double*) malloc(sizeof(double) * num_replicas * 6 * Nc);
+    for (int r = 0; r < num_replicas; ++r)
+    {
+        double *hac[3], *rtc[3];
+        for (int d = 0; d < 3; ++d)
+        {
+            hac[d] = data + (r * 6 + d) * Nc;
+            rtc[d] = data + (r * 6 + d + 3) * Nc;
+            rtc[d][0] = 0.0;
+        }
+        find_correlator_hac(corr[r], hac);
+        find_rtc(Nc, factor, hac[0], hac[1], hac[2], rtc[0], rtc[1], rtc[2]);
+    }
+
+    for (int nc = 0; nc < Nc; nc++) 
+    {
+        double average[6], error[6];
+        for (int k = 0; k < 6; ++k)
+        {
+            double sum = 0.0;
+            for (int r = 0; r < num_replicas; ++r) 
+            { 
+                sum += data[(r * 6 + k) * Nc + nc]; 
+            }
+            average[k] = sum / num_replicas;
+            double sum2 = 0.0; // the two-pass variance
+            for (int r = 0; r < num_replicas; ++r) 
+            { 
+                double deviation = data[(r * 6 + k) * Nc + nc] - average[k];
+                sum2 += deviation * deviation; 
+            }
+            error[k] = (num_replicas > 1) 
+                     ? sqrt(sum2 / ((num_replicas - 1.0) * num_replicas)) : 0.0;
+        }
+        fprintf(fid, "%25.15e", nc * dt_in_ps);
+        for (int k = 0; k < 6; ++k) { fprintf(fid, "%25.15e", average[k]); }
+        for (int k = 0; k < 6; ++k) { fprintf(fid, "%25.15e", error[k]); }
+        fprintf(fid, "\n");
+        if (nc == Nc - 1)
+        {
+            for (int d = 0; d < 3; ++d)
+            {
+                kappa[d] = average[d + 3];
+                kappa_error[d] = error[d + 3];
+            }
+        }
+    }
+    free(data);
+}
+
+// time the force evaluation for 1, 2, 4, ... threads and check that the 
+// results are identical to those with one thread
+template <typename real_x, typename real_f>
+void strong_scaling
+(
+    int N, Neighbor &neighbor, int pbc[3], double box[3], 
+    Bond_Data<real_f> &bond, real_x *x, real_x *y, real_x *z, 
+    real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, real_f *fz, 
+    real_x *prop_atom, int use_simd, int num_repeats
+)
+{
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+    printf("Warning: compiled without OpenMP; only one thread is used.\n");
+#endif
+    real_f *f_ref = (real_f*) malloc(N * 3 * sizeof(real_f));
+    real_x prop[7], prop_ref[7];
+    double time_1 = 0.0;
+
+    FILE *fid = fopen("scaling.txt", "w");
+    printf("\nStrong scaling of the force evaluation (N = %d):\n", N);
+    printf("%10s%15s%12s%12s%12s\n", 
+        "threads", "time/step(ms)", "speedup", "efficiency", "identical");
+    for (int threads = 1; ; threads *= 2)
+    {
+        if (threads > max_threads) { threads = max_threads; }
+#ifdef _OPENMP
+        omp_set_num_threads(threads);
+#endif
+        find_force // warm up
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, prop, use_simd, PROP_ALL
+        );
+        double time_begin = get_time();
+        for (int r = 0; r < num_repeats; ++r)
+        {
+            find_force
+            (
+                N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, 
+                fx, fy, fz, prop_atom, prop, use_simd, PROP_ALL
+            );
+        }
+        double time_used = (get_time() - time_begin) / num_repeats;
+
+        int is_identical = 1;
+        if (threads == 1)
+        {
+            time_1 = time_used;
+            memcpy(f_ref, fx, N * sizeof(real_f));
+            memcpy(f_ref + N, fy, N * sizeof(real_f));
+            memcpy(f_ref + N * 2, fz, N * sizeof(real_f));
+            memcpy(prop_ref, prop, 7 * sizeof(real_x));
+        }
+        else
+        {
+            is_identical = memcmp(f_ref, fx, N * sizeof(real_f)) == 0
+                && memcmp(f_ref + N, fy, N * sizeof(real_f)) == 0
+                && memcmp(f_ref + N * 2, fz, N * sizeof(real_f)) == 0
+                && memcmp(prop_ref, prop, 7 * sizeof(real_x)) == 0;
+        }
+        double speedup = time_1 / time_used;
+        printf
+        (
+            "%10d%15.6f%12.3f%12.3f%12s\n", threads, time_used * 1000.0, 
+            speedup, speedup / threads, is_identical ? "yes" : "no"
+        );
+        fprintf
+        (
+            fid, "%d %g %g %g %d\n", threads, time_used * 1000.0, 
+            speedup, speedup / threads, is_identical
+        );
+        if (threads == max_threads) { break; }
+    }
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    fclose(fid);
+    free(f_ref);
+}
+
+// largest force error (relative to the largest force) and largest error in 
+// prop[0-6] (relative) with respect to the reference values
+template <typename real_x, typename real_f>
+void find_force_error
+(
+    int N, real_f *f_ref, real_f *fx, real_f *fy, real_f *fz, 
+    real_x prop_ref[7], real_x prop[7], double &f_error, double &prop_error
+)
+{
+    double f_max = 0.0;
+    f_error = 0.0;
+    for (int n = 0; n < N; ++n)
+    {
+        double f[3] = {fx[n], fy[n], fz[n]};
+        for (int d = 0; d < 3; ++d)
+        {
+            double f0 = f_ref[n + N * d];
+            if (fabs(f0) > f_max) { f_max = fabs(f0); }
+            if (fabs(f[d] - f0) > f_error) { f_error = fabs(f[d] - f0); }
+        }
+    }
+    f_error /= f_max;
+    prop_error = 0.0;
+    for (int k = 0; k < 7; ++k)
+    {
+        double e = fabs(prop[k] - prop_ref[k]) / fabs(prop_ref[k]);
+        if (e > prop_error) { prop_error = e; }
+    }
+}
+
+// compare the vectorized force evaluation with the scalar one for randomly
+// displaced particles and time both of them with one thread
+template <typename real_x, typename real_f>
+void check_simd
+(
+    int N, Neighbor &neighbor, int pbc[3], double box[3], 
+    Bond_Data<real_f> &bond, real_x *x, real_x *y, real_x *z, 
+    real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, real_f *fz, 
+    real_x *prop_atom, unsigned int seed, int num_repeats
+)
+{
+    // relative to the largest value
+    const double tolerance = (sizeof(real_f) == sizeof(float)) ? 1.0e-4 : 1.0e-12;
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+    omp_set_num_threads(1);
+#endif
+
+    // the displacements (< 0.1 A) are smaller than half of the skin
+    for (int n = 0; n < N; ++n)
+    {
+        double u[4];
+        find_random_uniform(seed, 0, n, 0, RNG_DISPLACEMENT, u);
+        x[n] += 0.05 * (-1.0 + u[0] * 2.0);
+        y[n] += 0.05 * (-1.0 + u[1] * 2.0);
+        z[n] += 0.05 * (-1.0 + u[2] * 2.0);
+    }
+
+    real_f *f_ref = (real_f*) malloc(N * 3 * sizeof(real_f));
+    real_x prop[7], prop_ref[7];
+    double time_used[2];
+    for (int use_simd = 0; use_simd < 2; ++use_simd)
+    {
+        double time_begin = get_time();
+        for (int r = 0; r < num_repeats; ++r)
+        {
+            find_force
+            (
+                N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, 
+                fx, fy, fz, prop_atom, prop, use_simd, PROP_ALL
+            );
+        }
+        time_used[use_simd] = (get_time() - time_begin) / num_repeats;
+        if (use_simd == 0)
+        {
+            memcpy(f_ref, fx, N * sizeof(real_f));
+            memcpy(f_ref + N, fy, N * sizeof(real_f));
+            memcpy(f_ref + N * 2, fz, N * sizeof(real_f));
+            memcpy(prop_ref, prop, 7 * sizeof(real_x));
+        }
+    }
+
+    double f_error, prop_error;
+    find_force_error
+    (N, f_ref, fx, fy, fz, prop_ref, prop, f_error, prop_error);
+
+    printf("\nVectorized (%s) vs scalar force evaluation (N = %d):\n", 
+        get_simd_name(), N);
+    printf("    time/step (scalar)     = %g ms\n", time_used[0] * 1000.0);
+    printf("    time/step (vectorized) = %g ms\n", time_used[1] * 1000.0);
+    printf("    speedup                = %g\n", time_used[0] / time_used[1]);
+    printf("    max force error        = %g (relative to max force)\n", f_error);
+    printf("    max error in prop[0-6] = %g (relative)\n", prop_error);
+    printf("    tolerance              = %g\n", tolerance);
+    printf("    %s\n", (f_error < tolerance) ? "PASSED" : "FAILED");
+
+#ifdef _OPENMP
+    omp_set_num_threads(max_threads);
+#endif
+    free(f_ref);
+}
+
+// compare the tabulated force evaluation with the analytic one for randomly
+// displaced particles (the positions are not changed) and time both of them
+template <typename real_x, typename real_f>
+void check_table
+(
+    int N, Neighbor &neighbor, int pbc[3], double box[3], 
+    Bond_Data<real_f> &bond, real_x *x, real_x *y, real_x *z, 
+    real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, real_f *fz, 
+    real_x *prop_atom, int use_simd, unsigned int seed, int num_repeats
+)
+{
+    // the displacements (< 0.1 A) are smaller than half of the skin
+    real_x *xyz = (real_x*) malloc(N * 3 * sizeof(real_x));
+    for (int n = 0; n < N; ++n)
+    {
+        double u[4];
+        find_random_uniform(seed, 0, n, 0, RNG_DISPLACEMENT, u);
+        xyz[n] = x[n] + 0.05 * (-1.0 + u[0] * 2.0);
+        xyz[n + N] = y[n] + 0.05 * (-1.0 + u[1] * 2.0);
+        xyz[n + N * 2] = z[n] + 0.05 * (-1.0 + u[2] * 2.0);
+    }
+
+    Tersoff_Table<real_f> *table = bond.table;
+    real_f *f_ref = (real_f*) malloc(N * 3 * sizeof(real_f));
+    real_x prop[7], prop_ref[7];
+    double time_used[2];
+    for (int use_table = 0; use_table < 2; ++use_table)
+    {
+        bond.table = use_table ? table : NULL;
+        double time_begin = get_time();
+        for (int r = 0; r < num_repeats; ++r)
+        {
+            find_force
+            (
+                N, neighbor, pbc, box, bond, xyz, xyz + N, xyz + N * 2, 
+                vx, vy, vz, fx, fy, fz, prop_atom, prop, use_simd, PROP_ALL
+            );
+        }
+        time_used[use_table] = (get_time() - time_begin) / num_repeats;
+        if (use_table == 0)
+        {
+            memcpy(f_ref, fx, N * sizeof(real_f));
+            memcpy(f_ref + N, fy, N * sizeof(real_f));
+            memcpy(f_ref + N * 2, fz, N * sizeof(real_f));
+            memcpy(prop_ref, prop, 7 * sizeof(real_x));
+        }
+    }
+    double f_error, prop_error;
+    find_force_error
+    (N, f_ref, fx, fy, fz, prop_ref, prop, f_error, prop_error);
+
+    printf("\nTabulated vs analytic force evaluation (%d intervals):\n", 
+        table->n);
+    printf("    time/step (analytic)   = %g ms\n", time_used[0] * 1000.0);
+    printf("    time/step (tabulated)  = %g ms\n", time_used[1] * 1000.0);
+    printf("    speedup                = %g\n", time_used[0] / time_used[1]);
+    printf("    max force error        = %g (relative to max force)\n", f_error);
+    printf("    max error in prop[0-6] = %g (relative)\n", prop_error);
+
+    free(xyz); free(f_ref);
+}
+
+/*
+    Asynchronous output (see note 19)
+    The MD loop (the only producer) copies each record into a ring buffer 
+    and a background thread (the only consumer) writes the records to 
+    their files, such that the MD loop never waits for the disk unless the
+    ring is full. head and tail count the bytes pushed and written so far;
+    each of them is only changed by one side, and the release/acquire pairs 
+    make the bytes of a record visible before its new head (and free before
+    the new tail), so no lock is needed.
+*/
+#define OUTPUT_THERMO 0 // thermo.txt or thermo.bin
+#define OUTPUT_TRAJ   1 // traj.bin
+#define OUTPUT_KAPPA  2 // kappa.txt (HNEMD)
+#define NUM_OUTPUTS   3
+#define OUTPUT_VERSION 1 // version of the binary files
+
+struct Output_Queue
+{
+    char *buffer;              // the ring
+    size_t capacity;           // its size in bytes
+    std::atomic<size_t> head;  // bytes pushed so far (by the MD loop)
+    std::atomic<size_t> tail;  // bytes written so far (by the writer)
+    std::atomic<int> done;     // no more records will be pushed
+    FILE *fid[NUM_OUTPUTS];    // the files (NULL if not used)
+    std::thread writer;        // the consumer thread
+    double time_waited;        // time the MD loop waited for room
+    size_t bytes_pushed;       // total size of the records
+    size_t file_size[NUM_OUTPUTS]; // bytes pushed to each file
+};
+
+struct Output_Record // precedes the data of each record in the ring
+{
+    int output;  // one of the outputs above
+    int size;    // number of bytes of data
+};
+
+// copy between the ring (at byte count pos, which may wrap) and memory
+void copy_to_ring(Output_Queue &queue, size_t pos, const void *data, size_t size)
+{
+    size_t begin = pos % queue.capacity;
+    size_t first = queue.capacity - begin;
+    if (first > size) { first = size; }
+    memcpy(queue.buffer + begin, data, first);
+    memcpy(queue.buffer, (const char*) data + first, size - first);
+}
+
+void copy_from_ring(Output_Queue &queue, size_t pos, void *data, size_t size)
+{
+    size_t begin = pos % queue.capacity;
+    size_t first = queue.capacity - begin;
+    if (first > size) { first = size; }
+    memcpy(data, queue.buffer + begin, first);
+    memcpy((char*) data + first, queue.buffer, size - first);
+}
+
+// the writer thread: write the records in the order they were pushed
+void write_output(Output_Queue *queue)
+{
+    size_t tail = queue->tail.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        size_t head = queue->head.load(std::memory_order_acquire);
+        if (tail == head)
+        {
+            if (queue->done.load(std::memory_order_acquire) && 
+                tail == queue->head.load(std::memory_order_acquire)) 
+            { 
+                break; 
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+        while (tail != head)
+        {
+            Output_Record record;
+            copy_from_ring(*queue, tail, &record, sizeof(record));
+            size_t begin = (tail + sizeof(record)) % queue->capacity;
+            size_t first = queue->capacity - begin;
+            if (first > (size_t) record.size) { first = record.size; }
+            FILE *fid = queue->fid[record.output];
+            fwrite(queue->buffer + begin, 1, first, fid);
+            fwrite(queue->buffer, 1, record.size - first, fid);
+            tail += sizeof(record) + record.size;
+            queue->tail.store(tail, std::memory_order_release);
+        }
+    }
+}
+
+void open_output_queue(size_t capacity, Output_Queue &queue)
+{
+    queue.buffer = (char*) malloc(capacity);
+    queue.capacity = capacity;
+    queue.head.store(0);
+    queue.tail.store(0);
+    queue.done.store(0);
+    for (int k = 0; k < NUM_OUTPUTS; ++k) { queue.fid[k] = NULL; }
+    queue.time_waited = 0.0;
+    queue.bytes_pushed = 0;
+    for (int k = 0; k < NUM_OUTPUTS; ++k) { queue.file_size[k] = 0; }
+    queue.writer = std::thread(write_output, &queue);
+}
+
+// copy a record into the ring; only waits if the ring is full
+void push_output(Output_Queue &queue, int output, const void *data, int size)
+{
+    Output_Record record = {output, size};
+    size_t need = sizeof(record) + size;
+    if (need > queue.capacity)
+    {
+        printf("Error: an output record is larger than the output queue.\n");
+        exit(1);
+    }
+    size_t head = queue.head.load(std::memory_order_relaxed);
+    if (queue.capacity - (head - queue.tail.load(std::memory_order_acquire)) 
+        < need)
+    {
+        double time_begin = get_time();
+        while (queue.capacity 
+            - (head - queue.tail.load(std::memory_order_acquire)) < need)
+        {
+            std::this_thread::yield();
+        }
+        queue.time_waited += get_time() - time_begin;
+    }
+    copy_to_ring(queue, head, &record, sizeof(record));
+    copy_to_ring(queue, head + sizeof(record), data, size);
+    queue.head.store(head + need, std::memory_order_release);
+    queue.bytes_pushed += need;
+    queue.file_size[output] += size;
+}
+
+// wait until everything pushed so far is in the files (for a checkpoint)
+void flush_output_queue(Output_Queue &queue)
+{
+    double time_begin = get_time();
+    while (queue.tail.load(std::memory_order_acquire) 
+        != queue.head.load(std::memory_order_relaxed))
+    {
+        std::this_thread::yield();
+    }
+    for (int k = 0; k < NUM_OUTPUTS; ++k) 
+    { 
+        if (queue.fid[k]) { fflush(queue.fid[k]); }
+    }
+    queue.time_waited += get_time() - time_begin;
+}
+
+// wait for the writer to finish and close the files
+void close_output_queue(Output_Queue &queue)
+{
+    queue.done.store(1, std::memory_order_release);
+    queue.writer.join();
+    for (int k = 0; k < NUM_OUTPUTS; ++k) 
+    { 
+        if (queue.fid[k]) { fclose(queue.fid[k]); }
+    }
+    free(queue.buffer);
+}
+
+/*
+    The binary files start with an 8-character magic string and the 
+    version, followed by
+    thermo.bin: num_replicas, and then one record of 6 + 3 * num_replicas 
+        doubles per sample: temperature (K), kinetic and potential energy 
+        (eV), pressure (GPa) as in thermo.txt, and the heat current of each
+        replica (natural units)
+    traj.bin: N, box[3] (A), and type[N], and then one record of 1 + 6 N 
+        doubles per frame: time (ps), x[N], y[N], z[N] (A), and vx[N], 
+        vy[N], vz[N] (A/fs), in the original order of the particles
+    The integers are 32-bit and everything is in the native byte order.
+*/
+const char thermo_magic[9] = "MDTHERMO";
+const char traj_magic[9] = "MDTRAJEC";
+
+// the header of a binary file (magic string, version, and the size bytes
+// of data) as a record
+void push_output_header
+(
+    Output_Queue &queue, int output, const char *magic, const void *data, 
+    int size
+)
+{
+    int version = OUTPUT_VERSION;
+    char *header = (char*) malloc(8 + sizeof(int) + size);
+    memcpy(header, magic, 8);
+    memcpy(header + 8, &version, sizeof(int));
+    memcpy(header + 8 + sizeof(int), data, size);
+    push_output(queue, output, header, 8 + sizeof(int) + size);
+    free(header);
+}
+
+// convert thermo.bin to thermo.txt (the text layout) and heat_current.txt,
+// or traj.bin to traj.xyz (extended XYZ with the type index)
+void convert_output(const char *filename)
+{
+    FILE *fid = fopen(filename, "rb");
+    if (fid == NULL)
+    {
+        printf("Error: cannot open %s.\n", filename);
+        exit(1);
+    }
+    char magic[8];
+    int version = 0;
+    if (fread(magic, 1, 8, fid) != 8 || fread(&version, sizeof(int), 1, fid) 
+        != 1 || version != OUTPUT_VERSION)
+    {
+        printf("Error: %s is not a binary output file of this version.\n", 
+            filename);
+        exit(1);
+    }
+    if (memcmp(magic, thermo_magic, 8) == 0)
+    {
+        int num_replicas = 0;
+        if (fread(&num_replicas, sizeof(int), 1, fid) != 1 || num_replicas < 1)
+        {
+            printf("Error: bad header in %s.\n", filename);
+            exit(1);
+        }
+        int size = 6 + 3 * num_replicas;
+        double *data = (double*) malloc(size * sizeof(double));
+        FILE *fid_thermo = fopen("thermo.txt", "w");
+        FILE *fid_heat = fopen("heat_current.txt", "w");
+        int count = 0;
+        while (fread(data, sizeof(double), size, fid) == (size_t) size)
+        {
+            fprintf
+            (
+                fid_thermo, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n", 
+                data[0], data[1], data[2], data[3], data[4], data[5]
+            );
+            for (int k = 6; k < size; ++k) 
+            { 
+                fprintf(fid_heat, "%25.15e", data[k]); 
+            }
+            fprintf(fid_heat, "\n");
+            count++;
+        }
+        fclose(fid_thermo); fclose(fid_heat); free(data);
+        printf
+        (
+            "Converted %d samples to thermo.txt and heat_current.txt.\n", 
+            count
+        );
+    }
+    else if (memcmp(magic, traj_magic, 8) == 0)
+    {
+        int N = 0;
+        double box[3];
+        if (fread(&N, sizeof(int), 1, fid) != 1 || N < 1 
+            || fread(box, sizeof(double), 3, fid) != 3)
+        {
+            printf("Error: bad header in %s.\n", filename);
+            exit(1);
+        }
+        int *type = (int*) malloc(N * sizeof(int));
+        double *data = (double*) malloc((1 + 6 * N) * sizeof(double));
+        if (fread(type, sizeof(int), N, fid) != (size_t) N)
+        {
+            printf("Error: bad header in %s.\n", filename);
+            exit(1);
+        }
+        FILE *fid_xyz = fopen("traj.xyz", "w");
+        int count = 0;
+        while (fread(data, sizeof(double), 1 + 6 * N, fid) 
+            == (size_t) (1 + 6 * N))
+        {
+            fprintf(fid_xyz, "%d\n", N);
+            fprintf
+            (
+                fid_xyz, "Lattice=\"%.10g 0 0 0 %.10g 0 0 0 %.10g\" "
+                "Properties=type:I:1:pos:R:3:vel:R:3 Time=%.10g\n", 
+                box[0], box[1], box[2], data[0]
+            );
+            double *r = data + 1;
+            for (int n = 0; n < N; ++n)
+            {
+                fprintf
+                (
+                    fid_xyz, "%d %.10f %.10f %.10f %.10e %.10e %.10e\n", 
+                    type[n], r[n], r[n + N], r[n + N * 2], r[n + N * 3], 
+                    r[n + N * 4], r[n + N * 5]
+                );
+            }
+            count++;
+        }
+        fclose(fid_xyz); free(type); free(data);
+        printf("Converted %d frames to traj.xyz.\n", count);
+    }
+    else
+    {
+        printf("Error: %s is not a binary output file.\n", filename);
+        exit(1);
+    }
+    fclose(fid);
+}
+
+// summary of one run used by the energy-drift report
+struct Run_Summary
+{
+    double drift;     // slope of the total energy (eV/atom/ps)
+    double deviation; // rms deviation of the total energy from the fit 
+                      // (eV/atom)
+    double time_used; // time used for production (s)
+};
+
+// online linear least-squares fit of the total energy against time (the
+// energy is shifted by its first value to avoid cancellation)
+struct Energy_Fit
+{
+    int n;
+    double e0, st, se, stt, ste, see;
+};
+
+void add_to_energy_fit(Energy_Fit &fit, double t, double e)
+{
+    if (fit.n == 0) { fit.e0 = e; }
+    e -= fit.e0;
+    fit.n++;
+    fit.st += t; fit.se += e;
+    fit.stt += t * t; fit.ste += t * e; fit.see += e * e;
+}
+
+// drift (eV/atom/ps for t in ps) and rms deviation from the fit (eV/atom)
+void find_energy_drift(Energy_Fit &fit, int N, Run_Summary &summary)
+{
+    double tt = fit.stt - fit.st * fit.st / fit.n;
+    double te = fit.ste - fit.st * fit.se / fit.n;
+    double ee = fit.see - fit.se * fit.se / fit.n;
+    double slope = te / tt;
+    double deviation = ee - slope * te; // sum of the squared residuals
+    if (deviation < 0.0) { deviation = 0.0; }
+    summary.drift = slope / N;
+    summary.deviation = sqrt(deviation / fit.n) / N;
+}
+
+/*
+    Block averaging (see note 22)
+    The error of the mean of correlated data is found as by Flyvbjerg and 
+    Petersen [J. Chem. Phys. 91, 461 (1989)]: the data are averaged in 
+    pairs again and again, and the naive error of the mean at level l 
+    (blocks of 2^l data) grows with l until the blocks are longer than the
+    correlation time. Each level keeps a running mean and variance 
+    (Welford) and a block waiting for its partner, such that the data are 
+    not stored and the error is available at any time.
+*/
+#define MAX_BLOCK_LEVELS 40
+#define MIN_BLOCKS       16 // blocks needed for a level to be trusted
+
+struct Block_Average
+{
+    long long count[MAX_BLOCK_LEVELS];   // number of blocks at each level
+    double mean[MAX_BLOCK_LEVELS];       // running mean of the blocks
+    double m2[MAX_BLOCK_LEVELS];         // sum of the squared deviations
+    double pending[MAX_BLOCK_LEVELS];    // a block waiting for its partner
+    int has_pending[MAX_BLOCK_LEVELS];
+};
+
+void reset_block_average(Block_Average &block)
+{
+    memset(&block, 0, sizeof(block));
+}
+
+void add_to_block_average(Block_Average &block, double x)
+{
+    for (int l = 0; l < MAX_BLOCK_LEVELS; ++l)
+    {
+        block.count[l]++;
+        double delta = x - block.mean[l];
+        block.mean[l] += delta / block.count[l];
+        block.m2[l] += delta * (x - block.mean[l]);
+        if (!block.has_pending[l])
+        {
+            block.pending[l] = x;
+            block.has_pending[l] = 1;
+            return;
+        }
+        x = 0.5 * (block.pending[l] + x); // a block of the next level
+        block.has_pending[l] = 0;
+    }
+}
+
+// error of the mean at the first plateau, where the next level is within 
+// the uncertainty of this one (is_plateau = 0 if there is none yet and the
+// largest error of the trusted levels is returned)
+double find_block_error(const Block_Average &block, int &is_plateau)
+{
+    double sigma[MAX_BLOCK_LEVELS];
+    int num_levels = 0;
+    while (num_levels < MAX_BLOCK_LEVELS 
+        && block.count[num_levels] >= MIN_BLOCKS)
+    {
+        long long n = block.count[num_levels];
+        sigma[num_levels] = sqrt(block.m2[num_levels] / (n * (n - 1.0)));
+        num_levels++;
+    }
+    is_plateau = 0;
+    double error = 0.0;
+    for (int l = 0; l < num_levels; ++l)
+    {
+        if (sigma[l] > error) { error = sigma[l]; }
+        if (l + 1 < num_levels)
+        {
+            // standard deviation of sigma[l] itself
+            double sigma_error = sigma[l] / sqrt(2.0 * (block.count[l] - 1));
+            if (sigma[l + 1] < sigma[l] + sigma_error)
+            {
+                is_plateau = 1;
+                return (sigma[l + 1] > sigma[l]) ? sigma[l + 1] : sigma[l];
+            }
+        }
+    }
+    return error;
+}
+
+// the state of the convergence checks of run_md; the equilibration stops 
+// when the drift of the potential energy between two check intervals is 
+// below drift_tol with 95% confidence, and the production stops when the 
+// relative error of kappa is below kappa_tol
+struct Convergence
+{
+    double drift_tol;          // eV/atom/ps (0: no early stop)
+    double kappa_tol;          // relative error of kappa (0: no early stop)
+    Block_Average interval;    // potential energy of the current interval
+    int has_previous;          // 1 if there is a previous interval
+    double previous_mean;      // its mean potential energy
+    double previous_error;     // and the error of the mean
+    Block_Average thermo[6];   // production: as in thermo.txt
+    Block_Average heat[3];     // heat current (averaged over the replicas)
+};
+
+// the check at the end of an interval of the equilibration (interval_time 
+// in ps): returns 1 if the drift of the potential energy per atom is below
+// drift_tol with 95% confidence (and the error is reliable, is_plateau); 
+// the decision is logged to fid
+int check_equilibration
+(
+    Convergence &convergence, int step, double interval_time, int N_replica,
+    FILE *fid
+)
+{
+    int is_plateau;
+    double mean = convergence.interval.mean[0];
+    double error = find_block_error(convergence.interval, is_plateau);
+    int is_done = 0;
+    if (convergence.has_previous)
+    {
+        double scale = 1.0 / (interval_time * N_replica);
+        double drift = (mean - convergence.previous_mean) * scale;
+        double drift_error = sqrt(error * error + convergence.previous_error 
+                           * convergence.previous_error) * scale;
+        is_done = is_plateau 
+                && (fabs(drift) + 2.0 * drift_error < convergence.drift_tol);
+        const char *format = "equilibration step %d: drift = %g +- %g "
+            "eV/atom/ps (tolerance %g)%s: %s\n";
+        const char *decision = is_done ? "stop" : "continue";
+        const char *note = is_plateau ? "" : ", no plateau";
+        printf
+        (
+            format, step, drift, drift_error, convergence.drift_tol, note, 
+            decision
+        );
+        fprintf
+        (
+            fid, format, step, drift, drift_error, convergence.drift_tol, 
+            note, decision
+        );
+        fflush(fid);
+    }
+    convergence.has_previous = 1;
+    convergence.previous_mean = mean;
+    convergence.previous_error = error;
+    reset_block_average(convergence.interval);
+    return is_done;
+}
+
+// the EMD check of kappa needs MIN_ORIGINS_PER_NC * Nc time origins at the 
+// largest correlation time and MIN_REPLICAS_EMD replicas for the error
+#define MIN_ORIGINS_PER_NC 4
+#define MIN_REPLICAS_EMD   4
+
+// the check of kappa in the production: returns 1 if the relative error of
+// kappa is below kappa_tol for all the directions d with is_checked[d] 
+// (and the error is reliable: a plateau of the block error for HNEMD, or 
+// enough time origins for EMD); the decision is logged to fid
+int check_production
+(
+    Convergence &convergence, int step, double kappa[3], 
+    double kappa_error[3], int is_checked[3], int is_reliable, FILE *fid
+)
+{
+    int is_done = is_reliable;
+    double error_max = 0.0; // the largest relative error
+    for (int d = 0; d < 3; ++d)
+    {
+        if (!is_checked[d]) { continue; }
+        double error = fabs(kappa_error[d] / kappa[d]);
+        if (!(error < convergence.kappa_tol)) { is_done = 0; }
+        if (!(error < error_max)) { error_max = error; }
+    }
+    const char *format = "production step %d: kappa = %g(%g) %g(%g) %g(%g) "
+        "W/mK, relative error %g (tolerance %g)%s: %s\n";
+    const char *decision = is_done ? "stop" : "continue";
+    const char *note = is_reliable ? "" : ", error not reliable yet";
+    printf
+    (
+        format, step, kappa[0], kappa_error[0], kappa[1], kappa_error[1], 
+        kappa[2], kappa_error[2], error_max, convergence.kappa_tol, note, 
+        decision
+    );
+    fprintf
+    (
+        fid, format, step, kappa[0], kappa_error[0], kappa[1], 
+        kappa_error[1], kappa[2], kappa_error[2], error_max, 
+        convergence.kappa_tol, note, decision
+    );
+    fflush(fid);
+    return is_done;
+}
+
+// block averages of the production stage, to stdout and fid
+void report_convergence(Convergence &convergence, FILE *fid)
+{
+    const char *names[9] = 
+    {
+        "temperature (K)", "kinetic energy (eV)", "potential energy (eV)", 
+        "pressure_x (GPa)", "pressure_y (GPa)", "pressure_z (GPa)", 
+        "heat current_x", "heat current_y", "heat current_z"
+    };
+    const char *title = "\nBlock averages of the production stage (mean, "
+        "error of the mean, number of samples; * for no plateau):\n";
+    printf("%s", title);
+    fprintf(fid, "%s", title);
+    for (int k = 0; k < 9; ++k)
+    {
+        Block_Average &block 
+            = (k < 6) ? convergence.thermo[k] : convergence.heat[k - 6];
+        int is_plateau;
+        double error = find_block_error(block, is_plateau);
+        const char *format = "%24s%25.15e%15.6e%10lld%s\n";
+        printf
+        (
+            format, names[k], block.mean[0], error, block.count[0], 
+            is_plateau ? "" : " *"
+        );
+        fprintf
+        (
+            fid, format, names[k], block.mean[0], error, block.count[0], 
+            is_plateau ? "" : " *"
+        );
+    }
+}
+
+// per-replica sums (in the order of n, as in accumulate_force) of the 
+// per-particle properties and of the kinetic energy; see scale_velocity
+template <typename real_x>
+void sum_over_replicas
+(
+    int N, int num_replicas, int *id, real_x *m, real_x *vx, real_x *vy, 
+    real_x *vz, real_x *prop_atom, real_x *prop, double *ke
+)
+{
+    int N_replica = N / num_replicas;
+    for (int r = 0; r < num_replicas; ++r)
+    {
+        ke[r] = 0.0;
+        for (int k = 0; k < 7; ++k) { prop[r * 7 + k] = 0.0; }
+    }
+    for (int n = 0; n < N; ++n)
+    {
+        int r = id[n] / N_replica;
+        ke[r] += m[n] * (vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n]);
+        for (int k = 0; k < 7; ++k) 
+        { 
+            prop[r * 7 + k] += prop_atom[n * 7 + k]; 
+        }
+    }
+    for (int r = 0; r < num_replicas; ++r) { ke[r] *= 0.5; }
+}
+
+/*
+    Checkpoints (see note 20)
+    A checkpoint holds the whole state of a run: a fixed header, and then 
+    the arrays of the particles (in the current order), the neighbor list, 
+    the sums of the correlators, the HNEMD heat current sums, and the 
+    state of the convergence checks, each padded to a multiple of 8 bytes 
+    such that the arrays are aligned when the file is mapped into memory.
+    The random numbers need no state besides the seed and the step (note 
+    18). A checkpoint is written to a temporary file which is then renamed,
+    so a run killed while writing leaves the previous checkpoint intact.
+*/
+#define CHECKPOINT_VERSION 5
+const char checkpoint_magic[9] = "MDCHECKP";
+
+struct Checkpoint_Header
+{
+    char magic[8];        // checkpoint_magic
+    int version;          // CHECKPOINT_VERSION
+    int real_x_size;      // sizeof(real_x)
+    int real_f_size;      // sizeof(real_f)
+    int N;                // number of particles
+    int num_replicas;     // number of replicas
+    int nx, ny;           // number of unit cells
+    int num_types;        // number of types of the potential
+    int table_size;       // number of table intervals (0: analytic)
+    uint64_t potential_hash; // find_potential_hash (0: built-in carbon)
+    int Ns, Nc, Nd;       // sampling and correlation parameters
+    unsigned int seed;    // seed of the random numbers
+    int use_binary;       // thermo.bin instead of thermo.txt
+    int stage;            // 0 for equilibration and 1 for production
+    int step;             // number of steps completed in the stage
+    int equilibration_steps; // steps of the equilibration (stage 1)
+    int count;            // number of samples so far
+    int num_updates;      // number of neighbor list updates so far
+    int num_bonds;        // length of NL and reverse
+    double box[3];        // box lengths
+    double fe[3];         // HNEMD driving force (zero for EMD)
+    Energy_Fit energy_fit; // fit of the total energy so far
+    int64_t output_size[NUM_OUTPUTS]; // bytes in the output files so far
+    int64_t report_size;  // bytes in convergence.txt so far
+    int64_t file_size;    // size of the whole checkpoint (in bytes)
+};
+
+// size of an array in the file
+size_t find_section_size(size_t size) { return (size + 7) / 8 * 8; }
+
+void write_section(FILE *fid, const void *data, size_t size)
+{
+    const char zero[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    fwrite(data, 1, size, fid);
+    fwrite(zero, 1, find_section_size(size) - size, fid);
+}
+
+// copy an array from the mapped file at offset and move past it
+void read_section
+(
+    const char *file, size_t file_size, size_t &offset, void *data, 
+    size_t size
+)
+{
+    if (offset + find_section_size(size) > file_size)
+    {
+        printf("Error: the checkpoint is truncated.\n");
+        exit(1);
+    }
+    memcpy(data, file + offset, size);
+    offset += find_section_size(size);
+}
+
+// size of the checkpoint described by the header
+template <typename real_x, typename real_f>
+int64_t find_checkpoint_size(Checkpoint_Header &header)
+{
+    int64_t N = header.N;
+    int Nc = header.Nc, Nd = header.Nd;
+    int length = find_correlator_length
+    (Nc, Nd - Nc, use_fft_for_run(Nd, Nc, header.fe));
+    return find_section_size(sizeof(Checkpoint_Header))
+        + 2 * find_section_size(N * sizeof(int))            // id and type
+        + 10 * find_section_size(N * sizeof(real_x))        // m, x, x0, v
+        + 3 * find_section_size(N * sizeof(real_f))         // f
+        + find_section_size(N * sizeof(int))                // NN
+        + 2 * find_section_size(header.num_bonds * sizeof(int)) // NL, reverse
+        + header.num_replicas * 3                           // correlators
+        * (find_section_size(length * sizeof(double)) 
+        + find_section_size(Nc * sizeof(double)))
+        + find_section_size(header.num_replicas * 3 * sizeof(double)) // J
+        + find_section_size(sizeof(Convergence));
+}
+
+// write the state to filename (atomically)
+template <typename real_x, typename real_f>
+void write_checkpoint
+(
+    const char *filename, Checkpoint_Header &header, Neighbor &neighbor, 
+    Correlator *corr, double *heat_sum, Convergence &convergence, 
+    int *id, int *type, real_x *m, 
+    real_x *x, real_x *y, real_x *z, real_x *x0, real_x *y0, real_x *z0, 
+    real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, real_f *fz
+)
+{
+    int N = header.N;
+    memcpy(header.magic, checkpoint_magic, 8);
+    header.version = CHECKPOINT_VERSION;
+    header.real_x_size = sizeof(real_x);
+    header.real_f_size = sizeof(real_f);
+    header.num_bonds = neighbor.NO[N];
+    header.file_size = find_checkpoint_size<real_x, real_f>(header);
+
+    char temp_name[1024];
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+    FILE *fid = fopen(temp_name, "wb");
+    if (fid == NULL)
+    {
+        printf("Error: cannot open %s.\n", temp_name);
+        exit(1);
+    }
+    write_section(fid, &header, sizeof(header));
+    write_section(fid, id, N * sizeof(int));
+    write_section(fid, type, N * sizeof(int));
+    real_x *arrays_x[10] = {m, x, y, z, x0, y0, z0, vx, vy, vz};
+    for (int k = 0; k < 10; ++k) 
+    { 
+        write_section(fid, arrays_x[k], N * sizeof(real_x)); 
+    }
+    real_f *arrays_f[3] = {fx, fy, fz};
+    for (int k = 0; k < 3; ++k) 
+    { 
+        write_section(fid, arrays_f[k], N * sizeof(real_f)); 
+    }
+    write_section(fid, neighbor.NN, N * sizeof(int));
+    write_section(fid, neighbor.NL, header.num_bonds * sizeof(int));
+    write_section(fid, neighbor.reverse, header.num_bonds * sizeof(int));
+    for (int r = 0; r < header.num_replicas; ++r)
+    {
+        for (int d = 0; d < 3; ++d)
+        {
+            size_t h_size = corr[r].length * sizeof(double);
+            write_section(fid, corr[r].h[d], h_size);
+            write_section(fid, corr[r].sum[d], header.Nc * sizeof(double));
+        }
+    }
+    write_section(fid, heat_sum, header.num_replicas * 3 * sizeof(double));
+    write_section(fid, &convergence, sizeof(Convergence));
+    int is_ok = (fflush(fid) == 0 && ftell(fid) == header.file_size);
+#ifdef __linux__
+    is_ok = is_ok && (fsync(fileno(fid)) == 0); // on disk before the rename
+#endif
+    is_ok = (fclose(fid) == 0) && is_ok;
+#ifdef _WIN32
+    remove(filename); // rename does not replace a file here
+#endif
+    if (!is_ok || rename(temp_name, filename) != 0)
+    {
+        printf("Error: cannot write the checkpoint %s.\n", filename);
+        exit(1);
+    }
+}
+
+// map a file into memory (or read it where mmap is not available)
+const char *map_file(const char *filename, size_t &size)
+{
+    const char *data = NULL;
+#ifdef __linux__
+    int fd = open(filename, O_RDONLY);
+    struct stat file_stat;
+    if (fd >= 0 && fstat(fd, &file_stat) == 0 && file_stat.st_size > 0)
+    {
+        size = file_stat.st_size;
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) { data = (const char*) map; }
+    }
+    if (fd >= 0) { close(fd); }
+#else
+    FILE *fid = fopen(filename, "rb");
+    if (fid && fseek(fid, 0, SEEK_END) == 0 && ftell(fid) > 0)
+    {
+        size = ftell(fid);
+        char *buffer = (char*) malloc(size);
+        rewind(fid);
+        if (fread(buffer, 1, size, fid) == size) { data = buffer; }
+        else { free(buffer); }
+    }
+    if (fid) { fclose(fid); }
+#endif
+    if (data == NULL)
+    {
+        printf("Error: cannot read %s.\n", filename);
+        exit(1);
+    }
+    return data;
+}
+
+void unmap_file(const char *data, size_t size)
+{
+#ifdef __linux__
+    munmap((void*) data, size);
+#else
+    free((void*) data);
+#endif
+}
+
+// check a checkpoint against the setup of this run (in header) and load 
+// it; the rest of the header is returned in header
+template <typename real_x, typename real_f>
+void load_checkpoint
+(
+    const char *filename, Checkpoint_Header &header, Neighbor &neighbor, 
+    Correlator *corr, double *heat_sum, Convergence &convergence, 
+    int *id, int *type, real_x *m, 
+    real_x *x, real_x *y, real_x *z, real_x *x0, real_x *y0, real_x *z0, 
+    real_x *vx, real_x *vy, real_x *vz, real_f *fx, real_f *fy, real_f *fz
+)
+{
+    size_t file_size = 0;
+    const char *file = map_file(filename, file_size);
+    Checkpoint_Header saved;
+    if (file_size < sizeof(saved))
+    {
+        printf("Error: %s is not a checkpoint.\n", filename);
+        exit(1);
+    }
+    memcpy(&saved, file, sizeof(saved));
+    if (memcmp(saved.magic, checkpoint_magic, 8) != 0 
+        || saved.version != CHECKPOINT_VERSION)
+    {
+        printf("Error: %s is not a checkpoint of this version.\n", filename);
+        exit(1);
+    }
+    if (saved.real_x_size != (int) sizeof(real_x) 
+        || saved.real_f_size != (int) sizeof(real_f))
+    {
+        printf("Error: %s is for another precision.\n", filename);
+        exit(1);
+    }
+    if (saved.N != header.N || saved.num_replicas != header.num_replicas
+        || saved.nx != header.nx || saved.ny != header.ny 
+        || saved.num_types != header.num_types 
+        || saved.table_size != header.table_size
+        || saved.potential_hash != header.potential_hash
+        || saved.Ns != header.Ns 
+        || saved.Nc != header.Nc || saved.Nd != header.Nd 
+        || saved.use_binary != header.use_binary
+        || memcmp(saved.fe, header.fe, sizeof(saved.fe)) != 0)
+    {
+        printf
+        (
+            "Error: %s is for another system or other options (cells, "
+            "replicas, potential, table, binary, or hnemd).\n", filename
+        );
+        exit(1);
+    }
+    if (saved.file_size != (int64_t) file_size 
+        || saved.file_size != find_checkpoint_size<real_x, real_f>(saved))
+    {
+        printf("Error: the checkpoint %s is truncated.\n", filename);
+        exit(1);
+    }
+
+    int N = saved.N;
+    size_t offset = find_section_size(sizeof(saved));
+    read_section(file, file_size, offset, id, N * sizeof(int));
+    read_section(file, file_size, offset, type, N * sizeof(int));
+    real_x *arrays_x[10] = {m, x, y, z, x0, y0, z0, vx, vy, vz};
+    for (int k = 0; k < 10; ++k) 
+    { 
+        read_section(file, file_size, offset, arrays_x[k], N * sizeof(real_x)); 
+    }
+    real_f *arrays_f[3] = {fx, fy, fz};
+    for (int k = 0; k < 3; ++k) 
+    { 
+        read_section(file, file_size, offset, arrays_f[k], N * sizeof(real_f)); 
+    }
+    read_section(file, file_size, offset, neighbor.NN, N * sizeof(int));
+    find_neighbor_offset(N, neighbor); // room for the bonds
+    if (neighbor.NO[N] != saved.num_bonds)
+    {
+        printf("Error: bad neighbor list in %s.\n", filename);
+        exit(1);
+    }
+    size_t bonds_size = saved.num_bonds * sizeof(int);
+    read_section(file, file_size, offset, neighbor.NL, bonds_size);
+    read_section(file, file_size, offset, neighbor.reverse, bonds_size);
+    for (int r = 0; r < saved.num_replicas; ++r)
+    {
+        corr[r].num_data = saved.count;
+        for (int d = 0; d < 3; ++d)
+        {
+            size_t size = saved.Nc * sizeof(double);
+            size_t h_size = corr[r].length * sizeof(double);
+            read_section(file, file_size, offset, corr[r].h[d], h_size);
+            read_section(file, file_size, offset, corr[r].sum[d], size);
+        }
+    }
+    read_section
+    (
+        file, file_size, offset, heat_sum, 
+        saved.num_replicas * 3 * sizeof(double)
+    );
+    read_section
+    (file, file_size, offset, &convergence, sizeof(Convergence));
+    unmap_file(file, file_size);
+    header = saved;
+}
+
+// reopen an output file of a restarted run at its size in the checkpoint, 
+// dropping what was written after the checkpoint
+FILE *reopen_output(const char *filename, int64_t size)
+{
+#ifdef __linux__
+    if (truncate(filename, size) != 0)
+    {
+        printf("Error: cannot truncate %s.\n", filename);
+        exit(1);
+    }
+#endif
+    FILE *fid = fopen(filename, "ab");
+    if (fid == NULL || fseek(fid, 0, SEEK_END) != 0 || ftell(fid) != size)
+    {
+        printf("Error: %s does not match the checkpoint.\n", filename);
+        exit(1);
+    }
+    return fid;
+}
+
+// bytes written to the convergence report so far (0 without a report), 
+// flushed such that a restart can cut the report back to them
+int64_t find_report_size(FILE *fid)
+{
+    if (fid == NULL) { return 0; }
+    fflush(fid);
+    return ftell(fid);
+}
+
+// the tasks of run_md
+#define TASK_MD      0 // MD, with outputs in thermo.txt and hac.txt
+#define TASK_SCALING 1 // strong-scaling report of the force evaluation
+#define TASK_SIMD    2 // vectorized vs scalar force evaluation
+#define TASK_DRIFT   3 // MD without outputs, for the energy-drift report
+#define TASK_HAC     4 // FFT vs direct hac (no MD)
+
+// options from the command line
+struct Run_Options
+{
+    int precision;    // PRECISION_DOUBLE, PRECISION_FLOAT, or PRECISION_MIXED
+    int task;         // one of the tasks above
+    unsigned int seed; // seed of the random numbers
+    int table_size;   // number of table intervals (0: analytic functions)
+    int use_counters; // 1 for hardware counters in the profile
+    const char *potential_file; // GPUMD Tersoff file (NULL: built-in carbon)
+    int sort_interval; // steps between the sorts of the particles (0: none)
+    int nx, ny;        // number of unit cells in the x and y directions
+    int num_replicas;  // number of independent replicas (see note 17)
+    int use_binary;    // 1 for thermo.bin instead of thermo.txt (note 19)
+    int dump_interval; // steps between trajectory frames (0: none)
+    int checkpoint_interval;  // steps between checkpoints (0: none)
+    const char *restart_file; // checkpoint to start from (NULL: none)
+    double fe[3];      // HNEMD driving force in 1/A (zero: EMD; note 21)
+    double drift_tol;  // eV/atom/ps for an early end of the equilibration
+    double kappa_tol;  // relative error of kappa for an early end (note 22)
+};
+
+// the whole simulation for one precision mode
+template <typename real_x, typename real_f>
+void run_md(const Run_Options &options, Run_Summary &summary)
+{
+    int task = options.task;
+    int table_size = options.table_size;
+    int sort_interval = options.sort_interval;
+    int num_replicas = options.num_replicas;
+    int nx = options.nx; // number of unit cells in the x-direction
+    int ny = options.ny; // number of unit cells in the y-direction
+    int nz = 1;  // number of unit cells in the z-direction
+    int n0 = 4;  // number of particles in the unit cell
+    int N_replica = n0 * nx * ny * nz; // number of particles in a replica
+    int N = N_replica * num_replicas;  // total number of particles
+    int Ne = 10000;   // number of steps in the equilibration stage
+    int Np = 10000;   // number of steps in the production stage
+    int Ns = 10;      // sampling interval
+    int Nd = Np / Ns; // number of heat current data
+    int Nc = Nd / 10; // number of correlation data (a good choice)
+    int pbc[3] = {1, 1, 0}; // 1 for periodic boundary; 0 for free boundary
+
+    double T_0 = 300.0;           // temperature prescribed
+    double ax = 1.438 * sqrt(3.0); // lattice constant in the x direction
+    double ay = 1.438 * 3.0;       // lattice constant in the y direction
+    double az = 3.35;             // Just a convention
+    double box[3];
+    box[0] = ax * nx;             // box length in the x direction
+    box[1] = ay * ny;             // box length in the y direction
+    box[2] = az * nz;             // box length in the z direction
+    double volume = box[0] * box[1] * box[2]; // volume of the system
+    double cutoff = 2.1;          // cutoff distance of the potential
+    double skin = 0.3;            // skin distance for neighbor list
+    double time_step = 1.0 / TIME_UNIT_CONVERSION; // time step (1 fs here)
+    int use_simd = 1;             // 1 for the vectorized force evaluation
+    Tersoff_Potential potential;  // parameters from a file (optional)
+    int num_types = 1;
+    if (options.potential_file)
+    {
+        load_potential(options.potential_file, potential);
+        num_types = potential.num_types;
+        cutoff = potential.rc;
+        if (!potential.is_carbon) { use_simd = 0; }
+        if (!potential.is_carbon && (table_size > 0 || task == TASK_SIMD))
+        {
+            printf("Error: tables and vectorized kernels are only available"
+                " for the built-in carbon potential.\n");
+            exit(1);
+        }
+    }
+
+    // the replicas are stacked along the free z direction, far enough apart
+    // not to interact, and make up one system for the force evaluation
+    double replica_distance = az * nz + 4.0 * (cutoff + skin);
+    if (num_replicas > 1) 
+    { 
+        if (pbc[2] == 1)
+        {
+            printf("Error: the replicas need a free z direction.\n");
+            exit(1);
+        }
+        box[2] = replica_distance * num_replicas; 
+        printf
+        (
+            "%d replicas with %d particles each.\n", num_replicas, N_replica
+        );
+    }
+    
+    // neighbor list
+    Neighbor neighbor;
+    allocate_neighbor(N, neighbor);
+    real_x *x0 = (real_x*) malloc(N * sizeof(real_x)); // positions at the 
+    real_x *y0 = (real_x*) malloc(N * sizeof(real_x)); // last update of the 
+    real_x *z0 = (real_x*) malloc(N * sizeof(real_x)); // neighbor list
+
+    // major data for the particles
+    int *id    = (int*) malloc(N * sizeof(int));       // original index
+    int *type  = (int*) malloc(N * sizeof(int));       // type
+    real_x *m  = (real_x*) malloc(N * sizeof(real_x)); // mass
+    real_x *x  = (real_x*) malloc(N * sizeof(real_x)); // position
+    real_x *y  = (real_x*) malloc(N * sizeof(real_x));
+    real_x *z  = (real_x*) malloc(N * sizeof(real_x));
+    real_x *vx = (real_x*) malloc(N * sizeof(real_x)); // velocity
+    real_x *vy = (real_x*) malloc(N * sizeof(real_x));
+    real_x *vz = (real_x*) malloc(N * sizeof(real_x));
+    real_f *fx = (real_f*) malloc(N * sizeof(real_f)); // force
+    real_f *fy = (real_f*) malloc(N * sizeof(real_f));
+    real_f *fz = (real_f*) malloc(N * sizeof(real_f));
+    real_x *prop_atom = (real_x*) malloc(N * 7 * sizeof(real_x)); // per atom
+    Bond_Data<real_f> bond; // geometry and radial functions of the bonds
+    allocate_bond_data(bond);
+    Tersoff_Table<real_f> table; // tabulated Tersoff functions (optional)
+    if (table_size > 0) { allocate_table(table_size, table); }
+    Correlator *corr = (Correlator*) malloc(num_replicas * sizeof(Correlator));
+    int use_fft = use_fft_for_run(Nd, Nc, options.fe); // see note 12
+    for (int r = 0; r < num_replicas; ++r) // heat current correlators
+    {
+        allocate_correlator(Nc, Nd - Nc, use_fft, corr[r]);
+    }
+    if (use_fft && task == TASK_MD)
+    {
+        printf("The hac is found by FFT of the stored heat current.\n");
+    }
+    real_x *prop_replica = (real_x*) malloc(num_replicas * 7 * sizeof(real_x));
+    double *ke_replica = (double*) malloc(num_replicas * sizeof(double));
+    real_x *scale_factor = (real_x*) malloc(num_replicas * sizeof(real_x));
+    Energy_Fit energy_fit = {0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+
+    // initialize type, mass, position, and velocity; replica r has the 
+    // particles r * N_replica <= n < (r + 1) * N_replica (id[n] later) and
+    // its own random numbers
+    for (int n = 0; n < N; ++n) { id[n] = n; }
+    for (int r = 0; r < num_replicas; ++r)
+    {
+        int n_begin = r * N_replica;
+        initialize_type(nx, ny, nz, num_types, type + n_begin);
+        for (int n = n_begin; n < n_begin + N_replica; ++n) 
+        { 
+            // mass for carbon atom without a file
+            m[n] = options.potential_file ? potential.mass[type[n]] : 12.0;
+        }
+        initialize_position
+        (nx, ny, nz, ax, ay, az, x + n_begin, y + n_begin, z + n_begin);
+        for (int n = n_begin; n < n_begin + N_replica; ++n) 
+        { 
+            z[n] += r * replica_distance; 
+        }
+        initialize_velocity
+        (
+            N_replica, T_0, options.seed, r, m + n_begin, vx + n_begin, 
+            vy + n_begin, vz + n_begin
+        );
+    }
+    if (options.potential_file && !potential.is_carbon)
+    {
+        bond.potential = &potential;
+        bond.type = type;
+    }
+
+    // initialize neighbor list and force
+    int num_updates = update_neighbor
+    (
+        N, neighbor, pbc, box, x, y, z, x0, y0, z0, cutoff, skin, 1
+    );
+    real_x prop[7]; // potential, virial, and heat current
+    find_force
+    (
+        N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+        prop_atom, prop, use_simd, PROP_ALL
+    );
+    if (use_simd) { printf("Vectorized force evaluation: %s\n", get_simd_name()); }
+    if (table_size > 0)
+    {
+        bond.table = &table;
+        check_table
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, use_simd, options.seed, 100
+        );
+        find_force // back to the current positions
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, prop, use_simd, PROP_ALL
+        );
+    }
+
+    if (task == TASK_SIMD)
+    {
+        check_simd
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, options.seed, 100
+        );
+    }
+    if (task == TASK_SCALING)
+    {
+        strong_scaling
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, use_simd, 100
+        );
+    }
+    if (task == TASK_SIMD || task == TASK_SCALING) { Ne = Np = 0; } // no MD
+
+    // hac and rtc are written to hac_partial.txt (overwritten) at each 
+    // tenth of the production stage, such that a run can be monitored
+    double dt_in_ps = time_step * Ns * TIME_UNIT_CONVERSION / 1000.0;
+    double kappa[3], kappa_error[3]; // the error is for the replicas
+
+    // HNEMD (see note 21): the production stage is driven by the force 
+    // options.fe and thermostatted, and kappa is found from the sums of the
+    // heat current of each replica
+    const double *fe = options.fe;
+    int use_hnemd = (fe[0] != 0.0 || fe[1] != 0.0 || fe[2] != 0.0);
+    double *heat_sum = (double*) malloc(num_replicas * 3 * sizeof(double));
+    for (int k = 0; k < num_replicas * 3; ++k) { heat_sum[k] = 0.0; }
+
+    // the progress of the run, saved in the checkpoints (see note 20)
+    int checkpoint_interval = options.checkpoint_interval;
+    Checkpoint_Header checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.N = N;
+    checkpoint.num_replicas = num_replicas;
+    checkpoint.nx = nx;
+    checkpoint.ny = ny;
+    checkpoint.num_types = num_types;
+    checkpoint.table_size = table_size;
+    checkpoint.potential_hash = options.potential_file 
+        ? find_potential_hash(potential) : 0;
+    checkpoint.Ns = Ns;
+    checkpoint.Nc = Nc;
+    checkpoint.Nd = Nd;
+    checkpoint.seed = options.seed;
+    checkpoint.use_binary = options.use_binary;
+    for (int d = 0; d < 3; ++d) { checkpoint.box[d] = box[d]; }
+    for (int d = 0; d < 3; ++d) { checkpoint.fe[d] = options.fe[d]; }
+    int step_begin[2] = {0, 0}; // first steps of the two stages
+    int step_end[2] = {Ne, Np}; // earlier if converged (see note 22)
+    int count = 0; // number of samples
+    Convergence convergence;
+    memset(&convergence, 0, sizeof(convergence));
+    int is_resumed = 0; // 1 if the production stage is continued
+    if (options.restart_file)
+    {
+        load_checkpoint
+        (
+            options.restart_file, checkpoint, neighbor, corr, heat_sum, 
+            convergence, id, type, m, x, y, z, x0, y0, z0, vx, vy, vz, 
+            fx, fy, fz
+        );
+        num_updates = checkpoint.num_updates;
+        energy_fit = checkpoint.energy_fit;
+        convergence.drift_tol = 0.0; // from this run
+        convergence.kappa_tol = 0.0;
+        count = checkpoint.count;
+        step_begin[0] = (checkpoint.stage == 0) 
+                      ? checkpoint.step : checkpoint.equilibration_steps;
+        if (checkpoint.stage == 1) { step_end[0] = step_begin[0]; }
+        step_begin[1] = (checkpoint.stage == 0) ? 0 : checkpoint.step;
+        is_resumed = (checkpoint.stage == 1 && checkpoint.step > 0);
+        printf
+        (
+            "Restarted from %s after %d %s steps.\n", options.restart_file,
+            checkpoint.step, checkpoint.stage ? "production" : "equilibration"
+        );
+    }
+
+    // the convergence checks and the decisions (see note 22)
+    convergence.drift_tol = options.drift_tol;
+    convergence.kappa_tol = options.kappa_tol;
+    double interval_time = (Ne / 10) * time_step * TIME_UNIT_CONVERSION 
+                         / 1000.0; // ps between two checks of the drift
+    int is_checked[3]; // directions of kappa in the check
+    for (int d = 0; d < 3; ++d) 
+    { 
+        is_checked[d] = use_hnemd ? (fe[d] != 0.0) : pbc[d]; 
+    }
+    FILE *fid_report = NULL; // convergence.txt, only with a tolerance
+    if (task == TASK_MD 
+        && (convergence.drift_tol > 0.0 || convergence.kappa_tol > 0.0))
+    {
+        if (options.restart_file && checkpoint.report_size > 0)
+        {
+            // continued as if uninterrupted (the tolerances of this run 
+            // are in the decisions)
+            fid_report 
+                = reopen_output("convergence.txt", checkpoint.report_size);
+        }
+        else
+        {
+            fid_report = fopen("convergence.txt", "w");
+            fprintf
+            (
+                fid_report, "drift_tol = %g eV/atom/ps, kappa_tol = %g\n", 
+                convergence.drift_tol, convergence.kappa_tol
+            );
+        }
+    }
+
+    // the thermodynamic properties (and the trajectory) of the production
+    // stage are written by a background thread
+    int use_output = (task == TASK_MD);
+    int use_binary = options.use_binary;
+    int dump_interval = options.dump_interval;
+    int thermo_size = 6 + 3 * num_replicas; // doubles per binary sample
+    double *thermo_record = (double*) malloc(thermo_size * sizeof(double));
+    double *frame = NULL; // time and positions and velocities
+    Output_Queue output;
+    if (use_output)
+    {
+        size_t frame_size = (dump_interval > 0) 
+                          ? (1 + 6 * (size_t) N) * sizeof(double) : 0;
+        size_t capacity = 64 << 20; // bytes, at least 4 frames
+        if (capacity < 4 * (frame_size + 64)) 
+        { 
+            capacity = 4 * (frame_size + 64); 
+        }
+        open_output_queue(capacity, output);
+        const char *thermo_file = use_binary ? "thermo.bin" : "thermo.txt";
+        if (is_resumed)
+        {
+            output.file_size[OUTPUT_THERMO] 
+                = checkpoint.output_size[OUTPUT_THERMO];
+            output.fid[OUTPUT_THERMO] 
+                = reopen_output(thermo_file, output.file_size[OUTPUT_THERMO]);
+        }
+        else
+        {
+            output.fid[OUTPUT_THERMO] = fopen(thermo_file, "wb");
+        }
+        if (use_binary && !is_resumed)
+        {
+            push_output_header
+            (
+                output, OUTPUT_THERMO, thermo_magic, &num_replicas, 
+                sizeof(int)
+            );
+        }
+        if (use_hnemd && is_resumed)
+        {
+            output.file_size[OUTPUT_KAPPA] 
+                = checkpoint.output_size[OUTPUT_KAPPA];
+            output.fid[OUTPUT_KAPPA] 
+                = reopen_output("kappa.txt", output.file_size[OUTPUT_KAPPA]);
+        }
+        else if (use_hnemd)
+        {
+            output.fid[OUTPUT_KAPPA] = fopen("kappa.txt", "wb");
+        }
+        if (dump_interval > 0)
+        {
+            frame = (double*) malloc(frame_size);
+        }
+        if (dump_interval > 0 && is_resumed 
+            && checkpoint.output_size[OUTPUT_TRAJ] > 0)
+        {
+            output.file_size[OUTPUT_TRAJ] = checkpoint.output_size[OUTPUT_TRAJ];
+            output.fid[OUTPUT_TRAJ] 
+                = reopen_output("traj.bin", output.file_size[OUTPUT_TRAJ]);
+        }
+        else if (dump_interval > 0)
+        {
+            output.fid[OUTPUT_TRAJ] = fopen("traj.bin", "wb");
+            // N, box, and the types in the original order
+            int header_size = sizeof(int) + 3 * sizeof(double) 
+                            + N * sizeof(int);
+            char *header = (char*) malloc(header_size);
+            int *type_original = (int*) (header + sizeof(int) 
+                               + 3 * sizeof(double));
+            memcpy(header, &N, sizeof(int));
+            memcpy(header + sizeof(int), box, 3 * sizeof(double));
+            for (int n = 0; n < N; ++n) { type_original[id[n]] = type[n]; }
+            push_output_header
+            (output, OUTPUT_TRAJ, traj_magic, header, header_size);
+            free(header);
+        }
+    }
+    double time_begin;
+    double time_used;
+    int use_md = (Ne + Np > 0); // no MD stages for the scaling and simd tasks
+
+    // equilibration
+    if (use_md) 
+    { 
+        start_profiling(options.use_counters); 
+        printf("\nEquilibration started:\n");
+    }
+    time_begin = get_time();
+    for (int step = step_begin[0]; step < step_end[0]; ++step)
+    {
+        phase_begin();
+        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        phase_end(PHASE_INTEGRATE);
+        phase_begin();
+        num_updates += update_neighbor
+        (
+            N, neighbor, pbc, box, x, y, z, x0, y0, z0, cutoff, skin, 0
+        );
+        phase_end(PHASE_NEIGHBOR);
+        if (sort_interval > 0 && step % sort_interval == 0)
+        {
+            phase_begin();
+            sort_particles
+            (
+                N, box, neighbor, id, type, m, x, y, z, x0, y0, z0, 
+                vx, vy, vz, fx, fy, fz
+            );
+            phase_end(PHASE_SORT);
+        }
+        // no properties are needed here, unless the drift is checked
+        int is_sampled = (convergence.drift_tol > 0.0 && 0 == step % Ns);
+        find_force
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, prop, use_simd, is_sampled ? PROP_ALL : PROP_NONE
+        );
+        phase_begin();
+        integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
+        phase_end(PHASE_INTEGRATE);
+        phase_begin();
+        // control temperature
+        scale_velocity(N, num_replicas, id, T_0, m, vx, vy, vz, scale_factor);
+        phase_end(PHASE_THERMOSTAT);
+        if (is_sampled)
+        {
+            phase_begin();
+            sum_over_replicas
+            (
+                N, num_replicas, id, m, vx, vy, vz, prop_atom, prop_replica, 
+                ke_replica
+            );
+            double pe = 0.0; // averaged over the replicas
+            for (int r = 0; r < num_replicas; ++r) 
+            { 
+                pe += prop_replica[r * 7]; 
+            }
+            add_to_block_average(convergence.interval, pe / num_replicas);
+            phase_end(PHASE_SAMPLING);
+        }
+        if ((step+1) % (Ne/10) == 0)
+        {
+            printf("\t%d steps completed.\n", step + 1);
+            if (convergence.drift_tol > 0.0 && check_equilibration
+                (convergence, step + 1, interval_time, N_replica, fid_report))
+            {
+                step_end[0] = step + 1;
+                break;
+            }
+        }
+        if (checkpoint_interval > 0 && (step + 1) % checkpoint_interval == 0)
+        {
+            phase_begin();
+            checkpoint.stage = 0;
+            checkpoint.step = step + 1;
+            checkpoint.num_updates = num_updates;
+            checkpoint.report_size = find_report_size(fid_report);
+            write_checkpoint
+            (
+                "restart.bin", checkpoint, neighbor, corr, heat_sum, 
+                convergence, id, type, m, x, y, z, x0, y0, z0, vx, vy, vz, 
+                fx, fy, fz
+            );
+            phase_end(PHASE_OUTPUT);
+        }
+    } 
+    time_used = get_time() - time_begin;
+    if (use_md)
+    {
+        fprintf(stderr, "time used for equilibration = %g s\n", time_used); 
+    }
+    checkpoint.equilibration_steps = step_end[0];
+    if (checkpoint_interval > 0 && step_begin[0] < step_end[0])
+    {
+        // the equilibrated state, from which production runs can start
+        checkpoint.stage = 1;
+        checkpoint.step = 0;
+        checkpoint.num_updates = num_updates;
+        checkpoint.report_size = find_report_size(fid_report);
+        write_checkpoint
+        (
+            "equilibrated.bin", checkpoint, neighbor, corr, heat_sum, 
+            convergence, id, type, m, x, y, z, x0, y0, z0, vx, vy, vz, 
+            fx, fy, fz
+        );
+        printf("Equilibrated state written to equilibrated.bin.\n");
+    }
 
     // production
-    printf("\nProduction started:\n");
-    time_begin = clock();
-    int count = 0;
-    for (int step = 0; step < Np; ++step)
+    if (use_md) { printf("\nProduction started:\n"); }
+    time_begin = get_time();
+    for (int step = step_begin[1]; step < Np; ++step)
     {  
+        phase_begin();
         integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 1);
+        phase_end(PHASE_INTEGRATE);
+        phase_begin();
+        num_updates += update_neighbor
+        (
+            N, neighbor, pbc, box, x, y, z, x0, y0, z0, cutoff, skin, 0
+        );
+        phase_end(PHASE_NEIGHBOR);
+        if (sort_interval > 0 && step % sort_interval == 0)
+        {
+            phase_begin();
+            sort_particles
+            (
+                N, box, neighbor, id, type, m, x, y, z, x0, y0, z0, 
+                vx, vy, vz, fx, fy, fz
+            );
+            phase_end(PHASE_SORT);
+        }
+        int props = (0 == step % Ns) ? PROP_ALL : PROP_NONE; // sampling
         find_force
-        (N, NN, NL, MN, pbc, box, b, bp, x, y, z, vx, vy, vz, fx, fy, fz, prop);
+        (
+            N, neighbor, pbc, box, bond, x, y, z, vx, vy, vz, fx, fy, fz, 
+            prop_atom, prop, use_simd, props
+        );
+        if (use_hnemd)
+        {
+            phase_begin();
+            add_driving_force
+            (
+                N, neighbor, use_simd && !bond.potential, bond, fe, 
+                num_replicas, id, fx, fy, fz
+            );
+            phase_end(PHASE_FORCE);
+        }
+        phase_begin();
         integrate(N, time_step, m, fx, fy, fz, vx, vy, vz, x, y, z, 2);
-        if ((step+1) % (Np/10) == 0)
+        phase_end(PHASE_INTEGRATE);
+        if (use_hnemd) // the heat from the driving force is removed
         {
-            printf("\t%d steps completed.\n", step + 1);
+            phase_begin();
+            scale_velocity
+            (N, num_replicas, id, T_0, m, vx, vy, vz, scale_factor);
+            phase_end(PHASE_THERMOSTAT);
         }
         if (0 == step % Ns) 
         {
-            double pe = prop[0]; // total potential energy
-            double px = prop[1]; // pressure in the x direction
-            double py = prop[2]; // pressure in the y direction
-            double pz = prop[3]; // pressure in the z direction
-            double ke = 0.0;     // total kinetic energy
-            for (int n = 0; n < N; ++n)
+            phase_begin();
+            sum_over_replicas
+            (
+                N, num_replicas, id, m, vx, vy, vz, prop_atom, prop_replica, 
+                ke_replica
+            );
+            double thermo[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0}; // averages
+            double e_total = 0.0; // total energy of all the replicas
+            for (int r = 0; r < num_replicas; ++r)
+            {
+                real_x *prop_r = prop_replica + r * 7;
+                double pe = prop_r[0];      // total potential energy
+                double px = prop_r[1];      // pressure in the x direction
+                double py = prop_r[2];      // pressure in the y direction
+                double pz = prop_r[3];      // pressure in the z direction
+                double ke = ke_replica[r];  // total kinetic energy
+                e_total += ke + pe;
+                // instant temperature
+                double temp = 2.0 * ke / (3.0 * N_replica * K_B); 
+                // Do you remember the state equation for ideal gas: 
+                // p V = N k_B T?
+                double nkt = N_replica * K_B * temp;
+                px = (px + nkt) / volume * PRESSURE_UNIT_CONVERSION; 
+                py = (py + nkt) / volume * PRESSURE_UNIT_CONVERSION;
+                pz = (pz + nkt) / volume * PRESSURE_UNIT_CONVERSION;
+                if (use_hnemd)
+                {
+                    for (int d = 0; d < 3; ++d) 
+                    { 
+                        heat_sum[r * 3 + d] += prop_r[4 + d]; 
+                    }
+                }
+                else
+                {
+                    add_to_correlator
+                    (corr[r], prop_r[4], prop_r[5], prop_r[6]);
+                }
+                double thermo_r[6] = {temp, ke, pe, px, py, pz};
+                for (int k = 0; k < 6; ++k) { thermo[k] += thermo_r[k]; }
+            }
+            for (int k = 0; k < 6; ++k) { thermo[k] /= num_replicas; }
+            for (int k = 0; k < 6; ++k) 
+            { 
+                add_to_block_average(convergence.thermo[k], thermo[k]); 
+            }
+            for (int d = 0; d < 3; ++d)
             {
-                ke += m[n] * (vx[n] * vx[n] + vy[n] * vy[n] + vz[n] * vz[n]);
+                double heat = 0.0; // averaged over the replicas
+                for (int r = 0; r < num_replicas; ++r) 
+                { 
+                    heat += prop_replica[r * 7 + 4 + d]; 
+                }
+                add_to_block_average(convergence.heat[d], heat / num_replicas);
             }
-            ke *= 0.5;
-            double temp = 2.0 * ke / (3.0 * N * K_B); // instant temperature
-            // Do you remember the state equation for ideal gas: p V = N k_B T?
-            px = (px + N * K_B * temp) / volume * PRESSURE_UNIT_CONVERSION; 
-            py = (py + N * K_B * temp) / volume * PRESSURE_UNIT_CONVERSION;
-            pz = (pz + N * K_B * temp) / volume * PRESSURE_UNIT_CONVERSION;
+            add_to_energy_fit(energy_fit, count * dt_in_ps, e_total);
+            phase_end(PHASE_SAMPLING);
 
-            fprintf
+            phase_begin();
+            if (use_output && use_binary)
+            {
+                for (int k = 0; k < 6; ++k) { thermo_record[k] = thermo[k]; }
+                for (int r = 0; r < num_replicas; ++r)
+                {
+                    for (int d = 0; d < 3; ++d)
+                    {
+                        thermo_record[6 + r * 3 + d] 
+                            = prop_replica[r * 7 + 4 + d];
+                    }
+                }
+                push_output
+                (
+                    output, OUTPUT_THERMO, thermo_record, 
+                    thermo_size * sizeof(double)
+                );
+            }
+            else if (use_output) // averages over the replicas
+            {
+                char line[200];
+                int length = sprintf
+                (
+                    line, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n", 
+                    thermo[0],                       // in units of K
+                    thermo[1], thermo[2],            // in units of eV
+                    thermo[3], thermo[4], thermo[5]  // in units of GPa
+                );
+                push_output(output, OUTPUT_THERMO, line, length);
+            }
+            if (use_output && use_hnemd) // running kappa
+            {
+                find_hnemd_kappa
+                (
+                    num_replicas, heat_sum, count + 1, T_0, volume, fe, 
+                    kappa, kappa_error
+                );
+                char line[200];
+                int length = sprintf
+                (
+                    line, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n",
+                    (count + 1) * dt_in_ps, kappa[0], kappa[1], kappa[2], 
+                    kappa_error[0], kappa_error[1], kappa_error[2]
+                );
+                push_output(output, OUTPUT_KAPPA, line, length);
+            }
+            phase_end(PHASE_OUTPUT);
+            count++; 
+        }
+        if (use_output && dump_interval > 0 && 0 == step % dump_interval)
+        {
+            phase_begin();
+            frame[0] = (step + 1) * time_step * TIME_UNIT_CONVERSION / 1000.0;
+            double *r = frame + 1; // in the original order
+            for (int n = 0; n < N; ++n)
+            {
+                int k = id[n];
+                r[k] = x[n];
+                r[k + N] = y[n];
+                r[k + N * 2] = z[n];
+                r[k + N * 3] = vx[n] / TIME_UNIT_CONVERSION; // A/fs
+                r[k + N * 4] = vy[n] / TIME_UNIT_CONVERSION;
+                r[k + N * 5] = vz[n] / TIME_UNIT_CONVERSION;
+            }
+            push_output
             (
-                fid, "%25.15e%25.15e%25.15e%25.15e%25.15e%25.15e\n", 
-                temp,       // in units of K
-                ke, pe,     // in units of eV
-                px, py, pz  // in units of GPa
+                output, OUTPUT_TRAJ, frame, (1 + 6 * N) * sizeof(double)
             );
-            hx[count] = prop[4]; // record the heat current data
-            hy[count] = prop[5]; 
-            hz[count] = prop[6]; 
-            count++; 
+            phase_end(PHASE_OUTPUT);
+        }
+        if ((step+1) % (Np/10) == 0)
+        {
+            printf("\t%d steps completed.\n", step + 1);
+            if (task == TASK_MD && use_hnemd)
+            {
+                find_hnemd_kappa
+                (
+                    num_replicas, heat_sum, count, T_0, volume, fe, kappa, 
+                    kappa_error
+                );
+                printf
+                (
+                    "\tkappa(%g ps) = %g(%g) %g(%g) %g(%g) W/mK\n", 
+                    count * dt_in_ps, kappa[0], kappa_error[0], 
+                    kappa[1], kappa_error[1], kappa[2], kappa_error[2]
+                );
+            }
+            else if (task == TASK_MD)
+            {
+                phase_begin();
+                FILE *fid_hac = fopen("hac_partial.txt", "w");
+                if (num_replicas == 1)
+                {
+                    output_correlator
+                    (corr[0], time_step * Ns, T_0, volume, fid_hac, kappa);
+                    printf
+                    (
+                        "\tkappa(%g ps) = %g %g %g W/mK\n", 
+                        (Nc - 1) * dt_in_ps, kappa[0], kappa[1], kappa[2]
+                    );
+                }
+                else
+                {
+                    output_ensemble
+                    (
+                        num_replicas, corr, time_step * Ns, T_0, volume, 
+                        fid_hac, kappa, kappa_error
+                    );
+                    printf
+                    (
+                        "\tkappa(%g ps) = %g(%g) %g(%g) %g(%g) W/mK\n", 
+                        (Nc - 1) * dt_in_ps, kappa[0], kappa_error[0], 
+                        kappa[1], kappa_error[1], kappa[2], kappa_error[2]
+                    );
+                }
+                fclose(fid_hac);
+                phase_end(PHASE_OUTPUT);
+            }
+            // for EMD, the rtc at the largest correlation time needs at 
+            // least MIN_ORIGINS_PER_NC * Nc time origins
+            int num_origins = count - (Nc - 1);
+            if (num_origins > Nd - Nc) { num_origins = Nd - Nc; }
+            int is_reliable 
+                = use_hnemd || (num_origins >= MIN_ORIGINS_PER_NC * Nc);
+            if (task == TASK_MD && use_hnemd && convergence.kappa_tol > 0.0)
+            {
+                // the block-averaged error of the time average (of the 
+                // replica average) of the heat current
+                double factor = KAPPA_UNIT_CONVERSION / (T_0 * volume 
+                    * sqrt(fe[0] * fe[0] + fe[1] * fe[1] + fe[2] * fe[2]));
+                for (int d = 0; d < 3; ++d)
+                {
+                    int is_plateau_d;
+                    kappa[d] = convergence.heat[d].mean[0] * factor;
+                    kappa_error[d] = factor 
+                        * find_block_error(convergence.heat[d], is_plateau_d);
+                    if (is_checked[d] && !is_plateau_d) { is_reliable = 0; }
+                }
+            }
+            if (task == TASK_MD && convergence.kappa_tol > 0.0 
+                && check_production
+                (
+                    convergence, step + 1, kappa, kappa_error, is_checked, 
+                    is_reliable, fid_report
+                ))
+            {
+                step_end[1] = step + 1;
+                break;
+            }
+        }
+        if (checkpoint_interval > 0 && (step + 1) % checkpoint_interval == 0)
+        {
+            phase_begin();
+            checkpoint.stage = 1;
+            checkpoint.step = step + 1;
+            checkpoint.count = count;
+            checkpoint.num_updates = num_updates;
+            checkpoint.energy_fit = energy_fit;
+            checkpoint.report_size = find_report_size(fid_report);
+            if (use_output)
+            {
+                flush_output_queue(output); // the outputs match the state
+                for (int k = 0; k < NUM_OUTPUTS; ++k) 
+                { 
+                    checkpoint.output_size[k] = output.file_size[k]; 
+                }
+            }
+            write_checkpoint
+            (
+                "restart.bin", checkpoint, neighbor, corr, heat_sum, 
+                convergence, id, type, m, x, y, z, x0, y0, z0, vx, vy, vz, 
+                fx, fy, fz
+            );
+            phase_end(PHASE_OUTPUT);
         }
     } 
 
-    fclose(fid);
-    time_finish = clock();
-    time_used = (time_finish - time_begin) / (double) CLOCKS_PER_SEC;
-    fprintf(stderr, "time used for production = %g s\n", time_used); 
+    if (use_output) 
+    { 
+        close_output_queue(output); 
+        printf
+        (
+            "Output: %.3f MB written by the writer thread; the MD loop "
+            "waited %g s for room in the queue.\n", 
+            output.bytes_pushed / 1048576.0, output.time_waited
+        );
+    }
+    free(thermo_record); free(frame);
+    time_used = get_time() - time_begin;
+    summary.time_used = time_used;
+    if (Np > 0)
+    {
+        fprintf(stderr, "time used for production = %g s\n", time_used); 
+        printf("\nNumber of neighbor list updates = %d\n", num_updates);
+        find_energy_drift(energy_fit, N, summary);
+        printf
+        (
+            "Energy drift = %g eV/atom/ps (rms deviation %g eV/atom)\n", 
+            summary.drift, summary.deviation
+        );
+    }
 
-    // calculate hac and rtc
-    find_hac_kappa(Nd, Nc, time_step * Ns, T_0, volume, hx, hy, hz);
+    // output the final hac and rtc (or the HNEMD kappa)
+    if (task == TASK_MD && use_hnemd)
+    {
+        find_hnemd_kappa
+        (
+            num_replicas, heat_sum, count, T_0, volume, fe, kappa, kappa_error
+        );
+        printf
+        (
+            "\nHNEMD with Fe = (%g, %g, %g) /A over %g ps:\n"
+            "kappa = %g(%g) %g(%g) %g(%g) W/mK\n", fe[0], fe[1], fe[2], 
+            count * dt_in_ps, kappa[0], kappa_error[0], 
+            kappa[1], kappa_error[1], kappa[2], kappa_error[2]
+        );
+    }
+    else if (task == TASK_MD)
+    {
+        phase_begin();
+        FILE *fid_hac = fopen("hac.txt", "a"); // "append" mode 
+        for (int r = 0; r < num_replicas; ++r) // as for independent runs
+        {
+            output_correlator
+            (corr[r], time_step * Ns, T_0, volume, fid_hac, kappa);
+        }
+        fclose(fid_hac);
+        if (num_replicas > 1)
+        {
+            fid_hac = fopen("hac_ensemble.txt", "w");
+            output_ensemble
+            (
+                num_replicas, corr, time_step * Ns, T_0, volume, fid_hac, 
+                kappa, kappa_error
+            );
+            fclose(fid_hac);
+            printf
+            (
+                "\nEnsemble average of %d replicas:\n"
+                "kappa(%g ps) = %g(%g) %g(%g) %g(%g) W/mK\n", num_replicas,
+                (Nc - 1) * dt_in_ps, kappa[0], kappa_error[0], 
+                kappa[1], kappa_error[1], kappa[2], kappa_error[2]
+            );
+        }
+        phase_end(PHASE_OUTPUT);
+    }
+    if (fid_report)
+    {
+        const char *format = "\n%d of %d equilibration steps and %d of %d "
+            "production steps were run.\n";
+        printf(format, step_end[0], Ne, step_end[1], Np);
+        fprintf(fid_report, format, step_end[0], Ne, step_end[1], Np);
+        report_convergence(convergence, fid_report);
+        fclose(fid_report);
+    }
+    if (use_md)
+    {
+        stop_profiling();
+        char filename[64];
+        const char *precision = precision_names[options.precision];
+        sprintf(filename, "profile_%s.json", precision);
+        report_profiling
+        (
+            precision, N, 
+            step_end[0] - step_begin[0] + step_end[1] - step_begin[1], 
+            use_simd ? get_simd_name() : "scalar", table_size, filename
+        );
+    }
 
-    free(NN); free(NL); free(m);  free(x);  free(y);  free(z);
+    free_neighbor(neighbor); free(m);  free(x);  free(y);  free(z);
     free(vx); free(vy); free(vz); free(fx); free(fy); free(fz);
-    free(hx); free(hy); free(hz); free(b);  free(bp);
+    free(x0); free(y0); free(z0);
+    free(prop_atom); free_bond_data(bond); 
+    for (int r = 0; r < num_replicas; ++r) { free_correlator(corr[r]); }
+    free(corr); free(prop_replica); free(ke_replica); free(heat_sum);
+    free(scale_factor);
+    free(id); free(type);
+    if (table_size > 0) { free_table(table); }
+    if (options.potential_file) { free_potential(potential); }
+}
+
+// run the simulation in one precision mode
+void run_md(const Run_Options &options, Run_Summary &summary)
+{
+    if (options.precision == PRECISION_DOUBLE)
+    {
+        run_md<double, double>(options, summary);
+    }
+    else if (options.precision == PRECISION_FLOAT)
+    {
+        run_md<float, float>(options, summary);
+    }
+    else
+    {
+        run_md<double, float>(options, summary);
+    }
+}
+
+// run the three precision modes from the same initial state and compare the
+// drift of the total energy in the production (NVE) stage
+void report_energy_drift(const Run_Options &options)
+{
+    Run_Summary summary[3];
+    for (int precision = 0; precision < 3; ++precision)
+    {
+        printf
+        ("\n==== precision mode: %s ====\n", precision_names[precision]);
+        Run_Options options_drift = options;
+        options_drift.precision = precision;
+        options_drift.task = TASK_DRIFT;
+        run_md(options_drift, summary[precision]);
+    }
+
+    FILE *fid = fopen("drift.txt", "w");
+    printf("\nEnergy drift in the production stage (NVE):\n");
+    printf
+    (
+        "%10s%25s%25s%20s\n", "mode", "drift(eV/atom/ps)", 
+        "rms deviation(eV/atom)", "time used(s)"
+    );
+    for (int precision = 0; precision < 3; ++precision)
+    {
+        printf
+        (
+            "%10s%25.6e%25.6e%20.3f\n", precision_names[precision], 
+            summary[precision].drift, summary[precision].deviation, 
+            summary[precision].time_used
+        );
+        fprintf
+        (
+            fid, "%d %25.15e %25.15e %g\n", precision, summary[precision].drift, 
+            summary[precision].deviation, summary[precision].time_used
+        );
+    }
+    fclose(fid);
+}
+
+// compare the FFT, the streaming, and the direct versions of find_hac for a 
+// correlated random signal of Nd data
+void check_hac(unsigned int seed, int Nd, int Nc)
+{
+    int M = Nd - Nc;
+    double *h[3], *hac[3][3];
+    for (int d = 0; d < 3; ++d)
+    {
+        h[d] = (double*) malloc(sizeof(double) * Nd);
+        double h_old = 0.0; // h[n] = 0.99 h[n-1] + noise
+        for (int n = 0; n < Nd; ++n)
+        {
+            double u[4];
+            find_random_uniform(seed, 0, n, 0, RNG_SIGNAL, u);
+            h_old = 0.99 * h_old + u[d] - 0.5;
+            h[d][n] = h_old;
+        }
+        for (int k = 0; k < 3; ++k)
+        {
+            hac[k][d] = (double*) malloc(sizeof(double) * Nc);
+            for (int nc = 0; nc < Nc; ++nc) { hac[k][d][nc] = 0.0; }
+        }
+    }
+
+    double time_used[3];
+    double time_begin = get_time();
+    find_hac(Nc, M, h[0], h[1], h[2], hac[0][0], hac[0][1], hac[0][2]);
+    time_used[0] = get_time() - time_begin;
+    time_begin = get_time();
+    find_hac_fft(Nc, M, h[0], h[1], h[2], hac[1][0], hac[1][1], hac[1][2]);
+    time_used[1] = get_time() - time_begin;
+    time_begin = get_time();
+    Correlator corr;
+    allocate_correlator(Nc, M, 0, corr);
+    for (int n = 0; n < Nd; ++n) 
+    {
+        add_to_correlator(corr, h[0][n], h[1][n], h[2][n]);
+    }
+    for (int d = 0; d < 3; ++d)
+    {
+        for (int nc = 0; nc < Nc; ++nc) { hac[2][d][nc] = corr.sum[d][nc] / M; }
+    }
+    free_correlator(corr);
+    time_used[2] = get_time() - time_begin;
+
+    double error[2] = {0.0, 0.0}; // relative to hac(0)
+    for (int k = 0; k < 2; ++k)
+    {
+        for (int d = 0; d < 3; ++d)
+        {
+            for (int nc = 0; nc < Nc; ++nc)
+            {
+                double e = fabs(hac[k + 1][d][nc] - hac[0][d][nc]) 
+                         / hac[0][d][0];
+                if (e > error[k]) { error[k] = e; }
+            }
+        }
+    }
+
+    const double tolerance = 1.0e-10;
+    printf("\nFFT and streaming vs direct hac (Nd = %d, Nc = %d):\n", Nd, Nc);
+    printf("    time (direct)         = %g s\n", time_used[0]);
+    printf("    time (FFT)            = %g s\n", time_used[1]);
+    printf("    time (streaming)      = %g s\n", time_used[2]);
+    printf("    max error (FFT)       = %g (relative to hac(0))\n", error[0]);
+    printf("    max error (streaming) = %g (relative to hac(0))\n", error[1]);
+    printf("    tolerance             = %g\n", tolerance);
+    printf
+    (
+        "    %s\n", 
+        (error[0] < tolerance && error[1] == 0.0) ? "PASSED" : "FAILED"
+    );
+    printf
+    (
+        "    the correlator of an EMD run uses the %s version for this size\n", 
+        use_fft_for_hac(Nd, Nc) ? "FFT" : "streaming"
+    );
+
+    for (int d = 0; d < 3; ++d)
+    {
+        free(h[d]); free(hac[0][d]); free(hac[1][d]); free(hac[2][d]);
+    }
+}
+
+// Finally, we reach the main function
+#ifndef MD_TERSOFF_NO_MAIN // defined by tersoff_batch.cpp (see note 23)
+int main(int argc, char *argv[])
+{
+    unsigned int seed = time(NULL); // each run is independent
+    int precision = PRECISION;
+    int task = TASK_MD;
+    int table_size = 0;
+    int use_counters = 0;
+    const char *potential_file = NULL;
+    int sort_interval = 0;
+    int nx = 20, ny = 12;
+    int num_replicas = 1;
+    int use_binary = 0;
+    int dump_interval = 0;
+    int checkpoint_interval = 0;
+    const char *restart_file = NULL;
+    double fe[3] = {0.0, 0.0, 0.0};
+    double drift_tol = 0.0;
+    double kappa_tol = 0.0;
+    const char *convert_file = NULL;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "double") == 0) { precision = PRECISION_DOUBLE; }
+        else if (strcmp(argv[i], "float") == 0) { precision = PRECISION_FLOAT; }
+        else if (strcmp(argv[i], "mixed") == 0) { precision = PRECISION_MIXED; }
+        else if (strcmp(argv[i], "scaling") == 0) { task = TASK_SCALING; }
+        else if (strcmp(argv[i], "simd") == 0) { task = TASK_SIMD; }
+        else if (strcmp(argv[i], "drift") == 0) { task = TASK_DRIFT; }
+        else if (strcmp(argv[i], "hac") == 0) { task = TASK_HAC; }
+        else if (strcmp(argv[i], "table") == 0) { table_size = 1000; }
+        else if (strcmp(argv[i], "counters") == 0) { use_counters = 1; }
+        else if (strcmp(argv[i], "sort") == 0) { sort_interval = 100; }
+        else if (strncmp(argv[i], "sort=", 5) == 0) 
+        { 
+            sort_interval = atoi(argv[i] + 5); 
+            if (sort_interval < 1)
+            {
+                printf("Error: the sort interval should be positive.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "cells=", 6) == 0) 
+        { 
+            if (sscanf(argv[i] + 6, "%d,%d", &nx, &ny) != 2 || nx < 2 || ny < 1)
+            {
+                printf("Error: use cells=nx,ny with nx >= 2 and ny >= 1.\n");
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "binary") == 0) { use_binary = 1; }
+        else if (strncmp(argv[i], "dump=", 5) == 0) 
+        { 
+            dump_interval = atoi(argv[i] + 5); 
+            if (dump_interval < 1)
+            {
+                printf("Error: the dump interval should be positive.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "checkpoint=", 11) == 0) 
+        { 
+            checkpoint_interval = atoi(argv[i] + 11); 
+            if (checkpoint_interval < 1)
+            {
+                printf("Error: the checkpoint interval should be positive.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "hnemd=", 6) == 0) 
+        { 
+            if (sscanf(argv[i] + 6, "%lf,%lf,%lf", &fe[0], &fe[1], &fe[2]) 
+                != 3 || (fe[0] == 0.0 && fe[1] == 0.0 && fe[2] == 0.0))
+            {
+                printf("Error: use hnemd=fx,fy,fz with a nonzero force.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "drift_tol=", 10) == 0) 
+        { 
+            drift_tol = atof(argv[i] + 10); 
+            if (drift_tol <= 0.0)
+            {
+                printf("Error: the drift tolerance should be positive.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "kappa_tol=", 10) == 0) 
+        { 
+            kappa_tol = atof(argv[i] + 10); 
+            if (kappa_tol <= 0.0)
+            {
+                printf("Error: the kappa tolerance should be positive.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "restart=", 8) == 0) 
+        { 
+            restart_file = argv[i] + 8; 
+        }
+        else if (strncmp(argv[i], "convert=", 8) == 0) 
+        { 
+            convert_file = argv[i] + 8; 
+        }
+        else if (strncmp(argv[i], "seed=", 5) == 0) 
+        { 
+            seed = strtoul(argv[i] + 5, NULL, 10); 
+        }
+        else if (strncmp(argv[i], "replicas=", 9) == 0) 
+        { 
+            num_replicas = atoi(argv[i] + 9); 
+            if (num_replicas < 1)
+            {
+                printf("Error: the number of replicas should be positive.\n");
+                exit(1);
+            }
+        }
+        else if (strncmp(argv[i], "potential=", 10) == 0) 
+        { 
+            potential_file = argv[i] + 10; 
+        }
+        else if (strncmp(argv[i], "table=", 6) == 0)
+        {
+            table_size = atoi(argv[i] + 6);
+            if (table_size < 1)
+            {
+                printf("Error: the table size should be positive.\n");
+                exit(1);
+            }
+        }
+        else
+        {
+            printf("Error: unknown argument %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (convert_file)
+    {
+        convert_output(convert_file);
+        return 0;
+    }
+    if ((checkpoint_interval > 0 || restart_file) && task != TASK_MD)
+    {
+        printf("Error: checkpoints are only for the MD task.\n");
+        exit(1);
+    }
+    if ((fe[0] != 0.0 || fe[1] != 0.0 || fe[2] != 0.0) && task != TASK_MD)
+    {
+        printf("Error: HNEMD is only for the MD task.\n");
+        exit(1);
+    }
+    if ((drift_tol > 0.0 || kappa_tol > 0.0) && task != TASK_MD)
+    {
+        printf("Error: the tolerances are only for the MD task.\n");
+        exit(1);
+    }
+    if (kappa_tol > 0.0 && num_replicas < MIN_REPLICAS_EMD 
+        && fe[0] == 0.0 && fe[1] == 0.0 && fe[2] == 0.0)
+    {
+        printf
+        (
+            "Error: kappa_tol needs the error of kappa, from the replicas "
+            "(replicas=R with R >= %d) or from HNEMD (hnemd=fx,fy,fz).\n",
+            MIN_REPLICAS_EMD
+        );
+        exit(1);
+    }
+    printf("Random seed = %u\n", seed);
+    Run_Options options = 
+    {
+        precision, task, seed, table_size, use_counters, potential_file, 
+        sort_interval, nx, ny, num_replicas, use_binary, dump_interval,
+        checkpoint_interval, restart_file, {fe[0], fe[1], fe[2]}, 
+        drift_tol, kappa_tol
+    };
+
+    if (task == TASK_DRIFT) 
+    {
+        report_energy_drift(options); 
+    }
+    else if (task == TASK_HAC)
+    {
+        check_hac(seed, 1000, 100);
+        check_hac(seed, 100000, 10000);
+    }
+    else
+    {
+        Run_Summary summary;
+        run_md(options, summary);
+    }
 
     //system("PAUSE"); // for Dev-C++ in Windows
     return 0;
 }
+#endif
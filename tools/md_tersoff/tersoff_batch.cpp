@@ -0,0 +1,390 @@
+/*
+    Batched evaluation of the Tersoff potential (see tersoff_batch.h).
+
+    The kernels of md_tersoff.cpp are compiled into the namespace md_tersoff
+    (its main is left out), such that the library does not export names
+    like find_force; the headers it includes are included first, so that
+    they stay in the global namespace.
+*/
+
+#include "tersoff_batch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace md_tersoff
+{
+#define MD_TERSOFF_NO_MAIN
+#include "md_tersoff.cpp"
+}
+
+using namespace md_tersoff;
+
+#define TERSOFF_MAX_ATOMS 100000000 // after the replication
+
+// the arrays of one worker (they only grow)
+struct Tersoff_Workspace
+{
+    int capacity;           // allocated number of particles
+    Neighbor neighbor;
+    Bond_Data<double> bond;
+    int *type;
+    double *x, *y, *z;      // positions in the (replicated) box
+    double *vx, *vy, *vz;   // zero (the heat current is not needed)
+    double *fx, *fy, *fz;
+    double *prop_atom;
+};
+
+struct Tersoff_Batch
+{
+    Tersoff_Potential potential;
+    int has_potential;      // 1 if a potential file was loaded
+    int use_types;          // 1 for the multi-species kernels
+    int num_types;
+    double cutoff;
+
+    // the thread pool: the workers wait for a new generation, take the
+    // structures with next, and the last one to finish wakes the caller
+    int num_threads;
+    std::thread *workers;
+    Tersoff_Workspace *workspace;
+    std::mutex mutex;
+    std::condition_variable start, finish;
+    int generation;
+    int num_busy;
+    int stop;
+    int num_structures;
+    const Tersoff_Structure *structures;
+    Tersoff_Result *results;
+    std::atomic<int> next;
+    std::atomic<int> num_errors;
+};
+
+static void allocate_workspace(Tersoff_Workspace &w)
+{
+    w.capacity = 0;
+    allocate_neighbor(0, w.neighbor);
+    allocate_bond_data(w.bond);
+    w.type = NULL;
+    w.x = w.y = w.z = w.vx = w.vy = w.vz = w.fx = w.fy = w.fz = NULL;
+    w.prop_atom = NULL;
+}
+
+static void free_workspace(Tersoff_Workspace &w)
+{
+    free_neighbor(w.neighbor);
+    free_bond_data(w.bond);
+    free(w.type);
+    free(w.x); free(w.y); free(w.z); free(w.vx); free(w.vy); free(w.vz);
+    free(w.fx); free(w.fy); free(w.fz); free(w.prop_atom);
+}
+
+static void reserve_workspace(int N, Tersoff_Workspace &w)
+{
+    if (N <= w.capacity) { return; }
+    int capacity = N + N / 5;
+    free_neighbor(w.neighbor);
+    allocate_neighbor(capacity, w.neighbor);
+    grow_array(capacity, w.type);
+    grow_array(capacity, w.x); grow_array(capacity, w.y);
+    grow_array(capacity, w.z);
+    grow_array(capacity, w.vx); grow_array(capacity, w.vy);
+    grow_array(capacity, w.vz);
+    grow_array(capacity, w.fx); grow_array(capacity, w.fy);
+    grow_array(capacity, w.fz);
+    grow_array(capacity * 7, w.prop_atom);
+    for (int n = 0; n < capacity; ++n)
+    {
+        w.vx[n] = w.vy[n] = w.vz[n] = 0.0;
+    }
+    w.capacity = capacity;
+}
+
+// W_ab = - sum of r12_a f12_b over the bonds of the particles n1 < N0 (the
+// bond data are bond-major for the vectorized kernels)
+static void find_virial
+(
+    int N, int N0, Neighbor &neighbor, int is_bond_major,
+    Bond_Data<double> &bond, double virial[9]
+)
+{
+    for (int k = 0; k < 9; ++k) { virial[k] = 0.0; }
+    for (int n1 = 0; n1 < N0; ++n1)
+    {
+        for (int i1 = 0; i1 < neighbor.NN[n1]; ++i1)
+        {
+            int index12 = is_bond_major ? i1 * N + n1 : neighbor.NO[n1] + i1;
+            double r12[3] =
+            {bond.x12[index12], bond.y12[index12], bond.z12[index12]};
+            double f12[3] =
+            {bond.f12x[index12], bond.f12y[index12], bond.f12z[index12]};
+            for (int a = 0; a < 3; ++a)
+            {
+                for (int b = 0; b < 3; ++b)
+                {
+                    virial[a * 3 + b] -= r12[a] * f12[b];
+                }
+            }
+        }
+    }
+}
+
+// evaluate one structure with the arrays of one worker
+static int evaluate_structure
+(
+    Tersoff_Batch *batch, Tersoff_Workspace &w,
+    const Tersoff_Structure &s, Tersoff_Result &r
+)
+{
+    int N0 = s.num_atoms;
+    if (N0 < 1) { return TERSOFF_BAD_BOX; }
+    for (int n = 0; n < N0; ++n)
+    {
+        int t = s.type ? s.type[n] : 0;
+        if (t < 0 || t >= batch->num_types) { return TERSOFF_BAD_TYPE; }
+    }
+
+    // replicate the short periodic directions; a free direction gets a box
+    // around the particles
+    int pbc[3], num_images[3];
+    double box[3], shift[3];
+    const double *xyz[3] = {s.x, s.y, s.z};
+    double num_atoms = N0;
+    for (int d = 0; d < 3; ++d)
+    {
+        pbc[d] = (s.pbc[d] == 1);
+        num_images[d] = 1;
+        shift[d] = 0.0;
+        if (pbc[d])
+        {
+            if (!(s.box[d] > 0.0)) { return TERSOFF_BAD_BOX; }
+            double length = 2.0 * batch->cutoff;
+            if (s.box[d] < length)
+            {
+                num_images[d] = (int) ceil(length / s.box[d]);
+                while (num_images[d] * s.box[d] < length) { num_images[d]++; }
+            }
+            box[d] = s.box[d] * num_images[d];
+        }
+        else
+        {
+            double lower = xyz[d][0], upper = xyz[d][0];
+            for (int n = 1; n < N0; ++n)
+            {
+                if (xyz[d][n] < lower) { lower = xyz[d][n]; }
+                if (xyz[d][n] > upper) { upper = xyz[d][n]; }
+            }
+            shift[d] = - lower;
+            box[d] = upper - lower + batch->cutoff;
+        }
+        num_atoms *= num_images[d];
+    }
+    if (num_atoms > TERSOFF_MAX_ATOMS) { return TERSOFF_TOO_LARGE; }
+    int N = (int) num_atoms;
+    reserve_workspace(N, w);
+
+    // the first N0 particles are the original ones
+    int n = 0;
+    for (int iz = 0; iz < num_images[2]; ++iz)
+    {
+        for (int iy = 0; iy < num_images[1]; ++iy)
+        {
+            for (int ix = 0; ix < num_images[0]; ++ix)
+            {
+                for (int n0 = 0; n0 < N0; ++n0)
+                {
+                    w.type[n] = s.type ? s.type[n0] : 0;
+                    w.x[n] = s.x[n0] + shift[0] + ix * s.box[0];
+                    w.y[n] = s.y[n0] + shift[1] + iy * s.box[1];
+                    w.z[n] = s.z[n0] + shift[2] + iz * s.box[2];
+                    n++;
+                }
+            }
+        }
+    }
+    apply_pbc(N, pbc, box, w.x, w.y, w.z);
+
+    find_neighbor(N, w.neighbor, pbc, box, w.x, w.y, w.z, batch->cutoff);
+    find_reverse_bond(N, w.neighbor);
+    w.bond.potential = batch->use_types ? &batch->potential : NULL;
+    w.bond.type = batch->use_types ? w.type : NULL;
+    int use_simd = !batch->use_types;
+    double prop[7];
+    find_force
+    (
+        N, w.neighbor, pbc, box, w.bond, w.x, w.y, w.z, w.vx, w.vy, w.vz,
+        w.fx, w.fy, w.fz, w.prop_atom, prop, use_simd, PROP_ALL
+    );
+
+    r.energy = 0.0;
+    for (int n0 = 0; n0 < N0; ++n0)
+    {
+        r.energy += w.prop_atom[n0 * 7];
+        r.fx[n0] = w.fx[n0];
+        r.fy[n0] = w.fy[n0];
+        r.fz[n0] = w.fz[n0];
+        if (r.energy_atom) { r.energy_atom[n0] = w.prop_atom[n0 * 7]; }
+    }
+    find_virial(N, N0, w.neighbor, use_simd, w.bond, r.virial);
+    return TERSOFF_OK;
+}
+
+static void run_worker(Tersoff_Batch *batch, int thread_id)
+{
+#ifdef _OPENMP
+    omp_set_num_threads(1); // one structure per thread
+#endif
+    Tersoff_Workspace &w = batch->workspace[thread_id];
+    int generation = 0;
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(batch->mutex);
+            batch->start.wait(lock, [&]
+            {
+                return batch->stop || batch->generation != generation;
+            });
+            if (batch->stop) { return; }
+            generation = batch->generation;
+        }
+        int num_errors = 0;
+        while (1)
+        {
+            int k = batch->next.fetch_add(1, std::memory_order_relaxed);
+            if (k >= batch->num_structures) { break; }
+            Tersoff_Result &r = batch->results[k];
+            r.status = evaluate_structure(batch, w, batch->structures[k], r);
+            if (r.status != TERSOFF_OK) { num_errors++; }
+        }
+        batch->num_errors += num_errors;
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        if (--batch->num_busy == 0) { batch->finish.notify_one(); }
+    }
+}
+
+Tersoff_Batch *create_tersoff_batch
+(const char *potential_file, int num_threads)
+{
+    Tersoff_Batch *batch = new Tersoff_Batch;
+    batch->has_potential = (potential_file != NULL);
+    batch->use_types = 0;
+    batch->num_types = 1;
+    batch->cutoff = 2.1; // the built-in carbon potential
+    if (potential_file)
+    {
+        if (read_potential(potential_file, batch->potential) != 0)
+        {
+            delete batch;
+            return NULL;
+        }
+        batch->use_types = !batch->potential.is_carbon;
+        batch->num_types = batch->potential.num_types;
+        batch->cutoff = batch->potential.rc;
+    }
+
+    if (num_threads <= 0)
+    {
+#ifdef _OPENMP
+        num_threads = omp_get_max_threads();
+#else
+        num_threads = 1;
+#endif
+    }
+    batch->num_threads = num_threads;
+    batch->generation = 0;
+    batch->num_busy = 0;
+    batch->stop = 0;
+    batch->num_structures = 0;
+    batch->structures = NULL;
+    batch->results = NULL;
+    batch->next = 0;
+    batch->num_errors = 0;
+    batch->workspace = new Tersoff_Workspace[num_threads];
+    batch->workers = new std::thread[num_threads];
+    for (int t = 0; t < num_threads; ++t)
+    {
+        allocate_workspace(batch->workspace[t]);
+        batch->workers[t] = std::thread(run_worker, batch, t);
+    }
+    return batch;
+}
+
+void free_tersoff_batch(Tersoff_Batch *batch)
+{
+    {
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        batch->stop = 1;
+    }
+    batch->start.notify_all();
+    for (int t = 0; t < batch->num_threads; ++t)
+    {
+        batch->workers[t].join();
+        free_workspace(batch->workspace[t]);
+    }
+    delete[] batch->workers;
+    delete[] batch->workspace;
+    if (batch->has_potential) { free_potential(batch->potential); }
+    delete batch;
+}
+
+int get_tersoff_num_types(const Tersoff_Batch *batch)
+{
+    return batch->num_types;
+}
+
+double get_tersoff_cutoff(const Tersoff_Batch *batch)
+{
+    return batch->cutoff;
+}
+
+int evaluate_tersoff_batch
+(
+    Tersoff_Batch *batch, int num_structures,
+    const Tersoff_Structure *structures, Tersoff_Result *results
+)
+{
+    if (num_structures <= 0) { return 0; }
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->num_structures = num_structures;
+    batch->structures = structures;
+    batch->results = results;
+    batch->next = 0;
+    batch->num_errors = 0;
+    batch->num_busy = batch->num_threads;
+    batch->generation++;
+    batch->start.notify_all();
+    batch->finish.wait(lock, [&] { return batch->num_busy == 0; });
+    return batch->num_errors;
+}
+
+const char *get_tersoff_error(int status)
+{
+    switch (status)
+    {
+        case TERSOFF_OK:        return "no error";
+        case TERSOFF_BAD_BOX:   return "non-positive box length or no atoms";
+        case TERSOFF_BAD_TYPE:  return "type out of range";
+        case TERSOFF_TOO_LARGE: return "too many atoms after replication";
+        default:                return "unknown error";
+    }
+}
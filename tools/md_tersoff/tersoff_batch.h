@@ -0,0 +1,83 @@
+/*
+    Batched evaluation of the Tersoff potential for many small structures
+    (e.g., the configurations of a training set or of a structure search),
+    using the force kernels of md_tersoff.cpp.
+
+    1) A batch owns the potential and a pool of worker threads; each
+       structure is evaluated by one thread (the OpenMP parallelism of the
+       kernels is switched off in the workers), and the threads take the
+       structures one by one, such that structures of different sizes are
+       balanced;
+    2) Each worker keeps its neighbor list, bond data, and work arrays 
+       between the calls, and they only grow with the largest structure;
+    3) The box is rectangular; a periodic direction shorter than twice the
+       cutoff is replicated internally, and a free direction can have any
+       length (the particles need not be inside it);
+    4) Units are those of md_tersoff.cpp: Angstrom and eV; the virial is
+       W_ab = - sum over the bonds of r12_a f12_b (as in md_tersoff.cpp),
+       such that the stress is - W / V, and the results do not depend on
+       the number of threads;
+    5) A batch serves one caller at a time: the structures, the results,
+       and the state of the pool are shared by all its threads, so 
+       concurrent calls of evaluate_tersoff_batch on the same batch are 
+       not allowed (use one batch per calling thread instead); different 
+       batches are independent;
+    6) Compile with
+       "g++ -O3 -fopenmp -c tersoff_batch.cpp" and link tersoff_batch.o;
+       "g++ -O3 -fopenmp tersoff_batch_benchmark.cpp tersoff_batch.cpp"
+       builds the benchmark.
+*/
+
+#ifndef TERSOFF_BATCH_H
+#define TERSOFF_BATCH_H
+
+#define TERSOFF_OK        0 // the results are valid
+#define TERSOFF_BAD_BOX   1 // non-positive box length, or no particles
+#define TERSOFF_BAD_TYPE  2 // a type outside [0, number of types)
+#define TERSOFF_TOO_LARGE 3 // too many particles after the replication
+
+struct Tersoff_Batch; // opaque
+
+// one structure (the arrays belong to the caller)
+struct Tersoff_Structure
+{
+    int num_atoms;
+    double box[3];    // rectangular box
+    int pbc[3];       // 1 for periodic and 0 for free boundaries
+    const int *type;  // types (NULL for the built-in carbon potential)
+    const double *x, *y, *z;
+};
+
+// the results for one structure (the arrays belong to the caller)
+struct Tersoff_Result
+{
+    int status;           // TERSOFF_OK or one of the errors above
+    double energy;        // potential energy
+    double virial[9];     // xx, xy, xz, yx, yy, yz, zx, zy, zz
+    double *fx, *fy, *fz; // forces (num_atoms of each)
+    double *energy_atom;  // per-particle potential energy (may be NULL)
+};
+
+// potential_file is a file as for md_tersoff (NULL for the built-in carbon
+// potential); num_threads <= 0 means the number of OpenMP threads; returns 
+// NULL (after printing the reason) for an invalid potential file
+Tersoff_Batch *create_tersoff_batch
+(const char *potential_file, int num_threads);
+
+void free_tersoff_batch(Tersoff_Batch *batch);
+
+// the number of types and the cutoff of the potential
+int get_tersoff_num_types(const Tersoff_Batch *batch);
+double get_tersoff_cutoff(const Tersoff_Batch *batch);
+
+// evaluate the structures in parallel and return the number of structures
+// with errors (the other results are valid)
+int evaluate_tersoff_batch
+(
+    Tersoff_Batch *batch, int num_structures,
+    const Tersoff_Structure *structures, Tersoff_Result *results
+);
+
+const char *get_tersoff_error(int status);
+
+#endif
@@ -0,0 +1,358 @@
+/*
+    Throughput of the batched Tersoff evaluation (see tersoff_batch.h).
+
+    1) Many small graphene cells (1 to 4 by 1 to 3 orthogonal unit cells
+       of 4 atoms, periodic in x and y, with random displacements and, for
+       a multi-species potential, random types) are evaluated with 1, 2,
+       4, ... threads and the structures per second are reported;
+    2) The results are checked to be the same for all numbers of threads,
+       the energy of a cell is compared with that of a 2 x 2 supercell of
+       it, and the virial is compared with the finite difference of the
+       energy with respect to a strain;
+    3) compile with
+       "g++ -O3 -fopenmp tersoff_batch_benchmark.cpp tersoff_batch.cpp"
+       and run with "./a.out" or "./a.out structures=S threads=T
+       potential=FILE" (10000 structures and the OpenMP threads by default).
+*/
+
+#include "tersoff_batch.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <chrono>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+double get_time()
+{
+    return std::chrono::duration<double>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a small reproducible generator (the benchmark only needs some disorder)
+double get_random(unsigned long long &state)
+{
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct Structures
+{
+    int num_structures;
+    Tersoff_Structure *structures;
+    Tersoff_Result *results;
+    int *type;
+    double *x, *y, *z, *fx, *fy, *fz, *energy_atom;
+};
+
+// nx by ny orthogonal graphene cells starting at x[0], y[0], z[0]
+void initialize_graphene
+(int nx, int ny, double *x, double *y, double *z)
+{
+    double a = 1.438;
+    double ax = a * sqrt(3.0), ay = a * 3.0;
+    double x0[4] = {0.0, ax * 0.5, ax * 0.5, 0.0};
+    double y0[4] = {0.0, a * 0.5, a * 1.5, a * 2.0};
+    int n = 0;
+    for (int ix = 0; ix < nx; ++ix)
+    {
+        for (int iy = 0; iy < ny; ++iy)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                x[n] = ix * ax + x0[k];
+                y[n] = iy * ay + y0[k];
+                z[n] = 0.0;
+                n++;
+            }
+        }
+    }
+}
+
+void create_structures(int num_structures, int num_types, Structures &s)
+{
+    unsigned long long state = 12345;
+    double a = 1.438;
+    s.num_structures = num_structures;
+    s.structures = (Tersoff_Structure*)
+        malloc(num_structures * sizeof(Tersoff_Structure));
+    s.results = (Tersoff_Result*)
+        malloc(num_structures * sizeof(Tersoff_Result));
+    int *nx = (int*) malloc(num_structures * sizeof(int));
+    int *ny = (int*) malloc(num_structures * sizeof(int));
+    int N_total = 0;
+    for (int k = 0; k < num_structures; ++k)
+    {
+        nx[k] = 1 + (int) (get_random(state) * 4);
+        ny[k] = 1 + (int) (get_random(state) * 3);
+        N_total += nx[k] * ny[k] * 4;
+    }
+    s.type = (int*) malloc(N_total * sizeof(int));
+    double **arrays[7] =
+    {&s.x, &s.y, &s.z, &s.fx, &s.fy, &s.fz, &s.energy_atom};
+    for (int i = 0; i < 7; ++i)
+    {
+        *arrays[i] = (double*) malloc(N_total * sizeof(double));
+    }
+
+    int offset = 0;
+    for (int k = 0; k < num_structures; ++k)
+    {
+        int N = nx[k] * ny[k] * 4;
+        Tersoff_Structure &t = s.structures[k];
+        t.num_atoms = N;
+        t.box[0] = a * sqrt(3.0) * nx[k];
+        t.box[1] = a * 3.0 * ny[k];
+        t.box[2] = 10.0;
+        t.pbc[0] = t.pbc[1] = 1;
+        t.pbc[2] = 0;
+        t.type = (num_types > 1) ? s.type + offset : NULL;
+        t.x = s.x + offset; t.y = s.y + offset; t.z = s.z + offset;
+        initialize_graphene
+        (nx[k], ny[k], s.x + offset, s.y + offset, s.z + offset);
+        for (int n = offset; n < offset + N; ++n)
+        {
+            s.type[n] = (int) (get_random(state) * num_types);
+            s.x[n] += (get_random(state) - 0.5) * 0.1;
+            s.y[n] += (get_random(state) - 0.5) * 0.1;
+            s.z[n] += (get_random(state) - 0.5) * 0.1;
+        }
+        Tersoff_Result &r = s.results[k];
+        r.fx = s.fx + offset; r.fy = s.fy + offset; r.fz = s.fz + offset;
+        r.energy_atom = s.energy_atom + offset;
+        offset += N;
+    }
+    free(nx); free(ny);
+}
+
+void free_structures(Structures &s)
+{
+    free(s.structures); free(s.results); free(s.type);
+    free(s.x); free(s.y); free(s.z); free(s.fx); free(s.fy); free(s.fz);
+    free(s.energy_atom);
+}
+
+// the largest difference of the energies, forces, and virials
+double compare_results(Structures &s, Tersoff_Result *r0, double *f0)
+{
+    double difference = 0.0;
+    int offset = 0;
+    for (int k = 0; k < s.num_structures; ++k)
+    {
+        Tersoff_Result &r = s.results[k];
+        difference = fmax(difference, fabs(r.energy - r0[k].energy));
+        for (int i = 0; i < 9; ++i)
+        {
+            difference = fmax
+            (difference, fabs(r.virial[i] - r0[k].virial[i]));
+        }
+        for (int n = 0; n < s.structures[k].num_atoms; ++n)
+        {
+            difference = fmax(difference, fabs(r.fx[n] - f0[offset + n]));
+        }
+        offset += s.structures[k].num_atoms;
+    }
+    return difference;
+}
+
+double find_energy(Tersoff_Batch *batch, Tersoff_Structure &s)
+{
+    int N = s.num_atoms;
+    double *f = (double*) malloc(N * 3 * sizeof(double));
+    Tersoff_Result r;
+    r.fx = f; r.fy = f + N; r.fz = f + N * 2;
+    r.energy_atom = NULL;
+    if (evaluate_tersoff_batch(batch, 1, &s, &r) > 0)
+    {
+        printf("Error: %s.\n", get_tersoff_error(r.status));
+        exit(1);
+    }
+    free(f);
+    return r.energy;
+}
+
+// the energy of a structure whose box and positions are strained by
+// (1 + epsilon) in the direction a, displaced in the direction b
+double find_strained_energy
+(
+    Tersoff_Batch *batch, const Tersoff_Structure &s, int a, int b,
+    double epsilon
+)
+{
+    int N = s.num_atoms;
+    double *r = (double*) malloc(N * 3 * sizeof(double));
+    const double *r0[3] = {s.x, s.y, s.z};
+    for (int d = 0; d < 3; ++d)
+    {
+        for (int n = 0; n < N; ++n)
+        {
+            r[d * N + n] = r0[d][n] + (d == b ? epsilon * r0[a][n] : 0.0);
+        }
+    }
+    Tersoff_Structure t = s;
+    t.x = r; t.y = r + N; t.z = r + N * 2;
+    if (a == b) { t.box[a] *= 1.0 + epsilon; }
+    double energy = find_energy(batch, t);
+    free(r);
+    return energy;
+}
+
+// compare W_ab with - dE / d(epsilon_ab) (only the diagonal for a periodic
+// box, as it must stay rectangular)
+void check_virial(Tersoff_Batch *batch, Tersoff_Structure &s, int all)
+{
+    int N = s.num_atoms;
+    double *f = (double*) malloc(N * 3 * sizeof(double));
+    Tersoff_Result r;
+    r.fx = f; r.fy = f + N; r.fz = f + N * 2;
+    r.energy_atom = NULL;
+    evaluate_tersoff_batch(batch, 1, &s, &r);
+    double h = 1.0e-5;
+    double difference = 0.0, largest = 0.0;
+    for (int a = 0; a < 3; ++a)
+    {
+        for (int b = 0; b < 3; ++b)
+        {
+            if (!all && a != b) { continue; }
+            double ep = find_strained_energy(batch, s, a, b, h);
+            double em = find_strained_energy(batch, s, a, b, -h);
+            double w = - (ep - em) / (2.0 * h);
+            difference = fmax(difference, fabs(w - r.virial[a * 3 + b]));
+            largest = fmax(largest, fabs(r.virial[a * 3 + b]));
+        }
+    }
+    printf("virial (%s) vs. finite difference: largest |W| = %g eV, "
+        "largest difference = %g eV\n", all ? "flake, all components" :
+        "periodic cell, diagonal", largest, difference);
+    free(f);
+}
+
+void check_batch(Tersoff_Batch *batch, Structures &s)
+{
+    // a cell and its 2 x 2 supercell
+    Tersoff_Structure &s0 = s.structures[0];
+    int N = s0.num_atoms;
+    double *r = (double*) malloc(N * 4 * 3 * sizeof(double));
+    int *type = (int*) malloc(N * 4 * sizeof(int));
+    int n = 0;
+    for (int ix = 0; ix < 2; ++ix)
+    {
+        for (int iy = 0; iy < 2; ++iy)
+        {
+            for (int n0 = 0; n0 < N; ++n0)
+            {
+                r[n] = s0.x[n0] + ix * s0.box[0];
+                r[N * 4 + n] = s0.y[n0] + iy * s0.box[1];
+                r[N * 8 + n] = s0.z[n0];
+                type[n] = s0.type ? s0.type[n0] : 0;
+                n++;
+            }
+        }
+    }
+    Tersoff_Structure s1 = s0;
+    s1.num_atoms = N * 4;
+    s1.box[0] *= 2.0; s1.box[1] *= 2.0;
+    s1.type = s0.type ? type : NULL;
+    s1.x = r; s1.y = r + N * 4; s1.z = r + N * 8;
+    double e0 = find_energy(batch, s0);
+    double e1 = find_energy(batch, s1);
+    printf("cell of %d atoms: energy = %.10f eV; 2 x 2 supercell: "
+        "energy / 4 = %.10f eV\n", N, e0, e1 * 0.25);
+
+    check_virial(batch, s0, 0);
+    Tersoff_Structure flake = s1; // the supercell without pbc
+    flake.pbc[0] = flake.pbc[1] = 0;
+    check_virial(batch, flake, 1);
+    free(r); free(type);
+}
+
+int main(int argc, char *argv[])
+{
+    int num_structures = 10000;
+    const char *potential_file = NULL;
+#ifdef _OPENMP
+    int max_threads = omp_get_max_threads();
+#else
+    int max_threads = 1;
+#endif
+    for (int k = 1; k < argc; ++k)
+    {
+        if (strncmp(argv[k], "structures=", 11) == 0)
+        {
+            num_structures = atoi(argv[k] + 11);
+        }
+        else if (strncmp(argv[k], "threads=", 8) == 0)
+        {
+            max_threads = atoi(argv[k] + 8);
+        }
+        else if (strncmp(argv[k], "potential=", 10) == 0)
+        {
+            potential_file = argv[k] + 10;
+        }
+        else
+        {
+            printf("Error: unknown argument %s.\n", argv[k]);
+            exit(1);
+        }
+    }
+    if (num_structures < 1 || max_threads < 1)
+    {
+        printf("Error: structures and threads should be positive.\n");
+        exit(1);
+    }
+
+    Tersoff_Batch *batch = create_tersoff_batch(potential_file, 1);
+    if (batch == NULL) { exit(1); } // the reason is printed
+    int num_types = get_tersoff_num_types(batch);
+    Structures s;
+    create_structures(num_structures, num_types, s);
+    int N_total = 0;
+    for (int k = 0; k < num_structures; ++k)
+    {
+        N_total += s.structures[k].num_atoms;
+    }
+    printf("%d structures with %d atoms in total (%d types, cutoff %g A)\n",
+        num_structures, N_total, num_types, get_tersoff_cutoff(batch));
+    check_batch(batch, s);
+
+    // the reference results with one thread
+    if (evaluate_tersoff_batch(batch, num_structures, s.structures, s.results))
+    {
+        printf("Error: %s.\n", get_tersoff_error(s.results[0].status));
+        exit(1);
+    }
+    Tersoff_Result *r0 = (Tersoff_Result*)
+        malloc(num_structures * sizeof(Tersoff_Result));
+    memcpy(r0, s.results, num_structures * sizeof(Tersoff_Result));
+    double *f0 = (double*) malloc(N_total * sizeof(double));
+    memcpy(f0, s.fx, N_total * sizeof(double));
+    free_tersoff_batch(batch);
+
+    printf("threads  structures/s  atoms/s      speedup  difference\n");
+    double rate_1 = 0.0;
+    for (int num_threads = 1; ; num_threads *= 2)
+    {
+        if (num_threads > max_threads) { num_threads = max_threads; }
+        batch = create_tersoff_batch(potential_file, num_threads);
+        double time_best = 1.0e30;
+        for (int repeat = 0; repeat < 3; ++repeat)
+        {
+            double time_begin = get_time();
+            evaluate_tersoff_batch
+            (batch, num_structures, s.structures, s.results);
+            time_best = fmin(time_best, get_time() - time_begin);
+        }
+        free_tersoff_batch(batch);
+        double rate = num_structures / time_best;
+        if (num_threads == 1) { rate_1 = rate; }
+        printf("%7d  %12.0f  %11.0f  %7.2f  %g\n", num_threads, rate,
+            N_total / time_best, rate / rate_1, compare_results(s, r0, f0));
+        if (num_threads == max_threads) { break; }
+    }
+
+    free(r0); free(f0);
+    free_structures(s);
+    return 0;
+}